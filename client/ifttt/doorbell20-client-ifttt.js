@@ -18,6 +18,16 @@
 
 var noble = require('noble');
 var https = require('https');
+var fs = require('fs');
+var DoorBell20Client = require('../lib/doorbell20-client');
+var trace = require('../lib/trace');
+var metrics = require('../lib/metrics');
+var EventStreamServer = require('../lib/event-stream');
+var History = require('../lib/history');
+var Coordinator = require('../lib/redundancy');
+var LivenessMonitor = require('../lib/liveness');
+var RuleEngine = require('../lib/rules');
+var measure = require('../lib/measure');
 
 // The key identifying our IFTTT Maker channel.
 // We read the key as a command line argument. Note that the first
@@ -30,7 +40,7 @@ var iftttKey = process.argv[2];
 var iftttDoorBellEventName = process.argv[4];
 
 // The name of the event sent to the IFTTT Maker channel if the door bell
-// sensor fails (connection timeout).
+// sensor fails (link down, device silent, or battery low).
 // We read the event name as a command line argument. Note that the first
 // argument has the index 2 (0 is always 'node', 1 is the script name).
 var iftttFailureEventName = process.argv[5];
@@ -43,77 +53,105 @@ var iftttFailureEventName = process.argv[5];
 // script name).
 var doorBellDeviceMAC = process.argv[3];
 
-// BLE/GATT UUIDs.
-var doorBellServiceUUID = '451e0001dd1c4f20a42eff91a53d2992';
-var doorBellAlarmCharUUID = '451e0002dd1c4f20a42eff91a53d2992';
-var localtimeCharUUID = '451e0003dd1c4f20a42eff91a53d2992';
-
-// BLE/GATT objects. 
-var doorBellPeripheral = null;
-var doorBellService = null;
-var doorBellAlarmChar = null;
-var doorBellLocaltimeChar = null;
-
-// If the master cannot connect to the peripheral for this amount of time
-// in milliseconds, we assume a permanent error like empty peripheral 
-// batteries. After a timeout, the client will terminate.
-var connectionTimeout = 1000*60*10; // 10 minutes
-var connectionTimeoutTimer = setTimeout(onConnectionTimeout, 
-					connectionTimeout);
-
-function notifyIFTTTFailure() {
-    // Can send up to three values formated as JSON document in request body.
-    var body = JSON.stringify({ "value1" : "Door Bell (" + doorBellDeviceMAC + 
-				")", "value2" : "", "value3" : "" });
-
-    // Request is sent as HTTPS Post request.
-    // The URL has the format:
-    // https://maker.ifttt.com/trigger/{event}/with/key/{key}
-    var httpOptions = {
-	hostname: 'maker.ifttt.com',
-	port: 443,
-	path: '/trigger/' + iftttFailureEventName + "/with/key/" + iftttKey,
-	method: 'POST',
-	headers: {
-	    'Content-Type': 'application/json',
-	    'Content-Length': Buffer.byteLength(body)
-	}
-    };
-
-    var req = https.request(httpOptions, function(res) {
-	console.log('HTTP request to IFTTT Maker channel. Request status: ' + 
-		    res.statusCode);
-	// Exit client after we sent failure notification.
+// Optional arguments following the required ones:
+// --trace <file>: records a trace of all BLE events to this file, e.g., to
+//   replay incidents later (see client/replay).
+// --metrics-port <port>: serves Prometheus metrics at 
+//   http://localhost:<port>/metrics.
+// --stream-port <port>: pushes door bell alarms and connection changes to
+//   local subscribers at http://<gateway>:<port>/events (Server-Sent 
+//   Events, see lib/event-stream.js).
+// --history <dir>: keeps all door bell alarms in this directory (see 
+//   lib/history.js).
+// --history-port <port>: serves queries of the history at 
+//   http://localhost:<port>.
+// --redundancy <priority>: runs as one of several redundant gateways, which
+//   elect the gateway connecting to the device over UDP multicast (see 
+//   lib/redundancy.js). Gateways with higher priority are preferred.
+// --redundancy-interface <address>: address of the network interface used
+//   for multicast.
+// --suspicion <fraction>: a failure is reported if the device has not been
+//   connected or has not sent a heartbeat for this fraction of the 
+//   heartbeat interval (default: 0.5; see lib/liveness.js).
+// --battery-low <percent>: battery level reported as low (default: 20).
+// --rules <file>: acts on events by the local rules in this JSON file (see 
+//   lib/rules.js) instead of sending all events to IFTTT. Rules can use 
+//   IFTTT as sink of type 'ifttt' with optional property 'event' (default: 
+//   the event name of the door bell alarm resp. the failure).
+var traceFile = null;
+var metricsPort = null;
+var streamPort = null;
+var historyDir = null;
+var historyPort = null;
+var redundancyPriority = null;
+var redundancyInterface;
+var livenessOptions = {};
+var rulesFile = null;
+for (var i = 6; i < process.argv.length; i += 2) {
+    if (process.argv[i] === '--trace') {
+	traceFile = process.argv[i + 1];
+    } else if (process.argv[i] === '--metrics-port') {
+	metricsPort = Number(process.argv[i + 1]);
+    } else if (process.argv[i] === '--stream-port') {
+	streamPort = Number(process.argv[i + 1]);
+    } else if (process.argv[i] === '--history') {
+	historyDir = process.argv[i + 1];
+    } else if (process.argv[i] === '--history-port') {
+	historyPort = Number(process.argv[i + 1]);
+    } else if (process.argv[i] === '--redundancy') {
+	redundancyPriority = Number(process.argv[i + 1]);
+    } else if (process.argv[i] === '--redundancy-interface') {
+	redundancyInterface = process.argv[i + 1];
+    } else if (process.argv[i] === '--suspicion') {
+	livenessOptions.suspicion = Number(process.argv[i + 1]);
+    } else if (process.argv[i] === '--battery-low') {
+	livenessOptions.batteryLowLevel = Number(process.argv[i + 1]);
+    } else if (process.argv[i] === '--rules') {
+	rulesFile = process.argv[i + 1];
+    } else {
+	console.log('Unknown option: ' + process.argv[i]);
 	process.exit(-1);
-    });
-    req.on('error', function(e) {
-	console.log('HTTP request error: ' + e.message);
-    });
-    req.write(body);
-    req.end();
+    }
 }
 
-function onConnectionTimeout() {
-    console.log('Connection timeout.');
+// The client uses noble as BLE transport. Redundant gateways subscribe to
+// indications, so the device keeps alarms not confirmed by a failing
+// gateway for the gateway taking over.
+var transport = traceFile ? new trace.TraceRecorder(noble, traceFile) : noble;
+var client = new DoorBell20Client(transport, [doorBellDeviceMAC],
+				  { acknowledged: redundancyPriority !== null });
 
-    // Bail out since we are not able to connect to peripheral.
-    notifyIFTTTFailure();
+// Failures of the device are detected from its heartbeats.
+var liveness = new LivenessMonitor(client, livenessOptions);
+
+var gatewayMetrics = null;
+if (metricsPort) {
+    gatewayMetrics = new metrics.GatewayMetrics(client);
+    gatewayMetrics.registry.listen(metricsPort);
 }
 
-noble.on('stateChange', function(state) {
-    if (state === 'poweredOn') {
-	// Before scanning, we must wait for the device to be powered on. 
-	console.log('Scanning started.');
-	noble.startScanning([doorBellServiceUUID], false);
-    } else {
-	console.log('Scanning stopped.');
-	noble.stopScanning();
-    }
-})
+var eventStream = null;
+if (streamPort) {
+    eventStream = new EventStreamServer();
+    eventStream.listen(streamPort);
+    eventStream.on('slow', function(remoteAddress) {
+	console.log('Disconnected slow event stream subscriber ' + 
+		    remoteAddress);
+    });
+}
+
+var history = null;
+if (historyDir) {
+    history = new History(historyDir);
+    if (historyPort)
+	history.listen(historyPort);
+}
 
-function notifyIFTTT(dateStr) {
+// Triggers an event of the IFTTT Maker channel and calls back with the 
+// HTTP status code, or null if the request failed.
+function requestIFTTT(eventName, value1, value2, callback) {
     // Can send up to three values formated as JSON document in request body.
-    var body = JSON.stringify({ "value1" : dateStr, "value2" : "", 
+    var body = JSON.stringify({ "value1" : value1, "value2" : value2, 
 				"value3" : "" });
 
     // Request is sent as HTTPS Post request.
@@ -122,7 +160,7 @@ function notifyIFTTT(dateStr) {
     var httpOptions = {
 	hostname: 'maker.ifttt.com',
 	port: 443,
-	path: '/trigger/' + iftttDoorBellEventName + "/with/key/" + iftttKey,
+	path: '/trigger/' + eventName + "/with/key/" + iftttKey,
 	method: 'POST',
 	headers: {
 	    'Content-Type': 'application/json',
@@ -133,97 +171,210 @@ function notifyIFTTT(dateStr) {
     var req = https.request(httpOptions, function(res) {
 	console.log('HTTP request to IFTTT Maker channel. Request status: ' + 
 		    res.statusCode);
+	// Consume the response to free the socket.
+	res.resume();
+	callback(res.statusCode);
     });
     req.on('error', function(e) {
 	console.log('HTTP request error: ' + e.message);
+	callback(null);
     });
     req.write(body);
     req.end();
 }
 
-function onDoorBellAlarmCharNotification(data, isNotification) {
-    console.log('Door bell alarm notification.');
-    // Send event notification to IFTTT via HTTP request.
-    var now = new Date();
-    var dateStr = now.toLocaleString();
-    console.log(dateStr);
-    notifyIFTTT(dateStr);
+// The client keeps reconnecting after failures, so it keeps running.
+function notifyIFTTTFailure(reason) {
+    requestIFTTT(iftttFailureEventName, 
+		 "Door Bell (" + doorBellDeviceMAC + ")", reason, 
+		 function() {});
 }
 
-function onCharDiscovered(err, characteristics) {
-    characteristics.forEach(function(characteristic) {
-	if (characteristic.uuid === doorBellAlarmCharUUID) {
-	    doorBellAlarmChar = characteristic;
-	} else if (characteristic.uuid === localtimeCharUUID) {
-	    doorBellLocaltimeChar = characteristic;
-	}
-    });
-    
-    if (!doorBellAlarmChar || !doorBellLocaltimeChar) {
-	console.log('Missing characteristic.');
+// Reasons of failures reported by liveness and battery events.
+function failureReason(event) {
+    if (event.type === 'battery')
+	return event.data.isLow ? 'battery low (' + event.data.level + ' %)' :
+	    'battery ok';
+    return event.data.state === 'link-down' ? 'link down' : 
+	event.data.state === 'silent' ? 'device silent' : event.data.state;
+}
+
+// Sink type 'ifttt' of the rules. Alarms and ring patterns are sent like
+// door bell alarms with the name of the rule as value2, liveness and 
+// battery events like failures.
+function createIFTTTSink(config) {
+    return function(ruleName, event, callback) {
+	if (event.type === 'liveness' || event.type === 'battery')
+	    requestIFTTT(config.event || iftttFailureEventName, 
+			 "Door Bell (" + event.device + ")", 
+			 failureReason(event), callback);
+	else
+	    requestIFTTT(config.event || iftttDoorBellEventName, 
+			 new Date(event.time).toLocaleString(), ruleName, 
+			 callback);
+    };
+}
+
+var rules = null;
+if (rulesFile) {
+    try {
+	rules = new RuleEngine(JSON.parse(fs.readFileSync(rulesFile)), 
+			       { sinkTypes: { ifttt: createIFTTTSink } });
+    } catch (err) {
+	console.log('Invalid rules: ' + err.message);
 	process.exit(-1);
     }
+    rules.on('action', function(ruleName, sinkName, event, status, start, 
+				end) {
+	var isOk = status === 0 || (status >= 200 && status < 300);
 
-    // Required characteristcs are all available.
-    console.log('Discovered all required characteristics.');
-
-    // Subscribe for door bell alarm notifications.
-    doorBellAlarmChar.on('read', onDoorBellAlarmCharNotification);
-    doorBellAlarmChar.subscribe(function(err) {
-	if (err) {
-	    console.log('Could not subscribe to door bell alarm ' +
-			'characteristic.');
-	} else {
-	    console.log('Subscribed to door bell alarm characteristic.');
-	    // Stop disconnection timer to avoid disconnection timeout
-	    // while actually being connected.
-	    clearTimeout(connectionTimeoutTimer);
+	console.log('Rule ' + ruleName + ': ' + sinkName + ' ' + 
+		    (status !== null ? status : 'failed') + ' (' + 
+		    (end - start).toFixed(0) + ' ms)');
+	if (gatewayMetrics && event.type === 'alarm') {
+	    gatewayMetrics.sinkRequest(sinkName, event.data, start, end, 
+				       status);
+	    if (!isOk)
+		gatewayMetrics.sinkDropped(sinkName);
 	}
     });
 }
 
-function onServicesDiscovered(err, services) {
-    if (err) {
-	console.log('Could not discover services.');
-    } else {
-	console.log('Discovered DoorBell20 service');
-	// There is exactly one service matching the requested UUID.
-	doorBellService = services[0];
-	doorBellService.discoverCharacteristics([], onCharDiscovered);
-    }
-}
-
-function onPeripheralDisconnected() {
-    console.log('Disconnected');
+// Passes an event to the rules; alarms happen at the time of the ring if
+// the device has wall-clock time.
+function handleRules(type, address, data) {
+    var time = type === 'alarm' && data.isWallclock ? data.time*1000 : 
+	Date.now();
 
-    // Start disconnection timer to detect permanent problems in re-connecting
-    // to the peripheral.
-    connectionTimeoutTimer = setTimeout(onConnectionTimeout, 
-					connectionTimeout);
+    rules.handle({ type: type, device: address, time: time, data: data });
 }
 
-function onPeripheralConnected(err)  {
-    if (err) {
-	console.log('Could not connect to DoorBell20 device.');
-    } else {
-	console.log('Connected to peripheral.');
-	doorBellPeripheral.once('disconnect', onPeripheralDisconnected);
-	doorBellPeripheral.discoverServices([doorBellServiceUUID], 
-					    onServicesDiscovered);
+function onLivenessState(address, state, previousState) {
+    console.log('Device ' + state + '.');
+    if (eventStream)
+	eventStream.publish('liveness', { device: address, state: state });
+    if (rules) {
+	handleRules('liveness', address, { state: state, 
+					   previousState: previousState });
+	return;
     }
+    if (state === 'link-down')
+	notifyIFTTTFailure('link down');
+    else if (state === 'silent')
+	notifyIFTTTFailure('device silent');
 }
 
-noble.on('discover', function(peripheral) {
-    console.log('found peripheral: ', peripheral.advertisement);
+function onBattery(address, isLow, heartbeat) {
+    console.log('Battery ' + (isLow ? 'low' : 'ok') + ': ' + 
+		heartbeat.batteryLevel + ' %');
+    if (eventStream)
+	eventStream.publish('battery', { device: address, isLow: isLow, 
+					 level: heartbeat.batteryLevel, 
+					 mv: heartbeat.batteryMv });
+    if (rules) {
+	handleRules('battery', address, { isLow: isLow, 
+					  level: heartbeat.batteryLevel, 
+					  mv: heartbeat.batteryMv });
+	return;
+    }
+    if (isLow)
+	notifyIFTTTFailure('battery low (' + heartbeat.batteryLevel + ' %)');
+}
 
-    if (peripheral.address === doorBellDeviceMAC) {
-	// We found our DoorBell20 device implementing the DoorBell20 service.
-	console.log('Found DoorBell20 device.');
-	doorBellPeripheral = peripheral;
+function notifyIFTTT(dateStr, alarm) {
+    var requestStart = measure.now();
 
-	noble.stopScanning();
+    requestIFTTT(iftttDoorBellEventName, dateStr, "", function(status) {
+	if (gatewayMetrics) {
+	    gatewayMetrics.sinkRequest('ifttt', alarm, requestStart, 
+				       measure.now(), status);
+	    if (status !== 200)
+		gatewayMetrics.sinkDropped('ifttt');
+	}
+    });
+}
 
-	peripheral.connect(onPeripheralConnected);
+function onDoorBellAlarm(address, alarm) {
+    console.log('Door bell alarm notification.');
+    // Alarms sent again after a failover might have been delivered by 
+    // another gateway.
+    if (coordinator && coordinator.isDuplicate(address, alarm)) {
+	console.log('Duplicate alarm dropped.');
+	return;
     }
-})
-   
+    // Local subscribers are notified first, since they do not have to wait
+    // for a request to the Internet.
+    if (eventStream)
+	eventStream.publish('alarm', { device: address, time: alarm.time, 
+				       inputs: alarm.inputs, 
+				       isWallclock: alarm.isWallclock });
+    if (history)
+	history.append(address, alarm, Date.now());
+    // Local rules decide whether IFTTT is notified.
+    if (rules) {
+	handleRules('alarm', address, alarm);
+	return;
+    }
+    // Send event notification to IFTTT via HTTP request. Alarms carry 
+    // wall-clock time if the gateway has set the time of the device; 
+    // otherwise, the time of the client machine is used.
+    var date = alarm.isWallclock ? new Date(alarm.time*1000) : new Date();
+    var dateStr = date.toLocaleString();
+    console.log(dateStr);
+    notifyIFTTT(dateStr, alarm);
+}
+
+client.on('alarm', onDoorBellAlarm);
+client.on('pattern', function(address, pattern) {
+    if (eventStream)
+	eventStream.publish('pattern', { device: address, 
+					 presses: pattern.presses, 
+					 durations: pattern.durations, 
+					 input: pattern.input });
+    if (rules)
+	handleRules('pattern', address, pattern);
+});
+liveness.on('state', onLivenessState);
+liveness.on('battery', onBattery);
+client.on('connected', function(address) {
+    console.log('Subscribed to door bell alarm characteristic.');
+    if (eventStream)
+	eventStream.publish('status', { device: address, connected: true });
+});
+client.on('disconnected', function(address) {
+    console.log('Disconnected');
+    if (eventStream)
+	eventStream.publish('status', { device: address, connected: false });
+});
+client.on('wallclock', function(address) {
+    console.log('Wall-clock time of door bell set.');
+});
+client.on('warning', function(address, message) {
+    console.log(message);
+});
+
+// With redundant gateways, the client only runs on the active gateway.
+var coordinator = null;
+if (redundancyPriority !== null) {
+    coordinator = new Coordinator({ priority: redundancyPriority, 
+				    interface: redundancyInterface });
+    // Only the active gateway monitors the device, so a gateway standing
+    // by does not report the device as failed.
+    coordinator.on('active', function() {
+	console.log('Active gateway.');
+	liveness.start();
+	client.start();
+    });
+    coordinator.on('standby', function() {
+	console.log('Standby gateway.');
+	client.stop();
+	liveness.stop();
+    });
+    coordinator.on('warning', function(message) {
+	console.log(message);
+    });
+    coordinator.start();
+} else {
+    liveness.start();
+    client.start();
+}
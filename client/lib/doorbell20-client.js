@@ -0,0 +1,571 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Gateway side of the DoorBell20 service: finds DoorBell20 devices, keeps
+// them connected, subscribes to door bell alarms, and emits the received
+// alarms.
+//
+// The BLE transport is passed in by the application. Any object
+// implementing the subset of the noble API used here can be used, i.e.,
+// noble itself or the simulated transport of sim-transport.js:
+//
+// * transport.state, event 'stateChange' (state)
+// * transport.startScanning(serviceUUIDs, allowDuplicates),
+//   transport.stopScanning()
+// * event 'discover' (peripheral)
+// * peripheral.address, peripheral.connect(callback(err)),
+//   peripheral.disconnect(), event 'disconnect' (HCI reason code)
+// * peripheral.discoverServices(serviceUUIDs, callback(err, services))
+// * service.discoverCharacteristics(charUUIDs,
+//   callback(err, characteristics))
+// * characteristic.uuid, characteristic.properties,
+//   characteristic.subscribe(callback(err)),
+//   characteristic.write(data, withoutResponse, callback(err)),
+//   characteristic.discoverDescriptors(callback(err, descriptors)),
+//   event 'read' (data, isNotification)
+// * descriptor.uuid, descriptor.writeValue(data, callback(err))
+
+var events = require('events');
+var util = require('util');
+var now = require('./measure').now;
+
+// BLE/GATT UUIDs.
+var doorBellServiceUUID = '451e0001dd1c4f20a42eff91a53d2992';
+var doorBellAlarmCharUUID = '451e0002dd1c4f20a42eff91a53d2992';
+var localtimeCharUUID = '451e0003dd1c4f20a42eff91a53d2992';
+var heartbeatCharUUID = '451e000add1c4f20a42eff91a53d2992';
+var ringPatternCharUUID = '451e0005dd1c4f20a42eff91a53d2992';
+var wallclockCharUUID = '451e0009dd1c4f20a42eff91a53d2992';
+var cccdUUID = '2902';
+
+// CCCD value subscribing to indications.
+var CCCD_INDICATION = 0x0002;
+
+// Flags of the door bell alarm.
+var ALARM_FLAG_WALLCLOCK = 0x01;
+
+// Flags of the ring pattern.
+var RING_PATTERN_FLAG_OVERFLOW = 0x01;
+var RING_PATTERN_FLAG_TRUNCATED = 0x02;
+var RING_PATTERN_INPUT_SHIFT = 5;
+// Unit of the durations of the ring pattern [ms].
+var RING_PATTERN_UNIT = 10;
+
+// Parses a door bell alarm characteristic value. The released firmware
+// monitors a single input and sends only the time of the alarm (4 bytes);
+// inputs is 1 (input 0) then. Alarms without flags carry local time, and
+// alarms without sequence number have seq null. Returns null for invalid
+// values.
+function parseAlarm(data) {
+    var flags = data.length > 5 ? data.readUInt8(5) : 0;
+
+    if (data.length < 4)
+	return null;
+
+    return {
+	time: data.readUInt32LE(0),
+	inputs: data.length > 4 ? data.readUInt8(4) : 1,
+	isWallclock: (flags & ALARM_FLAG_WALLCLOCK) !== 0,
+	seq: data.length >= 8 ? data.readUInt16LE(6) : null
+    };
+}
+
+// Creates a wall-clock characteristic value for the given time [ms since
+// 1970]: seconds (4 bytes), milliseconds (2 bytes), and the drift estimate
+// of the device (2 bytes), which is ignored when written.
+function formatWallclock(time) {
+    var data = Buffer.alloc(8);
+
+    data.writeUInt32LE(Math.floor(time/1000), 0);
+    data.writeUInt16LE(time % 1000, 4);
+    data.writeInt16LE(0, 6);
+
+    return data;
+}
+
+// Parses a heartbeat characteristic value. Returns null for invalid values.
+function parseHeartbeat(data) {
+    if (data.length < 7)
+	return null;
+
+    return {
+	seq: data.readUInt16LE(0),
+	// Heartbeat interval [s].
+	interval: data.readUInt16LE(2),
+	batteryMv: data.readUInt16LE(4),
+	// Battery level [%].
+	batteryLevel: data.readUInt8(6)
+    };
+}
+
+// Parses a ring pattern characteristic value. Durations [ms] alternate
+// between presses and gaps, starting and ending with a press. Returns null
+// for invalid values and for the empty pattern read before the first ring.
+function parseRingPattern(data) {
+    var durations = [];
+    var flags, i, duration;
+
+    if (data.length < 2 || data.readUInt8(0) === 0)
+	return null;
+
+    flags = data.readUInt8(1);
+    for (i = 2; i < data.length; i++) {
+	duration = data.readUInt8(i);
+	// Long durations take two bytes with the most significant bit set.
+	if (duration & 0x80) {
+	    if (++i >= data.length)
+		return null;
+	    duration = ((duration & 0x7f) << 8) | data.readUInt8(i);
+	}
+	durations.push(duration * RING_PATTERN_UNIT);
+    }
+    if (durations.length % 2 !== 1)
+	return null;
+
+    return {
+	presses: data.readUInt8(0),
+	durations: durations,
+	input: flags >> RING_PATTERN_INPUT_SHIFT,
+	// More presses than recorded in durations.
+	isOverflow: (flags & RING_PATTERN_FLAG_OVERFLOW) !== 0,
+	// The last press lasted longer than recorded.
+	isTruncated: (flags & RING_PATTERN_FLAG_TRUNCATED) !== 0
+    };
+}
+
+// Creates a client for the DoorBell20 devices with the given MAC addresses
+// (format 'f3:23:0d:4c:ce:1b').
+//
+// Options:
+// * connectionTimeout: if a device is not connected and subscribed for
+//   this time [ms], event 'timeout' is emitted (default: 10 min).
+// * reconnectDelay: delay before connecting again after a failed
+//   connection attempt or disconnect [ms] (default: 1 s).
+// * acknowledged: subscribe to indications of door bell alarms instead of
+//   notifications (acknowledged delivery), so the device keeps alarms
+//   until the client has confirmed them; the transport confirms
+//   indications (default: false). Devices without indications are
+//   subscribed to notifications.
+// * wallclockInterval: the wall-clock time of a device is written after
+//   subscribing and then with this interval [ms] while connected (default:
+//   6 h; 0: never). The device only accepts the time over an encrypted link
+//   from its bonded peer, so the transport must pair on demand (noble does
+//   when the write fails with insufficient authentication). The device
+//   estimates its clock drift from writes at least one day apart.
+//
+// Events:
+// * 'connected' (address, timing): subscribed to door bell alarms. Timing
+//   gives the durations [ms] of the successful connection attempt
+//   (connect), of service discovery and subscribing (discovery), and the
+//   time since the device has been disconnected (reconnect; null for the
+//   first connection).
+// * 'disconnected' (address, reason): reason is the HCI reason code, if
+//   the transport provides it.
+// * 'alarm' (address, alarm): door bell alarm; see parseAlarm(). The
+//   alarm also carries the time of reception (receivedAt, see
+//   measure.now()).
+// * 'heartbeat' (address, heartbeat): heartbeat of a device; see
+//   parseHeartbeat(). Devices with older firmware send no heartbeats
+//   (device.hasHeartbeat is not set after connecting).
+// * 'pattern' (address, pattern): ring pattern, sent by the device when a
+//   ring has ended; see parseRingPattern().
+// * 'wallclock' (address): the wall-clock time of a device was written.
+// * 'retry' (address): connecting again after a failure or disconnect.
+// * 'dropped' (address, reason): an invalid notification was dropped.
+// * 'timeout' (address): see option connectionTimeout.
+// * 'warning' (address, message): errors that are handled by
+//   reconnecting, and failed writes of the wall-clock time.
+function DoorBell20Client(transport, addresses, options) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.transport = transport;
+    this.connectionTimeout = options.connectionTimeout || 1000*60*10;
+    this.reconnectDelay = options.reconnectDelay || 1000;
+    this.isAcknowledged = options.acknowledged || false;
+    this.wallclockInterval = options.wallclockInterval !== undefined ?
+	options.wallclockInterval : 1000*60*60*6;
+    // Incremented by stop(), so callbacks of earlier runs can be ignored.
+    this.generation = 0;
+
+    // State per device, indexed by address.
+    this.devices = {};
+    addresses.forEach(function(address) {
+	self.devices[address] = {
+	    address: address,
+	    peripheral: null,
+	    isConnected: false,
+	    hasHeartbeat: false,
+	    timeoutTimer: null,
+	    retryTimer: null,
+	    wallclockTimer: null,
+	    onDisconnect: null,
+	    // Start of the current connection attempt and of the discovery,
+	    // and time of the last disconnect (see measure.now()).
+	    connectStart: 0,
+	    discoveryStart: 0,
+	    disconnectTime: null
+	};
+    });
+
+    this.onDiscover = function(peripheral) {
+	self.handleDiscover(peripheral);
+    };
+    this.onStateChange = function(state) {
+	self.handleStateChange(state);
+    };
+}
+
+util.inherits(DoorBell20Client, events.EventEmitter);
+
+DoorBell20Client.prototype.start = function() {
+    var self = this;
+
+    Object.keys(this.devices).forEach(function(address) {
+	self.startTimeoutTimer(self.devices[address]);
+    });
+
+    this.transport.on('discover', this.onDiscover);
+    this.transport.on('stateChange', this.onStateChange);
+    if (this.transport.state === 'poweredOn')
+	this.handleStateChange('poweredOn');
+};
+
+// Disconnects all devices and stops scanning. The client can be started
+// again.
+DoorBell20Client.prototype.stop = function() {
+    var self = this;
+
+    this.generation++;
+    this.transport.removeListener('discover', this.onDiscover);
+    this.transport.removeListener('stateChange', this.onStateChange);
+    this.transport.stopScanning();
+
+    Object.keys(this.devices).forEach(function(address) {
+	var device = self.devices[address];
+
+	clearTimeout(device.timeoutTimer);
+	clearTimeout(device.retryTimer);
+	clearTimeout(device.wallclockTimer);
+	if (device.peripheral) {
+	    device.peripheral.removeListener('disconnect', device.onDisconnect);
+	    device.peripheral.disconnect();
+	    device.peripheral = null;
+	}
+	device.isConnected = false;
+	device.disconnectTime = null;
+    });
+};
+
+DoorBell20Client.prototype.startTimeoutTimer = function(device) {
+    var self = this;
+
+    clearTimeout(device.timeoutTimer);
+    device.timeoutTimer = setTimeout(function() {
+	self.emit('timeout', device.address);
+    }, this.connectionTimeout);
+};
+
+DoorBell20Client.prototype.isScanComplete = function() {
+    var self = this;
+
+    return Object.keys(this.devices).every(function(address) {
+	return self.devices[address].peripheral !== null;
+    });
+};
+
+DoorBell20Client.prototype.handleStateChange = function(state) {
+    if (state === 'poweredOn') {
+	// Before scanning, we must wait for the adapter to be powered on.
+	if (!this.isScanComplete())
+	    this.transport.startScanning([doorBellServiceUUID], false);
+    } else {
+	this.transport.stopScanning();
+    }
+};
+
+DoorBell20Client.prototype.handleDiscover = function(peripheral) {
+    var device = this.devices[peripheral.address];
+
+    // Several DoorBell20 devices might be in range, so the service UUID
+    // is not enough to find our devices.
+    if (!device || device.peripheral)
+	return;
+
+    device.peripheral = peripheral;
+    device.onDisconnect = this.handleDisconnect.bind(this, device);
+    peripheral.on('disconnect', device.onDisconnect);
+    if (this.isScanComplete())
+	this.transport.stopScanning();
+
+    this.connect(device);
+};
+
+DoorBell20Client.prototype.connect = function(device) {
+    var self = this;
+    var generation = this.generation;
+    var peripheral = device.peripheral;
+
+    device.connectStart = now();
+    peripheral.connect(function(err) {
+	if (generation !== self.generation) {
+	    // Stopped while connecting.
+	    if (!err)
+		peripheral.disconnect();
+	} else if (err) {
+	    self.emit('warning', device.address, 'Could not connect.');
+	    self.retry(device);
+	} else {
+	    device.discoveryStart = now();
+	    self.discover(device);
+	}
+    });
+};
+
+DoorBell20Client.prototype.retry = function(device) {
+    var self = this;
+
+    this.emit('retry', device.address);
+    device.retryTimer = setTimeout(function() {
+	self.connect(device);
+    }, this.reconnectDelay);
+};
+
+// Drops a link that cannot be used; the device is connected again after
+// the disconnect.
+DoorBell20Client.prototype.fail = function(device, message) {
+    this.emit('warning', device.address, message);
+    device.peripheral.disconnect();
+};
+
+DoorBell20Client.prototype.discover = function(device) {
+    var self = this;
+    var generation = this.generation;
+    var peripheral = device.peripheral;
+
+    peripheral.discoverServices([doorBellServiceUUID], function(err, services) {
+	if (generation !== self.generation)
+	    return;
+	if (err || services.length === 0) {
+	    self.fail(device, 'Could not discover services.');
+	    return;
+	}
+	// There is exactly one service matching the requested UUID.
+	services[0].discoverCharacteristics([], function(err, chars) {
+	    if (generation !== self.generation)
+		return;
+	    if (err) {
+		self.fail(device, 'Could not discover characteristics.');
+		return;
+	    }
+	    self.subscribe(device, chars);
+	});
+    });
+};
+
+DoorBell20Client.prototype.subscribe = function(device, chars) {
+    var self = this;
+    var generation = this.generation;
+    var alarmChar = null;
+    var localtimeChar = null;
+    var heartbeatChar = null;
+    var ringPatternChar = null;
+    var wallclockChar = null;
+
+    chars.forEach(function(characteristic) {
+	if (characteristic.uuid === doorBellAlarmCharUUID)
+	    alarmChar = characteristic;
+	else if (characteristic.uuid === localtimeCharUUID)
+	    localtimeChar = characteristic;
+	else if (characteristic.uuid === heartbeatCharUUID)
+	    heartbeatChar = characteristic;
+	else if (characteristic.uuid === ringPatternCharUUID)
+	    ringPatternChar = characteristic;
+	else if (characteristic.uuid === wallclockCharUUID)
+	    wallclockChar = characteristic;
+    });
+
+    if (!alarmChar || !localtimeChar) {
+	this.fail(device, 'Missing characteristic.');
+	return;
+    }
+
+    // Characteristics are discovered again on every connection, so the
+    // listener is added once per characteristic object.
+    alarmChar.on('read', function(data, isNotification) {
+	var alarm;
+
+	if (!isNotification)
+	    return;
+	alarm = parseAlarm(data);
+	if (alarm) {
+	    alarm.receivedAt = now();
+	    self.emit('alarm', device.address, alarm);
+	} else {
+	    self.emit('dropped', device.address, 'invalid alarm');
+	}
+    });
+    this.subscribeAlarms(alarmChar, function(err) {
+	var t = now();
+	var timing;
+
+	if (generation !== self.generation)
+	    return;
+	if (err) {
+	    self.fail(device,
+		      'Could not subscribe to door bell alarm characteristic.');
+	    return;
+	}
+
+	timing = {
+	    connect: device.discoveryStart - device.connectStart,
+	    discovery: t - device.discoveryStart,
+	    reconnect: device.disconnectTime !== null ?
+		t - device.disconnectTime : null
+	};
+
+	// Stop the timeout timer while actually being connected.
+	clearTimeout(device.timeoutTimer);
+	device.isConnected = true;
+	device.hasHeartbeat = heartbeatChar !== null;
+	device.disconnectTime = null;
+	self.emit('connected', device.address, timing);
+	// The device sends the first heartbeat right after subscribing.
+	if (heartbeatChar)
+	    self.subscribeOptional(device, heartbeatChar, parseHeartbeat,
+				   'heartbeat');
+	if (ringPatternChar)
+	    self.subscribeOptional(device, ringPatternChar, parseRingPattern,
+				   'pattern');
+	if (wallclockChar && self.wallclockInterval > 0)
+	    self.writeWallclock(device, wallclockChar);
+    });
+};
+
+// Writes the wall-clock time of a device, and again after
+// wallclockInterval while the link is up. Failures do not drop the link,
+// since alarms are still delivered with local time.
+DoorBell20Client.prototype.writeWallclock = function(device, characteristic) {
+    var self = this;
+    var generation = this.generation;
+    var peripheral = device.peripheral;
+
+    characteristic.write(formatWallclock(Date.now()), false, function(err) {
+	if (generation !== self.generation || !device.isConnected ||
+	    device.peripheral !== peripheral)
+	    return;
+	if (err)
+	    self.emit('warning', device.address,
+		      'Could not write wall-clock time.');
+	else
+	    self.emit('wallclock', device.address);
+	clearTimeout(device.wallclockTimer);
+	device.wallclockTimer = setTimeout(function() {
+	    self.writeWallclock(device, characteristic);
+	}, self.wallclockInterval);
+    });
+};
+
+// Subscribes to door bell alarms. noble's subscribe() always prefers
+// notifications, so indications are subscribed to by writing the CCCD.
+DoorBell20Client.prototype.subscribeAlarms = function(alarmChar, callback) {
+    var data;
+
+    if (!this.isAcknowledged || !alarmChar.properties ||
+	alarmChar.properties.indexOf('indicate') < 0) {
+	alarmChar.subscribe(callback);
+	return;
+    }
+
+    data = Buffer.alloc(2);
+    data.writeUInt16LE(CCCD_INDICATION, 0);
+    alarmChar.discoverDescriptors(function(err, descriptors) {
+	var cccd = null;
+
+	if (!err) {
+	    descriptors.forEach(function(descriptor) {
+		if (descriptor.uuid === cccdUUID)
+		    cccd = descriptor;
+	    });
+	}
+	if (!cccd) {
+	    callback(err || new Error('Missing CCCD.'));
+	    return;
+	}
+	cccd.writeValue(data, callback);
+    });
+};
+
+// Subscribes to a characteristic that older firmware might not provide.
+// Its notifications are parsed with parse() and emitted as eventName.
+DoorBell20Client.prototype.subscribeOptional = function(device,
+							characteristic,
+							parse, eventName) {
+    var self = this;
+    var generation = this.generation;
+
+    characteristic.on('read', function(data, isNotification) {
+	var value;
+
+	if (!isNotification)
+	    return;
+	value = parse(data);
+	if (value) {
+	    value.receivedAt = now();
+	    self.emit(eventName, device.address, value);
+	} else {
+	    self.emit('dropped', device.address, 'invalid ' + eventName);
+	}
+    });
+    characteristic.subscribe(function(err) {
+	if (generation !== self.generation)
+	    return;
+	if (err)
+	    self.fail(device, 'Could not subscribe to ' + eventName +
+		      ' characteristic.');
+    });
+};
+
+DoorBell20Client.prototype.handleDisconnect = function(device, reason) {
+    // Failed discoveries also end with a disconnect; the time to reconnect
+    // is measured from the loss of the last subscribed link.
+    if (device.isConnected)
+	device.disconnectTime = now();
+    device.isConnected = false;
+    clearTimeout(device.wallclockTimer);
+    this.emit('disconnected', device.address, reason);
+
+    // The timeout timer detects permanent problems in re-connecting to the
+    // device. The device advertises again after a disconnect.
+    this.startTimeoutTimer(device);
+    this.retry(device);
+};
+
+module.exports = DoorBell20Client;
+module.exports.parseAlarm = parseAlarm;
+module.exports.parseHeartbeat = parseHeartbeat;
+module.exports.parseRingPattern = parseRingPattern;
+module.exports.formatWallclock = formatWallclock;
+module.exports.doorBellServiceUUID = doorBellServiceUUID;
+module.exports.doorBellAlarmCharUUID = doorBellAlarmCharUUID;
+module.exports.localtimeCharUUID = localtimeCharUUID;
+module.exports.heartbeatCharUUID = heartbeatCharUUID;
+module.exports.ringPatternCharUUID = ringPatternCharUUID;
+module.exports.wallclockCharUUID = wallclockCharUUID;
@@ -0,0 +1,218 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Local push stream of gateway events using Server-Sent Events (SSE).
+//
+// Local consumers (wall tablets, chimes, video recorders) subscribe with a
+// GET request to /events and receive every event published by the
+// gateway. Each event is serialized once and written to all subscribers
+// right away, so the stream adds little delay to the BLE notification.
+// Browsers support SSE natively (EventSource); other consumers only need
+// an HTTP client.
+//
+// Events carry increasing ids, starting with the time of the gateway
+// start in ms, so ids also increase across restarts. The last events are
+// kept, so consumers reconnecting with header Last-Event-ID (sent
+// automatically by EventSource) or query parameter lastEventId receive the
+// events they missed. If the missed events are no longer kept, the stream
+// starts with event 'reset'.
+//
+// Backpressure: a subscriber that does not keep up has its events queued
+// by the gateway. If the queue exceeds maxQueuedEvents, the subscriber is
+// disconnected; it can resume from its last event id after reconnecting,
+// so slow consumers never hold back the others or exhaust memory.
+
+var events = require('events');
+var http = require('http');
+var url = require('url');
+var util = require('util');
+
+// Comment sent periodically to keep idle connections (and proxies) open.
+var KEEPALIVE = ': keepalive\n\n';
+
+// Options:
+// * historySize: number of events kept for resuming (default: 1000).
+// * maxQueuedEvents: events queued for a slow subscriber before it is
+//   disconnected (default: 100).
+// * keepaliveInterval: [ms] (default: 15 s).
+// * retry: reconnect delay advised to EventSource clients [ms]
+//   (default: 1 s).
+//
+// Events:
+// * 'subscribe' (count), 'unsubscribe' (count): count is the number of
+//   subscribers.
+// * 'slow' (remoteAddress): a slow subscriber has been disconnected.
+function EventStreamServer(options) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.historySize = options.historySize || 1000;
+    this.maxQueuedEvents = options.maxQueuedEvents || 100;
+    this.retry = options.retry || 1000;
+    this.nextId = Date.now();
+    // Serialized events, oldest first.
+    this.history = [];
+    this.subscribers = [];
+
+    this.server = http.createServer(function(req, res) {
+	self.handleRequest(req, res);
+    });
+    this.keepaliveTimer = setInterval(function() {
+	self.subscribers.forEach(function(subscriber) {
+	    self.send(subscriber, KEEPALIVE);
+	});
+    }, options.keepaliveInterval || 15000);
+    this.keepaliveTimer.unref();
+}
+
+util.inherits(EventStreamServer, events.EventEmitter);
+
+// Listens on the given port. Host defaults to all interfaces, so devices in
+// the local network can subscribe.
+EventStreamServer.prototype.listen = function(port, host, callback) {
+    this.server.listen(port, host, callback);
+};
+
+EventStreamServer.prototype.close = function() {
+    clearInterval(this.keepaliveTimer);
+    this.subscribers.slice().forEach(function(subscriber) {
+	subscriber.res.end();
+    });
+    this.server.close();
+};
+
+// Publishes an event of the given type with data (serialized as JSON) to
+// all subscribers. Returns the event id.
+EventStreamServer.prototype.publish = function(type, data) {
+    var self = this;
+    var id = this.nextId++;
+    var frame = 'id: ' + id + '\nevent: ' + type + '\ndata: ' +
+	JSON.stringify(data) + '\n\n';
+
+    this.history.push({ id: id, frame: frame });
+    if (this.history.length > this.historySize)
+	this.history.shift();
+
+    // Copy, since slow subscribers are removed while iterating.
+    this.subscribers.slice().forEach(function(subscriber) {
+	self.send(subscriber, frame);
+    });
+    return id;
+};
+
+// Writes the queued frames of a subscriber until the socket buffer is full.
+EventStreamServer.prototype.flush = function(subscriber) {
+    while (subscriber.isWritable && subscriber.queue.length > 0) {
+	subscriber.isWritable = subscriber.res.write(subscriber.queue.shift());
+	// The missed events are queued first, so they are written first.
+	if (subscriber.missed > 0)
+	    subscriber.missed--;
+    }
+};
+
+EventStreamServer.prototype.send = function(subscriber, frame) {
+    if (subscriber.isClosed)
+	return;
+
+    subscriber.queue.push(frame);
+    // Events missed before resuming do not count while they are queued,
+    // since they are still referenced by the history anyway.
+    if (subscriber.queue.length > this.maxQueuedEvents + subscriber.missed) {
+	this.unsubscribe(subscriber);
+	this.emit('slow', subscriber.req.socket.remoteAddress);
+	subscriber.res.destroy();
+	return;
+    }
+    this.flush(subscriber);
+};
+
+EventStreamServer.prototype.handleRequest = function(req, res) {
+    var self = this;
+    var parsed = url.parse(req.url, true);
+    var lastEventId, subscriber, first;
+
+    if (req.method !== 'GET' || parsed.pathname !== '/events') {
+	res.writeHead(404);
+	res.end();
+	return;
+    }
+
+    lastEventId = req.headers['last-event-id'] || parsed.query.lastEventId;
+    lastEventId = lastEventId !== undefined ? parseInt(lastEventId, 10) : NaN;
+
+    req.socket.setNoDelay(true);
+    req.socket.setTimeout(0);
+    res.writeHead(200, {
+	'Content-Type': 'text/event-stream',
+	'Cache-Control': 'no-cache',
+	'Connection': 'keep-alive'
+    });
+
+    subscriber = {
+	req: req,
+	res: res,
+	// Frames waiting for the socket to drain.
+	queue: ['retry: ' + this.retry + '\n\n'],
+	isWritable: true,
+	isClosed: false,
+	// Frames of the resumed events not written so far.
+	missed: 0
+    };
+
+    // Resume after the last event the subscriber has received.
+    if (!isNaN(lastEventId) && lastEventId < this.nextId - 1) {
+	first = this.history.length > 0 ? this.history[0].id : this.nextId;
+	if (lastEventId + 1 < first)
+	    subscriber.queue.push('event: reset\ndata: {}\n\n');
+	this.history.forEach(function(event) {
+	    if (event.id > lastEventId)
+		subscriber.queue.push(event.frame);
+	});
+	subscriber.missed = subscriber.queue.length;
+    }
+
+    res.on('drain', function() {
+	subscriber.isWritable = true;
+	self.flush(subscriber);
+    });
+    res.on('close', function() {
+	self.unsubscribe(subscriber);
+    });
+    res.on('finish', function() {
+	self.unsubscribe(subscriber);
+    });
+
+    this.subscribers.push(subscriber);
+    this.emit('subscribe', this.subscribers.length);
+    this.flush(subscriber);
+};
+
+EventStreamServer.prototype.unsubscribe = function(subscriber) {
+    var i = this.subscribers.indexOf(subscriber);
+
+    subscriber.isClosed = true;
+    subscriber.queue = [];
+    if (i < 0)
+	return;
+    this.subscribers.splice(i, 1);
+    this.emit('unsubscribe', this.subscribers.length);
+};
+
+module.exports = EventStreamServer;
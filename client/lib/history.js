@@ -0,0 +1,553 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Local history of door bell alarms with a query API on localhost.
+//
+// The history is a directory of append-only files:
+//
+// * rings.log: one record of RECORD_SIZE bytes per alarm, in the order of
+//   reception. Records are ordered by the time of reception at the gateway,
+//   so the log itself is the time index: a time is found by binary search
+//   over the fixed-size records.
+// * devices.json: MAC addresses of the devices; a record refers to its
+//   device by the position in this list.
+// * device-<n>.idx: device index; the numbers of the records of device n
+//   (uint32), in ascending order.
+// * hours.idx: number of alarms per hour (uint32), starting with the hour
+//   of the first alarm (stored in the first uint32).
+//
+// With 12 bytes per alarm plus 4 bytes in the device index, ten years of
+// 100 rings per day take about 6 MB. Range queries and counts only read
+// the records and index entries they need, and hourly histograms of all
+// devices are served from the hour index. The indexes are derived from
+// the log; after a crash, they are rebuilt on startup if they do not match
+// the log.
+
+var fs = require('fs');
+var http = require('http');
+var path = require('path');
+var url = require('url');
+
+// Record of an alarm (little endian):
+// * uint32: time of reception at the gateway [s since epoch].
+// * uint32: time of the alarm as sent by the device (wall-clock or local
+//   time of the device, see flags) [s].
+// * uint16: device number (see devices.json).
+// * uint8: inputs.
+// * uint8: flags.
+var RECORD_SIZE = 12;
+var INDEX_ENTRY_SIZE = 4;
+var FLAG_WALLCLOCK = 0x01;
+var SECONDS_PER_HOUR = 3600;
+
+// Records (and device index entries) read at once while rebuilding the
+// indexes and reading the alarms of a device.
+var READ_CHUNK = 4096;
+
+// Default for the maximum number of records returned by a range query.
+var DEFAULT_LIMIT = 1000;
+
+function fileSize(fd) {
+    return fs.fstatSync(fd).size;
+}
+
+function readUInt32(fd, position) {
+    var buffer = Buffer.alloc(4);
+
+    fs.readSync(fd, buffer, 0, 4, position);
+    return buffer.readUInt32LE(0);
+}
+
+function writeUInt32(fd, value, position) {
+    var buffer = Buffer.alloc(4);
+
+    buffer.writeUInt32LE(value, 0);
+    fs.writeSync(fd, buffer, 0, 4, position);
+}
+
+// Opens a file for reading and appending, creating it if necessary.
+function openAppend(file) {
+    return fs.openSync(file, 'a+');
+}
+
+// Opens a file for reading and writing at any position, creating it if
+// necessary.
+function openUpdate(file) {
+    fs.closeSync(fs.openSync(file, 'a'));
+    return fs.openSync(file, 'r+');
+}
+
+// Opens the history in directory dir, which is created if it does not
+// exist.
+function History(dir) {
+    var size;
+
+    this.dir = dir;
+    try {
+	fs.mkdirSync(dir);
+    } catch (err) {
+	if (err.code !== 'EEXIST')
+	    throw err;
+    }
+
+    try {
+	this.devices = JSON.parse(fs.readFileSync(this.file('devices.json'),
+						  'utf8'));
+    } catch (err) {
+	if (err.code !== 'ENOENT')
+	    throw err;
+	this.devices = [];
+    }
+    this.deviceNumbers = {};
+    this.deviceFds = [];
+    this.deviceCounts = [];
+    this.devices.forEach(function(address, n) {
+	this.deviceNumbers[address] = n;
+	this.openDevice(n);
+    }, this);
+
+    // A record cut off by a crash is dropped.
+    this.logFd = openAppend(this.file('rings.log'));
+    size = fileSize(this.logFd);
+    this.count = Math.floor(size / RECORD_SIZE);
+    if (size !== this.count * RECORD_SIZE)
+	fs.ftruncateSync(this.logFd, this.count * RECORD_SIZE);
+    this.lastTime = this.count > 0 ? this.readTime(this.count - 1) : 0;
+
+    this.hoursFd = openUpdate(this.file('hours.idx'));
+    this.loadHours();
+
+    if (!this.isConsistent())
+	this.rebuild();
+}
+
+History.prototype.file = function(name) {
+    return path.join(this.dir, name);
+};
+
+History.prototype.openDevice = function(n) {
+    this.deviceFds[n] = openAppend(this.file('device-' + n + '.idx'));
+    this.deviceCounts[n] = Math.floor(fileSize(this.deviceFds[n]) /
+				      INDEX_ENTRY_SIZE);
+};
+
+History.prototype.loadHours = function() {
+    var size = fileSize(this.hoursFd);
+    var buffer, i;
+
+    this.hours = [];
+    this.firstHour = null;
+    if (size < 4)
+	return;
+
+    buffer = Buffer.alloc(size);
+    fs.readSync(this.hoursFd, buffer, 0, size, 0);
+    this.firstHour = buffer.readUInt32LE(0);
+    for (i = 4; i + 4 <= size; i += 4)
+	this.hours.push(buffer.readUInt32LE(i));
+};
+
+// The indexes match the log if they cover all records.
+History.prototype.isConsistent = function() {
+    var count = this.count;
+    var sum = function(a, b) { return a + b; };
+
+    return this.deviceCounts.reduce(sum, 0) === count &&
+	this.hours.reduce(sum, 0) === count;
+};
+
+// Rebuilds the device and hour indexes from the log.
+History.prototype.rebuild = function() {
+    var buffer = Buffer.alloc(READ_CHUNK * RECORD_SIZE);
+    var first, n, entries, i, record;
+
+    this.deviceFds.forEach(function(fd, n) {
+	fs.ftruncateSync(fd, 0);
+	this.deviceCounts[n] = 0;
+    }, this);
+    fs.ftruncateSync(this.hoursFd, 0);
+    this.hours = [];
+    this.firstHour = null;
+
+    for (first = 0; first < this.count; first += READ_CHUNK) {
+	n = Math.min(READ_CHUNK, this.count - first);
+	fs.readSync(this.logFd, buffer, 0, n * RECORD_SIZE,
+		    first * RECORD_SIZE);
+	// Index entries are written per chunk and device.
+	entries = [];
+	for (i = 0; i < n; i++) {
+	    record = this.parseRecord(buffer, i * RECORD_SIZE);
+	    entries[record.deviceNumber] = entries[record.deviceNumber] || [];
+	    entries[record.deviceNumber].push(first + i);
+	    this.countHour(record.receivedAt);
+	}
+	entries.forEach(function(recordNumbers, deviceNumber) {
+	    var index = Buffer.alloc(recordNumbers.length * INDEX_ENTRY_SIZE);
+
+	    recordNumbers.forEach(function(recordNumber, j) {
+		index.writeUInt32LE(recordNumber, j * INDEX_ENTRY_SIZE);
+	    });
+	    fs.writeSync(this.deviceFds[deviceNumber], index, 0, index.length);
+	    this.deviceCounts[deviceNumber] += recordNumbers.length;
+	}, this);
+    }
+
+    if (this.firstHour !== null) {
+	buffer = Buffer.alloc(4 + this.hours.length * 4);
+	buffer.writeUInt32LE(this.firstHour, 0);
+	this.hours.forEach(function(count, i) {
+	    buffer.writeUInt32LE(count, 4 + i * 4);
+	});
+	fs.writeSync(this.hoursFd, buffer, 0, buffer.length, 0);
+    }
+};
+
+// Adds an alarm to the hour counts in memory and returns the slot of the
+// hour.
+History.prototype.countHour = function(time) {
+    var hour = Math.floor(time / SECONDS_PER_HOUR);
+    var slot;
+
+    if (this.firstHour === null)
+	this.firstHour = hour;
+    // Times are never before the first alarm (see append()).
+    slot = hour - this.firstHour;
+    while (this.hours.length <= slot)
+	this.hours.push(0);
+    this.hours[slot]++;
+    return slot;
+};
+
+History.prototype.deviceNumber = function(address) {
+    var n = this.deviceNumbers[address];
+    var tmp;
+
+    if (n !== undefined)
+	return n;
+
+    n = this.devices.length;
+    this.devices.push(address);
+    this.deviceNumbers[address] = n;
+    // Replace the device list atomically.
+    tmp = this.file('devices.json.tmp');
+    fs.writeFileSync(tmp, JSON.stringify(this.devices));
+    fs.renameSync(tmp, this.file('devices.json'));
+    this.openDevice(n);
+    return n;
+};
+
+// Appends an alarm (see DoorBell20Client) of the device with the given
+// address, received at time receivedAt [ms since epoch]. The time of
+// reception is not allowed to go backwards, e.g., if the clock of the
+// gateway is adjusted, to keep the log ordered.
+History.prototype.append = function(address, alarm, receivedAt) {
+    var time = Math.max(Math.floor(receivedAt / 1000), this.lastTime);
+    var deviceNumber = this.deviceNumber(address);
+    var record = Buffer.alloc(RECORD_SIZE);
+    var isFirst = this.firstHour === null;
+    var slot;
+
+    record.writeUInt32LE(time, 0);
+    record.writeUInt32LE(alarm.time, 4);
+    record.writeUInt16LE(deviceNumber, 8);
+    record.writeUInt8(alarm.inputs, 10);
+    record.writeUInt8(alarm.isWallclock ? FLAG_WALLCLOCK : 0, 11);
+
+    // The log is written first, and the device index last. A crash in
+    // between leaves a device index not covering the log, so the indexes
+    // are rebuilt (see isConsistent()).
+    fs.writeSync(this.logFd, record, 0, RECORD_SIZE);
+    slot = this.countHour(time);
+    if (isFirst)
+	writeUInt32(this.hoursFd, this.firstHour, 0);
+    writeUInt32(this.hoursFd, this.hours[slot], 4 + slot * 4);
+    writeUInt32(this.deviceFds[deviceNumber], this.count, null);
+    this.deviceCounts[deviceNumber]++;
+    this.count++;
+    this.lastTime = time;
+};
+
+History.prototype.readTime = function(recordNumber) {
+    return readUInt32(this.logFd, recordNumber * RECORD_SIZE);
+};
+
+History.prototype.parseRecord = function(buffer, offset) {
+    return {
+	receivedAt: buffer.readUInt32LE(offset),
+	time: buffer.readUInt32LE(offset + 4),
+	deviceNumber: buffer.readUInt16LE(offset + 8),
+	inputs: buffer.readUInt8(offset + 10),
+	isWallclock: (buffer.readUInt8(offset + 11) & FLAG_WALLCLOCK) !== 0
+    };
+};
+
+// Reads count records starting with record number first.
+History.prototype.readRecords = function(first, count) {
+    var buffer = Buffer.alloc(count * RECORD_SIZE);
+    var records = [];
+    var i;
+
+    fs.readSync(this.logFd, buffer, 0, buffer.length, first * RECORD_SIZE);
+    for (i = 0; i < count; i++)
+	records.push(this.parseRecord(buffer, i * RECORD_SIZE));
+    return records;
+};
+
+// Number of the first record received at or after time [s], or the number
+// of records if there is none.
+History.prototype.findTime = function(time) {
+    var low = 0;
+    var high = this.count;
+    var middle;
+
+    while (low < high) {
+	middle = (low + high) >>> 1;
+	if (this.readTime(middle) < time)
+	    low = middle + 1;
+	else
+	    high = middle;
+    }
+    return low;
+};
+
+// Position in the index of device n of the first entry referring to a
+// record number at or after recordNumber.
+History.prototype.findDeviceEntry = function(n, recordNumber) {
+    var low = 0;
+    var high = this.deviceCounts[n];
+    var middle;
+
+    while (low < high) {
+	middle = (low + high) >>> 1;
+	if (readUInt32(this.deviceFds[n], middle * INDEX_ENTRY_SIZE) <
+	    recordNumber)
+	    low = middle + 1;
+	else
+	    high = middle;
+    }
+    return low;
+};
+
+History.prototype.toAlarm = function(record) {
+    return {
+	receivedAt: record.receivedAt,
+	device: this.devices[record.deviceNumber],
+	time: record.time,
+	inputs: record.inputs,
+	isWallclock: record.isWallclock
+    };
+};
+
+// Calls callback(record) for the records of device n with record numbers
+// in [first, end), at most limit. Index entries are read in chunks, and
+// records close to each other in the log with a single read.
+History.prototype.forEachDeviceRecord = function(n, first, end, limit,
+						 callback) {
+    var entry = this.findDeviceEntry(n, first);
+    var endEntry = entry + Math.max(0, Math.min(this.findDeviceEntry(n, end) -
+						entry, limit));
+    var buffer = Buffer.alloc(Math.min(endEntry - entry, READ_CHUNK) *
+			      INDEX_ENTRY_SIZE);
+    var count, numbers, i, j, k, records;
+
+    for (; entry < endEntry; entry += count) {
+	count = Math.min(endEntry - entry, READ_CHUNK);
+	fs.readSync(this.deviceFds[n], buffer, 0, count * INDEX_ENTRY_SIZE,
+		    entry * INDEX_ENTRY_SIZE);
+	numbers = [];
+	for (i = 0; i < count; i++)
+	    numbers.push(buffer.readUInt32LE(i * INDEX_ENTRY_SIZE));
+	for (i = 0; i < count; i = j) {
+	    j = i + 1;
+	    while (j < count && numbers[j] - numbers[i] < READ_CHUNK)
+		j++;
+	    records = this.readRecords(numbers[i],
+				       numbers[j - 1] - numbers[i] + 1);
+	    for (k = i; k < j; k++)
+		callback(records[numbers[k] - numbers[i]]);
+	}
+    }
+};
+
+// Records of device n with record numbers in [first, end), at most limit.
+History.prototype.readDeviceRecords = function(n, first, end, limit) {
+    var records = [];
+
+    this.forEachDeviceRecord(n, first, end, limit, function(record) {
+	records.push(record);
+    });
+    return records;
+};
+
+// Alarms received in [from, to) [s since epoch] in the order of reception,
+// at most limit (rounded down; default: 1000). If address is given, only
+// alarms of this device are returned.
+History.prototype.range = function(from, to, address, limit) {
+    var first = this.findTime(from);
+    var end = this.findTime(to);
+    var n, records;
+
+    limit = limit !== undefined ? Math.floor(limit) : DEFAULT_LIMIT;
+    if (address) {
+	n = this.deviceNumbers[address];
+	records = n !== undefined ?
+	    this.readDeviceRecords(n, first, end, limit) : [];
+    } else {
+	records = this.readRecords(first, Math.max(0, Math.min(end - first,
+							      limit)));
+    }
+    return records.map(this.toAlarm, this);
+};
+
+// Number of alarms per device received in [from, to) [s since epoch].
+History.prototype.counts = function(from, to) {
+    var first = this.findTime(from);
+    var end = this.findTime(to);
+    var counts = {};
+
+    this.devices.forEach(function(address, n) {
+	counts[address] = Math.max(0, this.findDeviceEntry(n, end) -
+				   this.findDeviceEntry(n, first));
+    }, this);
+    return counts;
+};
+
+// Number of alarms per hour received in [from, to) [s since epoch], as
+// list of {hour, count} with the start of the hour [s since epoch], for
+// hours with alarms. Hours are counted from the epoch, i.e., in UTC. If
+// address is given, only alarms of this device are counted.
+History.prototype.histogram = function(from, to, address) {
+    var histogram = [];
+    var firstHour, endHour, hour, n, counts;
+
+    if (this.firstHour === null)
+	return histogram;
+
+    if (!address) {
+	firstHour = Math.max(Math.floor(from / SECONDS_PER_HOUR),
+			     this.firstHour);
+	endHour = Math.min(Math.ceil(to / SECONDS_PER_HOUR),
+			   this.firstHour + this.hours.length);
+	for (hour = firstHour; hour < endHour; hour++) {
+	    if (this.hours[hour - this.firstHour] > 0) {
+		histogram.push({ hour: hour * SECONDS_PER_HOUR,
+				 count: this.hours[hour - this.firstHour] });
+	    }
+	}
+	return histogram;
+    }
+
+    // Only the alarms of the device are read.
+    n = this.deviceNumbers[address];
+    if (n === undefined)
+	return histogram;
+    counts = {};
+    this.forEachDeviceRecord(n, this.findTime(from), this.findTime(to),
+			     Infinity, function(record) {
+	hour = Math.floor(record.receivedAt / SECONDS_PER_HOUR);
+	if (counts[hour] === undefined) {
+	    counts[hour] = { hour: hour * SECONDS_PER_HOUR, count: 0 };
+	    histogram.push(counts[hour]);
+	}
+	counts[hour].count++;
+    });
+    return histogram;
+};
+
+// Size of the history [bytes] (without the device list).
+History.prototype.size = function() {
+    return [this.logFd, this.hoursFd].concat(this.deviceFds).reduce(
+	function(size, fd) {
+	    return size + fileSize(fd);
+	}, 0);
+};
+
+History.prototype.close = function() {
+    fs.closeSync(this.logFd);
+    fs.closeSync(this.hoursFd);
+    this.deviceFds.forEach(function(fd) {
+	fs.closeSync(fd);
+    });
+};
+
+// Parses a time of a query, given in s since epoch or as date string.
+// Returns def if the time is not given, and NaN if it is invalid.
+function parseTime(value, def) {
+    if (value === undefined || value === '')
+	return def;
+    if (/^\d+$/.test(value))
+	return Number(value);
+    return Math.floor(Date.parse(value) / 1000);
+}
+
+// Serves queries at http://<host>:<port> as JSON (host defaults to
+// localhost). Times are given in s since epoch or as date strings, e.g.,
+// '2016-10-18T12:00:00Z':
+//
+// * /rings?from=<time>&to=<time>&device=<address>&limit=<n>
+// * /counts?from=<time>&to=<time>
+// * /histogram?from=<time>&to=<time>&device=<address>
+//
+// All parameters are optional; the range defaults to the whole history.
+// The limit must be a non-negative integer.
+History.prototype.listen = function(port, host) {
+    var self = this;
+    var server = http.createServer(function(req, res) {
+	var parsed = url.parse(req.url, true);
+	var query = parsed.query;
+	var from = parseTime(query.from, 0);
+	var to = parseTime(query.to, self.lastTime + 1);
+	var limit = query.limit !== undefined ? Number(query.limit) :
+	    DEFAULT_LIMIT;
+	var status = 200;
+	var result, body;
+
+	if (req.method !== 'GET') {
+	    status = 404;
+	} else if (isNaN(from) || isNaN(to) || !Number.isInteger(limit) ||
+		   limit < 0) {
+	    status = 400;
+	    result = { error: 'Invalid parameter.' };
+	} else if (parsed.pathname === '/rings') {
+	    result = self.range(from, to, query.device, limit);
+	} else if (parsed.pathname === '/counts') {
+	    result = self.counts(from, to);
+	} else if (parsed.pathname === '/histogram') {
+	    result = self.histogram(from, to, query.device);
+	} else {
+	    status = 404;
+	}
+
+	if (result === undefined) {
+	    res.writeHead(status);
+	    res.end();
+	    return;
+	}
+	body = JSON.stringify(result);
+	res.writeHead(status, {
+	    'Content-Type': 'application/json',
+	    'Content-Length': Buffer.byteLength(body)
+	});
+	res.end(body);
+    });
+
+    server.listen(port, host || '127.0.0.1');
+    return server;
+};
+
+module.exports = History;
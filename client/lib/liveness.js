@@ -0,0 +1,213 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Liveness of DoorBell20 devices, tracked from their heartbeats (see
+// DoorBell20Client).
+//
+// The state of a device is one of:
+// * 'unknown': not connected since the start.
+// * 'alive': connected and sending heartbeats.
+// * 'link-down': not connected for longer than the suspicion time, e.g.,
+//   out of range or empty battery.
+// * 'silent': connected, but the last heartbeat is overdue by more than
+//   the suspicion time, i.e., the firmware hangs while the softdevice keeps
+//   the link.
+//
+// The suspicion time is a fraction of the heartbeat interval, so a failure
+// is reported within one heartbeat interval after the last sign of life
+// was due. Reconnecting within the suspicion time is not reported. The
+// battery level is tracked independently of the state. Devices with older
+// firmware send no heartbeats; they are alive while connected.
+//
+// Like the client, the monitor is started and stopped, e.g., when a
+// redundant gateway becomes active or stands by. A stopped monitor reports
+// nothing, and devices are unknown again when it is started.
+
+var events = require('events');
+var util = require('util');
+
+// The battery is ok again if its level has risen by this much [%] above
+// the threshold, so a level around the threshold does not report changes
+// on every heartbeat.
+var BATTERY_HYSTERESIS = 5;
+
+// Options:
+// * heartbeatInterval: heartbeat interval [ms] assumed until a device has
+//   sent its interval (default: 15 s, the local time clock interval of the
+//   firmware).
+// * suspicion: suspicion time as fraction of the heartbeat interval
+//   (default: 0.5).
+// * batteryLowLevel: battery level [%] below which the battery is low
+//   (default: 20).
+//
+// Events:
+// * 'state' (address, state, previousState): see above.
+// * 'battery' (address, isLow, heartbeat): the battery has become low or
+//   is ok again.
+function LivenessMonitor(client, options) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.client = client;
+    this.heartbeatInterval = options.heartbeatInterval || 15000;
+    this.suspicion = options.suspicion || 0.5;
+    this.batteryLowLevel = options.batteryLowLevel !== undefined ?
+	options.batteryLowLevel : 20;
+
+    this.isRunning = false;
+
+    // State per device, indexed by address.
+    this.devices = {};
+    Object.keys(client.devices).forEach(function(address) {
+	self.devices[address] = {
+	    address: address,
+	    state: 'unknown',
+	    interval: self.heartbeatInterval,
+	    isBatteryLow: false,
+	    timer: null,
+	    // State set when the timer expires.
+	    pendingState: null
+	};
+    });
+
+    client.on('connected', function(address) {
+	if (self.isRunning)
+	    self.handleConnected(self.devices[address]);
+    });
+    client.on('disconnected', function(address) {
+	if (self.isRunning)
+	    self.handleDisconnected(self.devices[address]);
+    });
+    client.on('heartbeat', function(address, heartbeat) {
+	if (self.isRunning)
+	    self.handleHeartbeat(self.devices[address], heartbeat);
+    });
+}
+
+util.inherits(LivenessMonitor, events.EventEmitter);
+
+// Starts monitoring; call along with client.start().
+LivenessMonitor.prototype.start = function() {
+    var self = this;
+
+    if (this.isRunning)
+	return;
+    this.isRunning = true;
+    Object.keys(this.devices).forEach(function(address) {
+	var device = self.devices[address];
+
+	// Connecting the first time takes some time.
+	self.startTimer(device, device.interval * (1 + self.suspicion),
+			'link-down');
+    });
+};
+
+// Stops monitoring without reporting any state changes, e.g., when the
+// client is stopped. The monitor can be started again.
+LivenessMonitor.prototype.stop = function() {
+    var self = this;
+
+    this.isRunning = false;
+    Object.keys(this.devices).forEach(function(address) {
+	var device = self.devices[address];
+
+	self.stopTimer(device);
+	device.state = 'unknown';
+	device.isBatteryLow = false;
+    });
+};
+
+LivenessMonitor.prototype.setState = function(device, state) {
+    var previousState = device.state;
+
+    if (state === previousState)
+	return;
+    device.state = state;
+    this.emit('state', device.address, state, previousState);
+};
+
+// Changes the state of the device after timeout [ms] unless the timer is
+// restarted or stopped.
+LivenessMonitor.prototype.startTimer = function(device, timeout, state) {
+    var self = this;
+
+    clearTimeout(device.timer);
+    device.pendingState = state;
+    device.timer = setTimeout(function() {
+	device.timer = null;
+	device.pendingState = null;
+	self.setState(device, state);
+    }, timeout);
+};
+
+LivenessMonitor.prototype.stopTimer = function(device) {
+    clearTimeout(device.timer);
+    device.timer = null;
+    device.pendingState = null;
+};
+
+LivenessMonitor.prototype.handleConnected = function(device) {
+    if (!this.client.devices[device.address].hasHeartbeat) {
+	this.stopTimer(device);
+	this.setState(device, 'alive');
+	return;
+    }
+    // The device sends a heartbeat right after subscribing; the link is
+    // not a sign of life of the firmware.
+    this.startTimer(device, device.interval * this.suspicion, 'silent');
+};
+
+LivenessMonitor.prototype.handleDisconnected = function(device) {
+    // Disconnects also end failed connection attempts, which do not
+    // extend the time until the link is reported down.
+    if (device.state === 'link-down' || device.pendingState === 'link-down')
+	return;
+    this.startTimer(device, device.interval * this.suspicion, 'link-down');
+};
+
+LivenessMonitor.prototype.handleHeartbeat = function(device, heartbeat) {
+    var isBatteryLow;
+
+    if (heartbeat.interval > 0)
+	device.interval = heartbeat.interval * 1000;
+    this.setState(device, 'alive');
+    this.startTimer(device, device.interval * (1 + this.suspicion), 'silent');
+
+    isBatteryLow = device.isBatteryLow ?
+	heartbeat.batteryLevel < this.batteryLowLevel + BATTERY_HYSTERESIS :
+	heartbeat.batteryLevel < this.batteryLowLevel;
+    if (isBatteryLow !== device.isBatteryLow) {
+	device.isBatteryLow = isBatteryLow;
+	this.emit('battery', device.address, isBatteryLow, heartbeat);
+    }
+};
+
+// Current states of all devices, indexed by address.
+LivenessMonitor.prototype.states = function() {
+    var self = this;
+    var states = {};
+
+    Object.keys(this.devices).forEach(function(address) {
+	states[address] = self.devices[address].state;
+    });
+    return states;
+};
+
+module.exports = LivenessMonitor;
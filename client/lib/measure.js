@@ -0,0 +1,84 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Helpers for measuring the gateway in load tests and trace replays.
+
+// Current time [ms] with sub-millisecond resolution.
+function now() {
+    var t = process.hrtime();
+
+    return t[0] * 1e3 + t[1] / 1e6;
+}
+
+// Percentile p (0-100) of an array sorted in ascending order.
+function percentile(sorted, p) {
+    if (sorted.length === 0)
+	return NaN;
+    return sorted[Math.min(sorted.length - 1,
+			   Math.floor(p / 100 * sorted.length))];
+}
+
+// Formats percentiles 50, 90, and 99 and the maximum of the values [ms].
+function formatDelays(values) {
+    var sorted = values.slice().sort(function(a, b) { return a - b; });
+
+    return [50, 90, 99, 100].map(function(p) {
+	return percentile(sorted, p).toFixed(1);
+    }).join(' / ') + ' ms';
+}
+
+function heapUsed() {
+    // Without node option --expose-gc, the heap also contains garbage.
+    if (global.gc)
+	global.gc();
+    return process.memoryUsage().heapUsed;
+}
+
+function mb(bytes) {
+    return (bytes / (1024 * 1024)).toFixed(1) + ' MB';
+}
+
+// Records the heap and the peak resident set size from now on.
+function MemoryMonitor() {
+    var self = this;
+
+    this.baseHeap = heapUsed();
+    this.baseRss = process.memoryUsage().rss;
+    this.peakRss = this.baseRss;
+    this.timer = setInterval(function() {
+	self.peakRss = Math.max(self.peakRss, process.memoryUsage().rss);
+    }, 100);
+}
+
+// Stops monitoring and returns the growth of heap and peak RSS.
+MemoryMonitor.prototype.stop = function() {
+    clearInterval(this.timer);
+    return 'heap ' + mb(heapUsed() - this.baseHeap) + ', peak rss ' +
+	mb(this.peakRss - this.baseRss);
+};
+
+// Prints a line of a report.
+function report(label, value) {
+    console.log((label + ':                          ').slice(0, 27) + value);
+}
+
+module.exports.now = now;
+module.exports.percentile = percentile;
+module.exports.formatDelays = formatDelays;
+module.exports.MemoryMonitor = MemoryMonitor;
+module.exports.report = report;
@@ -0,0 +1,276 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Prometheus-style metrics of the gateway.
+//
+// Counters and histograms are kept in memory and served in the Prometheus
+// text exposition format over HTTP. Updating a metric costs a lookup of
+// the label values and, for histograms, a scan of the few bucket bounds,
+// so metrics can stay enabled under peak load. Label values are passed as
+// arrays in the order of the label names.
+
+var http = require('http');
+
+// Bucket bounds [s] for delays in the gateway and sink requests.
+var DELAY_BUCKETS = [0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1,
+		     2.5, 5, 10];
+// Bucket bounds [s] for connection setup and reconnects.
+var CONNECTION_BUCKETS = [0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300, 600];
+
+function escapeLabelValue(value) {
+    return String(value).replace(/\\/g, '\\\\').replace(/\n/g, '\\n')
+	.replace(/"/g, '\\"');
+}
+
+function formatLabels(names, values, extraName, extraValue) {
+    var pairs = names.map(function(name, i) {
+	return name + '="' + escapeLabelValue(values[i]) + '"';
+    });
+
+    if (extraName)
+	pairs.push(extraName + '="' + extraValue + '"');
+    return pairs.length > 0 ? '{' + pairs.join(',') + '}' : '';
+}
+
+function Counter(name, help, labelNames) {
+    this.name = name;
+    this.help = help;
+    this.labelNames = labelNames || [];
+    // Series indexed by the joined label values.
+    this.series = {};
+}
+
+Counter.prototype.inc = function(labelValues, value) {
+    var key = labelValues ? labelValues.join('\u0000') : '';
+    var series = this.series[key];
+
+    if (!series) {
+	series = this.series[key] = { labels: labelValues || [], value: 0 };
+    }
+    series.value += value !== undefined ? value : 1;
+};
+
+Counter.prototype.expose = function() {
+    var self = this;
+    var lines = ['# HELP ' + this.name + ' ' + this.help,
+		 '# TYPE ' + this.name + ' counter'];
+
+    Object.keys(this.series).forEach(function(key) {
+	var series = self.series[key];
+
+	lines.push(self.name + formatLabels(self.labelNames, series.labels) +
+		   ' ' + series.value);
+    });
+    return lines.join('\n');
+};
+
+function Histogram(name, help, labelNames, buckets) {
+    this.name = name;
+    this.help = help;
+    this.labelNames = labelNames || [];
+    this.buckets = buckets;
+    this.series = {};
+}
+
+// Records a value [s].
+Histogram.prototype.observe = function(labelValues, value) {
+    var key = labelValues ? labelValues.join('\u0000') : '';
+    var series = this.series[key];
+    var buckets = this.buckets;
+    var i = 0;
+
+    if (!series) {
+	series = this.series[key] = {
+	    labels: labelValues || [],
+	    // Non-cumulative counts; the last entry counts values above the
+	    // largest bound.
+	    counts: buckets.map(function() { return 0; }).concat([0]),
+	    sum: 0,
+	    count: 0
+	};
+    }
+    while (i < buckets.length && value > buckets[i])
+	i++;
+    series.counts[i]++;
+    series.sum += value;
+    series.count++;
+};
+
+Histogram.prototype.expose = function() {
+    var self = this;
+    var lines = ['# HELP ' + this.name + ' ' + this.help,
+		 '# TYPE ' + this.name + ' histogram'];
+
+    Object.keys(this.series).forEach(function(key) {
+	var series = self.series[key];
+	var cumulative = 0;
+
+	self.buckets.forEach(function(bound, i) {
+	    cumulative += series.counts[i];
+	    lines.push(self.name + '_bucket' +
+		       formatLabels(self.labelNames, series.labels, 'le',
+				    bound) + ' ' + cumulative);
+	});
+	lines.push(self.name + '_bucket' +
+		   formatLabels(self.labelNames, series.labels, 'le', '+Inf') +
+		   ' ' + series.count);
+	lines.push(self.name + '_sum' +
+		   formatLabels(self.labelNames, series.labels) + ' ' +
+		   series.sum);
+	lines.push(self.name + '_count' +
+		   formatLabels(self.labelNames, series.labels) + ' ' +
+		   series.count);
+    });
+    return lines.join('\n');
+};
+
+function Registry() {
+    this.metrics = [];
+}
+
+Registry.prototype.counter = function(name, help, labelNames) {
+    var counter = new Counter(name, help, labelNames);
+
+    this.metrics.push(counter);
+    return counter;
+};
+
+Registry.prototype.histogram = function(name, help, labelNames, buckets) {
+    var histogram = new Histogram(name, help, labelNames, buckets);
+
+    this.metrics.push(histogram);
+    return histogram;
+};
+
+Registry.prototype.expose = function() {
+    return this.metrics.map(function(metric) {
+	return metric.expose();
+    }).join('\n') + '\n';
+};
+
+// Serves the metrics of the registry at http://host:port/metrics. Host
+// defaults to localhost.
+Registry.prototype.listen = function(port, host) {
+    var self = this;
+    var server = http.createServer(function(req, res) {
+	var body;
+
+	if (req.method !== 'GET' || req.url.split('?')[0] !== '/metrics') {
+	    res.writeHead(404);
+	    res.end();
+	    return;
+	}
+	body = self.expose();
+	res.writeHead(200, {
+	    'Content-Type': 'text/plain; version=0.0.4',
+	    'Content-Length': Buffer.byteLength(body)
+	});
+	res.end(body);
+    });
+
+    server.listen(port, host || '127.0.0.1');
+    return server;
+};
+
+function formatReason(reason) {
+    return reason !== undefined && reason !== null ?
+	'0x' + ('0' + reason.toString(16)).slice(-2) : 'unknown';
+}
+
+// Metrics of a gateway built on DoorBell20Client. The metrics of the
+// client are collected from its events; sinks (e.g., the IFTTT request)
+// report their results with sinkRequest() and sinkDropped().
+function GatewayMetrics(client, registry) {
+    var self = this;
+
+    this.registry = registry || new Registry();
+    registry = this.registry;
+
+    this.rings = registry.counter(
+	'doorbell20_rings_total', 'Door bell alarms received.', ['device']);
+    this.disconnects = registry.counter(
+	'doorbell20_disconnects_total',
+	'Disconnects by HCI reason code.', ['device', 'reason']);
+    this.retries = registry.counter(
+	'doorbell20_connect_retries_total',
+	'Connection attempts after failures and disconnects.', ['device']);
+    this.dropped = registry.counter(
+	'doorbell20_dropped_events_total', 'Events not delivered.',
+	['reason']);
+    this.sinkRequests = registry.counter(
+	'doorbell20_sink_requests_total',
+	'Requests to sinks by HTTP status (error if none).',
+	['sink', 'status']);
+    this.connectSeconds = registry.histogram(
+	'doorbell20_connect_seconds', 'Duration of successful connects.',
+	[], CONNECTION_BUCKETS);
+    this.discoverySeconds = registry.histogram(
+	'doorbell20_discovery_seconds',
+	'Duration of service discovery and subscribing.', [],
+	CONNECTION_BUCKETS);
+    this.reconnectSeconds = registry.histogram(
+	'doorbell20_reconnect_seconds',
+	'Time from losing a subscribed link to subscribing again.', [],
+	CONNECTION_BUCKETS);
+    this.sinkRequestSeconds = registry.histogram(
+	'doorbell20_sink_request_seconds', 'Duration of sink requests.',
+	['sink'], DELAY_BUCKETS);
+    this.notificationToSinkSeconds = registry.histogram(
+	'doorbell20_notification_to_sink_seconds',
+	'Time from receiving an alarm to the completed sink request.',
+	['sink'], DELAY_BUCKETS);
+
+    client.on('alarm', function(address) {
+	self.rings.inc([address]);
+    });
+    client.on('connected', function(address, timing) {
+	self.connectSeconds.observe(null, timing.connect / 1000);
+	self.discoverySeconds.observe(null, timing.discovery / 1000);
+	if (timing.reconnect !== null)
+	    self.reconnectSeconds.observe(null, timing.reconnect / 1000);
+    });
+    client.on('disconnected', function(address, reason) {
+	self.disconnects.inc([address, formatReason(reason)]);
+    });
+    client.on('retry', function(address) {
+	self.retries.inc([address]);
+    });
+    client.on('dropped', function(address, reason) {
+	self.dropped.inc([reason]);
+    });
+}
+
+// Reports a completed request of sink for alarm; status is the HTTP status
+// code or null on errors. Times as returned by measure.now().
+GatewayMetrics.prototype.sinkRequest = function(sink, alarm, requestStart,
+						requestEnd, status) {
+    this.sinkRequests.inc([sink, status !== null ? status : 'error']);
+    this.sinkRequestSeconds.observe([sink],
+				    (requestEnd - requestStart) / 1000);
+    if (status !== null)
+	this.notificationToSinkSeconds.observe(
+	    [sink], (requestEnd - alarm.receivedAt) / 1000);
+};
+
+// Reports an alarm that a sink could not deliver.
+GatewayMetrics.prototype.sinkDropped = function(sink) {
+    this.dropped.inc([sink + ' error']);
+};
+
+module.exports.Registry = Registry;
+module.exports.GatewayMetrics = GatewayMetrics;
@@ -0,0 +1,272 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Coordination of redundant gateways.
+//
+// A DoorBell20 device accepts a single connection, so only one gateway, the
+// active one, connects to the devices; the other gateways stand by. The
+// gateways coordinate over UDP multicast in the local network:
+//
+// * Every gateway sends a heartbeat every heartbeatInterval, telling
+//   whether it is active.
+// * If no heartbeat of an active gateway has been received for
+//   failoverTimeout, the standby gateway with the highest rank becomes
+//   active. Gateways that have received heartbeats of an active gateway,
+//   and thus know its recent alarms, rank higher than gateways that have
+//   just been started; then the priority and the id decide. An active
+//   gateway stays active as long as it is alive, so a returning gateway
+//   does not take over the links.
+// * If several gateways are active, e.g., after the network has been
+//   partitioned, all but the one with the highest rank stand by again.
+//
+// The active gateway announces every alarm, identified by device address,
+// sequence number, and time (see DoorBell20Client), before delivering it.
+// With acknowledged delivery, a device sends an alarm again if the
+// confirmation is lost, e.g., because the active gateway fails; the gateway
+// taking over drops such alarms instead of delivering them twice.
+// Announcements are repeated in the next heartbeats, since UDP datagrams
+// might be lost. The sequence number restarts at boot of the device, but
+// the time of the alarm differs then. Alarms without sequence number (older
+// firmware) are never dropped.
+//
+// Messages are JSON documents:
+// * {type: 'heartbeat', id, priority, isActive, isSynced,
+//   alarms: [key, ...]}
+// * {type: 'alarm', id, key}
+
+var dgram = require('dgram');
+var events = require('events');
+var os = require('os');
+var util = require('util');
+
+// Number of recent alarms repeated in heartbeats.
+var REPEATED_ALARMS = 16;
+
+function alarmKey(address, alarm) {
+    return address + '/' + alarm.seq + '/' + alarm.time;
+}
+
+// Options:
+// * id: unique id of the gateway (default: host name and process id).
+// * priority: gateways with higher priority are preferred (default: 0).
+// * group: multicast address (default: '239.255.20.20').
+// * port: UDP port (default: 20020).
+// * interface: address of the interface for multicast, e.g., '127.0.0.1'
+//   to test several gateways on one machine (default: chosen by the OS).
+// * heartbeatInterval: [ms] (default: 500).
+// * failoverTimeout: [ms] (default: 2 s).
+// * dedupWindow: time alarms are remembered for detecting duplicates [ms]
+//   (default: 10 min).
+//
+// Events:
+// * 'active': this gateway has become active and should connect to the
+//   devices.
+// * 'standby': this gateway has to stand by and disconnect from the
+//   devices.
+// * 'warning' (message): e.g., an invalid message has been received.
+function Coordinator(options) {
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.id = options.id || os.hostname() + ':' + process.pid;
+    this.priority = options.priority || 0;
+    this.group = options.group || '239.255.20.20';
+    this.port = options.port || 20020;
+    this.interface = options.interface;
+    this.heartbeatInterval = options.heartbeatInterval || 500;
+    this.failoverTimeout = options.failoverTimeout || 2000;
+    this.dedupWindow = options.dedupWindow || 1000*60*10;
+
+    this.isActive = false;
+    // Set when the recent alarms of an active gateway are known.
+    this.isSynced = false;
+    // Last heartbeat of the other gateways, indexed by id.
+    this.peers = {};
+    // Reception time of recent alarms (Date.now()), indexed by alarm key.
+    this.alarms = {};
+    this.recentAlarms = [];
+    this.socket = null;
+    this.timer = null;
+}
+
+util.inherits(Coordinator, events.EventEmitter);
+
+Coordinator.prototype.start = function() {
+    var self = this;
+
+    this.startTime = Date.now();
+    this.socket = dgram.createSocket({ type: 'udp4', reuseAddr: true });
+    this.socket.on('message', function(message) {
+	self.handleMessage(message);
+    });
+    this.socket.on('error', function(err) {
+	self.emit('warning', 'Multicast socket: ' + err.message);
+    });
+    this.socket.bind(this.port, function() {
+	if (self.interface)
+	    self.socket.setMulticastInterface(self.interface);
+	self.socket.addMembership(self.group, self.interface);
+	self.socket.setMulticastTTL(1);
+	// Gateways on the same machine receive each other's messages.
+	self.socket.setMulticastLoopback(true);
+	self.timer = setInterval(function() {
+	    self.sendHeartbeat();
+	    self.update();
+	}, self.heartbeatInterval);
+	self.sendHeartbeat();
+    });
+};
+
+// Stops sending heartbeats without standing by, like a failing gateway.
+Coordinator.prototype.stop = function() {
+    clearInterval(this.timer);
+    this.socket.close();
+    this.socket = null;
+};
+
+Coordinator.prototype.send = function(message) {
+    var data = Buffer.from(JSON.stringify(message));
+
+    this.socket.send(data, 0, data.length, this.port, this.group);
+};
+
+Coordinator.prototype.sendHeartbeat = function() {
+    this.send({ type: 'heartbeat', id: this.id, priority: this.priority,
+		isActive: this.isActive, isSynced: this.isSynced,
+		alarms: this.recentAlarms });
+};
+
+Coordinator.prototype.handleMessage = function(data) {
+    var self = this;
+    var message;
+
+    try {
+	message = JSON.parse(data.toString());
+    } catch (err) {
+	this.emit('warning', 'Invalid message.');
+	return;
+    }
+    if (message.id === this.id)
+	return;
+
+    if (message.type === 'heartbeat') {
+	this.peers[message.id] = {
+	    id: message.id,
+	    priority: message.priority,
+	    isActive: message.isActive,
+	    isSynced: message.isSynced,
+	    lastSeen: Date.now()
+	};
+	(message.alarms || []).forEach(function(key) {
+	    self.rememberAlarm(key);
+	});
+	if (message.isActive)
+	    this.isSynced = true;
+	this.update();
+    } else if (message.type === 'alarm') {
+	this.rememberAlarm(message.key);
+    }
+};
+
+// True if gateway a ranks higher than gateway b.
+function ranksHigher(a, b) {
+    if (a.isSynced !== b.isSynced)
+	return a.isSynced;
+    if (a.priority !== b.priority)
+	return a.priority > b.priority;
+    return a.id > b.id;
+}
+
+// Elects the active gateway from the heartbeats received.
+Coordinator.prototype.update = function() {
+    var self = this;
+    var t = Date.now();
+    var peers = [];
+    var hasActivePeer = false;
+    var isHighest = true;
+
+    Object.keys(this.peers).forEach(function(id) {
+	var peer = self.peers[id];
+
+	if (t - peer.lastSeen > self.failoverTimeout) {
+	    delete self.peers[id];
+	} else {
+	    peers.push(peer);
+	    if (peer.isActive)
+		hasActivePeer = true;
+	}
+    });
+
+    if (this.isActive) {
+	// Resolve several active gateways.
+	if (peers.some(function(peer) {
+	    return peer.isActive && ranksHigher(peer, self);
+	})) {
+	    this.isActive = false;
+	    this.emit('standby');
+	}
+    } else if (!hasActivePeer) {
+	// Wait for the heartbeats of the other gateways after the start.
+	if (t - this.startTime <= this.failoverTimeout)
+	    return;
+	peers.forEach(function(peer) {
+	    if (ranksHigher(peer, self))
+		isHighest = false;
+	});
+	if (isHighest) {
+	    this.isActive = true;
+	    this.isSynced = true;
+	    this.sendHeartbeat();
+	    this.emit('active');
+	}
+    }
+
+    Object.keys(this.alarms).forEach(function(key) {
+	if (t - self.alarms[key] > self.dedupWindow)
+	    delete self.alarms[key];
+    });
+};
+
+Coordinator.prototype.rememberAlarm = function(key) {
+    if (this.alarms[key] === undefined)
+	this.alarms[key] = Date.now();
+};
+
+// Checks whether an alarm received from the device with the given address
+// has been delivered before by any gateway. If not, the alarm is
+// announced to the other gateways, and the caller delivers it.
+Coordinator.prototype.isDuplicate = function(address, alarm) {
+    var key;
+
+    if (alarm.seq === null)
+	return false;
+
+    key = alarmKey(address, alarm);
+    if (this.alarms[key] !== undefined)
+	return true;
+
+    this.rememberAlarm(key);
+    this.recentAlarms.push(key);
+    if (this.recentAlarms.length > REPEATED_ALARMS)
+	this.recentAlarms.shift();
+    if (this.socket)
+	this.send({ type: 'alarm', id: this.id, key: key });
+    return false;
+};
+
+module.exports = Coordinator;
@@ -0,0 +1,445 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Local rules acting on the events of the gateway, so local actions such
+// as a chime or a light do not take the round-trip through the cloud and
+// keep working offline.
+//
+// Rules are given as JSON document:
+//
+// {
+//   "sinks": {
+//     "chime": { "type": "http", "url": "http://192.168.1.30/ring" },
+//     "light": { "type": "command", "command": "/usr/local/bin/flash" },
+//     "cloud": { "type": "ifttt", "event": "doorbell_alarm" }
+//   },
+//   "rules": [
+//     { "name": "night", "hours": { "from": "22:00", "to": "07:00" },
+//       "sinks": ["light"], "last": true },
+//     { "name": "front door", "devices": ["f3:23:0d:4c:ce:1b"],
+//       "rateLimit": { "count": 1, "seconds": 30 },
+//       "sinks": ["chime", "cloud"] }
+//   ]
+// }
+//
+// Rules are checked in order for every event. A rule fires if all its
+// conditions hold; then its sinks are triggered, and with "last", no
+// further rules are checked for the event. Conditions:
+//
+// * event: 'alarm' (door bell alarm, default), 'pattern' (ring pattern,
+//   sent when the ring has ended), 'liveness', or 'battery' (see
+//   lib/liveness.js).
+// * devices: addresses of the devices.
+// * inputs: bit mask of inputs; alarms of one of these inputs (alarms and
+//   ring patterns).
+// * hours, quietHours: {from: 'hh:mm', to: 'hh:mm', days: ['mon', ...]};
+//   the rule only fires within resp. outside this local time window. The
+//   window may span midnight; days default to every day and refer to the
+//   day the window starts. The time of alarms is the time of the ring if
+//   the device has wall-clock time.
+// * pattern: {minPresses, maxPresses, code, longPress} (ring patterns).
+//   Code is a sequence of short ('.') and long ('-') presses, e.g., '..-';
+//   presses of at least longPress [ms] are long (default: 500 ms).
+// * states: liveness states, e.g., ['link-down', 'silent'] (liveness).
+// * isLow: true if the battery has become low, false if it is ok again
+//   (battery).
+// * rateLimit: {count, seconds}; the rule fires at most count times per
+//   device within seconds. A rule suppressed by its rate limit does not
+//   stop later rules.
+//
+// Rules are compiled into predicates once when they are loaded, and
+// invalid rules throw an error then. Evaluating an event only runs the
+// predicates of the rules for its event type; sinks run asynchronously, so
+// a slow sink does not delay other sinks or events.
+//
+// Sinks of type 'http' send a request with the event as JSON document:
+// {url, method (default: 'POST'), timeout [ms] (default: 5 s)}. Sinks of
+// type 'command' run a program: {command, args, timeout}. The event is
+// passed in environment variables DOORBELL20_RULE, DOORBELL20_EVENT,
+// DOORBELL20_DEVICE, and DOORBELL20_DATA (JSON document). Applications add
+// further sink types with option sinkTypes, e.g., the cloud.
+//
+// Events passed to handle() are {type, device, time, data}: type is one of
+// the rule event types, time is the time of the event (Date.now()), data
+// is the alarm, ring pattern, or state of the event.
+
+var childProcess = require('child_process');
+var events = require('events');
+var http = require('http');
+var https = require('https');
+var url = require('url');
+var util = require('util');
+var now = require('./measure').now;
+
+var EVENT_TYPES = ['alarm', 'pattern', 'liveness', 'battery'];
+var DAYS = ['sun', 'mon', 'tue', 'wed', 'thu', 'fri', 'sat'];
+
+function ruleError(rule, message) {
+    return new Error('Rule ' + rule.name + ': ' + message);
+}
+
+// The document sent to sinks.
+function formatEvent(ruleName, event) {
+    var document = { rule: ruleName, event: event.type, device: event.device };
+
+    Object.keys(event.data).forEach(function(key) {
+	if (key !== 'receivedAt')
+	    document[key] = event.data[key];
+    });
+    return document;
+}
+
+function parseTimeOfDay(rule, value) {
+    var match = /^(\d\d?):(\d\d)$/.exec(value);
+
+    if (!match || Number(match[1]) > 23 || Number(match[2]) > 59)
+	throw ruleError(rule, 'invalid time of day ' + value);
+    return Number(match[1]) * 60 + Number(match[2]);
+}
+
+// Compiles a time window into a predicate of the time [ms].
+function compileWindow(rule, window) {
+    var from = parseTimeOfDay(rule, window.from);
+    var to = parseTimeOfDay(rule, window.to);
+    var days = 0;
+
+    (window.days || DAYS).forEach(function(day) {
+	var i = DAYS.indexOf(day);
+
+	if (i < 0)
+	    throw ruleError(rule, 'invalid day ' + day);
+	days |= 1 << i;
+    });
+
+    return function(time) {
+	var date = new Date(time);
+	var minute = date.getHours() * 60 + date.getMinutes();
+	var day = date.getDay();
+
+	if (from <= to)
+	    return minute >= from && minute < to && (days & (1 << day)) !== 0;
+	// The window spans midnight; after midnight, it has started the
+	// day before.
+	if (minute >= from)
+	    return (days & (1 << day)) !== 0;
+	return minute < to && (days & (1 << ((day + 6) % 7))) !== 0;
+    };
+}
+
+// Compiles the pattern condition into a predicate of the ring pattern
+// (see DoorBell20Client).
+function compilePattern(rule, condition) {
+    var minPresses = condition.minPresses || 0;
+    var maxPresses = condition.maxPresses !== undefined ?
+	condition.maxPresses : Infinity;
+    var longPress = condition.longPress || 500;
+    var code = condition.code;
+
+    if (code !== undefined && !/^[.-]+$/.test(code))
+	throw ruleError(rule, 'invalid code ' + code);
+
+    return function(pattern) {
+	var i, press;
+
+	if (pattern.presses < minPresses || pattern.presses > maxPresses)
+	    return false;
+	if (code === undefined)
+	    return true;
+	// The code has to match all presses.
+	if (pattern.isOverflow || pattern.presses !== code.length)
+	    return false;
+	for (i = 0; i < code.length; i++) {
+	    press = pattern.durations[2 * i] >= longPress ? '-' : '.';
+	    if (press !== code[i])
+		return false;
+	}
+	return true;
+    };
+}
+
+// Compiles a rate limit into a predicate of the event, which records the
+// event if it passes.
+function compileRateLimit(rule, limit) {
+    var count = limit.count;
+    var window = limit.seconds * 1000;
+    // Times of the last firings per device, oldest first.
+    var firings = {};
+
+    if (!(count >= 1) || !(window > 0))
+	throw ruleError(rule, 'invalid rate limit');
+
+    return function(event) {
+	var times = firings[event.device] || (firings[event.device] = []);
+
+	while (times.length > 0 && event.time - times[0] >= window)
+	    times.shift();
+	if (times.length >= count)
+	    return false;
+	times.push(event.time);
+	return true;
+    };
+}
+
+// Compiles a rule into {name, event, isLast, sinks, matches(event)}.
+function compileRule(rule, sinks) {
+    var conditions = [];
+    var rateLimit = null;
+    var type = rule.event || 'alarm';
+    var devices, inputs, isInside, isQuiet, matchesPattern, states, isLow;
+
+    if (EVENT_TYPES.indexOf(type) < 0)
+	throw ruleError(rule, 'invalid event ' + type);
+    if (!Array.isArray(rule.sinks))
+	throw ruleError(rule, 'missing sinks');
+    rule.sinks.forEach(function(name) {
+	if (!sinks[name])
+	    throw ruleError(rule, 'unknown sink ' + name);
+    });
+
+    if (rule.devices) {
+	devices = {};
+	rule.devices.forEach(function(address) {
+	    devices[address.toLowerCase()] = true;
+	});
+	conditions.push(function(event) {
+	    return devices[event.device] === true;
+	});
+    }
+    if (rule.inputs !== undefined) {
+	if (type !== 'alarm' && type !== 'pattern')
+	    throw ruleError(rule, 'inputs require alarm or pattern events');
+	inputs = rule.inputs;
+	conditions.push(type === 'alarm' ? function(event) {
+	    return (event.data.inputs & inputs) !== 0;
+	} : function(event) {
+	    return (inputs & (1 << event.data.input)) !== 0;
+	});
+    }
+    if (rule.hours) {
+	isInside = compileWindow(rule, rule.hours);
+	conditions.push(function(event) {
+	    return isInside(event.time);
+	});
+    }
+    if (rule.quietHours) {
+	isQuiet = compileWindow(rule, rule.quietHours);
+	conditions.push(function(event) {
+	    return !isQuiet(event.time);
+	});
+    }
+    if (rule.pattern) {
+	if (type !== 'pattern')
+	    throw ruleError(rule, 'pattern requires pattern events');
+	matchesPattern = compilePattern(rule, rule.pattern);
+	conditions.push(function(event) {
+	    return matchesPattern(event.data);
+	});
+    }
+    if (rule.states) {
+	if (type !== 'liveness')
+	    throw ruleError(rule, 'states require liveness events');
+	states = rule.states;
+	conditions.push(function(event) {
+	    return states.indexOf(event.data.state) >= 0;
+	});
+    }
+    if (rule.isLow !== undefined) {
+	if (type !== 'battery')
+	    throw ruleError(rule, 'isLow requires battery events');
+	isLow = rule.isLow;
+	conditions.push(function(event) {
+	    return event.data.isLow === isLow;
+	});
+    }
+    // Checked last, so only firings count.
+    if (rule.rateLimit)
+	rateLimit = compileRateLimit(rule, rule.rateLimit);
+
+    return {
+	name: rule.name,
+	event: type,
+	isLast: rule.last === true,
+	sinks: rule.sinks,
+	matches: function(event) {
+	    var i;
+
+	    for (i = 0; i < conditions.length; i++) {
+		if (!conditions[i](event))
+		    return false;
+	    }
+	    return rateLimit === null || rateLimit(event);
+	}
+    };
+}
+
+// Sink sending the event by HTTP(S).
+function createHttpSink(config) {
+    var options = url.parse(config.url || '');
+    var protocol = options.protocol === 'https:' ? https :
+	options.protocol === 'http:' ? http : null;
+    var method = config.method || 'POST';
+    var timeout = config.timeout || 5000;
+
+    if (!protocol)
+	throw new Error('Sink ' + config.name + ': invalid url ' + config.url);
+
+    return function(ruleName, event, callback) {
+	var body = method !== 'GET' ?
+	    JSON.stringify(formatEvent(ruleName, event)) : null;
+	var req;
+
+	options.method = method;
+	options.headers = body !== null ? {
+	    'Content-Type': 'application/json',
+	    'Content-Length': Buffer.byteLength(body)
+	} : {};
+	req = protocol.request(options, function(res) {
+	    // Consume the response to free the socket.
+	    res.resume();
+	    callback(res.statusCode);
+	});
+	req.setTimeout(timeout, function() {
+	    req.abort();
+	});
+	req.on('error', function() {
+	    callback(null);
+	});
+	if (body !== null)
+	    req.write(body);
+	req.end();
+    };
+}
+
+// Sink running a program; the status is its exit code.
+function createCommandSink(config) {
+    var args = config.args || [];
+    var timeout = config.timeout || 5000;
+
+    if (!config.command)
+	throw new Error('Sink ' + config.name + ': missing command');
+
+    return function(ruleName, event, callback) {
+	var env = {};
+
+	Object.keys(process.env).forEach(function(key) {
+	    env[key] = process.env[key];
+	});
+	env.DOORBELL20_RULE = ruleName;
+	env.DOORBELL20_EVENT = event.type;
+	env.DOORBELL20_DEVICE = event.device;
+	env.DOORBELL20_DATA = JSON.stringify(formatEvent(ruleName, event));
+	childProcess.execFile(config.command, args,
+			      { env: env, timeout: timeout }, function(err) {
+	    if (!err)
+		callback(0);
+	    else
+		callback(typeof err.code === 'number' ? err.code : null);
+	});
+    };
+}
+
+var SINK_TYPES = {
+    http: createHttpSink,
+    command: createCommandSink
+};
+
+// Compiles the rules of the given document (see above).
+//
+// Options:
+// * sinkTypes: further sink types, indexed by type. A sink type is a
+//   function(config) returning the sink: function(ruleName, event,
+//   callback(status)); status is the HTTP status code or exit code, or
+//   null if the sink failed. Sink types throw errors for invalid configs.
+//
+// Events:
+// * 'action' (ruleName, sinkName, event, status, start, end): a sink has
+//   completed; start and end as returned by measure.now().
+function RuleEngine(document, options) {
+    var self = this;
+    var sinkTypes = {};
+
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    Object.keys(SINK_TYPES).forEach(function(type) {
+	sinkTypes[type] = SINK_TYPES[type];
+    });
+    Object.keys(options.sinkTypes || {}).forEach(function(type) {
+	sinkTypes[type] = options.sinkTypes[type];
+    });
+
+    this.sinks = {};
+    Object.keys(document.sinks || {}).forEach(function(name) {
+	var config = document.sinks[name];
+
+	config.name = name;
+	if (!sinkTypes[config.type])
+	    throw new Error('Sink ' + name + ': unknown type ' + config.type);
+	self.sinks[name] = sinkTypes[config.type](config);
+    });
+
+    // Compiled rules per event type, in order.
+    this.rules = {};
+    EVENT_TYPES.forEach(function(type) {
+	self.rules[type] = [];
+    });
+    (document.rules || []).forEach(function(rule, i) {
+	var compiled;
+
+	rule.name = rule.name || 'rule ' + (i + 1);
+	compiled = compileRule(rule, self.sinks);
+	self.rules[compiled.event].push(compiled);
+    });
+}
+
+util.inherits(RuleEngine, events.EventEmitter);
+
+// Evaluates the rules for an event and triggers the sinks of the rules
+// that fire. Returns the names of these rules.
+RuleEngine.prototype.handle = function(event) {
+    var rules = this.rules[event.type] || [];
+    var fired = [];
+    var i, rule;
+
+    for (i = 0; i < rules.length; i++) {
+	rule = rules[i];
+	if (!rule.matches(event))
+	    continue;
+	fired.push(rule.name);
+	this.trigger(rule, event);
+	if (rule.isLast)
+	    break;
+    }
+    return fired;
+};
+
+RuleEngine.prototype.trigger = function(rule, event) {
+    var self = this;
+
+    rule.sinks.forEach(function(sinkName) {
+	var start = now();
+
+	self.sinks[sinkName](rule.name, event, function(status) {
+	    self.emit('action', rule.name, sinkName, event, status, start,
+		      now());
+	});
+    });
+};
+
+module.exports = RuleEngine;
+module.exports.formatEvent = formatEvent;
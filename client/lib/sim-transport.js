@@ -0,0 +1,600 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// In-process BLE transport with simulated DoorBell20 devices. It implements
+// the subset of the noble API used by DoorBell20Client (see
+// doorbell20-client.js), so the gateway can be tested and benchmarked
+// without a BLE adapter or device.
+//
+// A simulated device advertises while it is not connected. Connecting
+// takes a configurable delay. While connected, the device can lose the
+// link at random. Notifications are transmitted in connection events as
+// the firmware does: rings are queued and sent in the next connection
+// event, at most a few per event; queued notifications are lost on
+// disconnect, and rings while the client is not subscribed are not sent
+// at all. Unlike the firmware, the simulated device sends an alarm for
+// every ring (no alarm inhibit delay).
+//
+// In acknowledged mode, the device behaves like the firmware with
+// indications: alarms are kept until they are confirmed, one alarm is
+// sent per connection event and confirmed in the next one, and an alarm
+// not confirmed before a disconnect is sent again on the next link. Unlike
+// the firmware, the device keeps any number of alarms. Like the firmware,
+// the device enters acknowledged mode when the client writes 0x0002 to
+// the CCCD of the alarm characteristic, and leaves it when the client
+// subscribes to notifications.
+//
+// Devices with a heartbeat interval send heartbeats while subscribed, like
+// the firmware. A device can hang, i.e., stop sending while keeping the
+// link, and its battery voltage can be set. Devices with a wall clock
+// accept the time written by the client and then send alarms with
+// wall-clock time; unlike the firmware, they need no bonded peer.
+
+var events = require('events');
+var util = require('util');
+var DoorBell20Client = require('./doorbell20-client');
+var now = require('./measure').now;
+
+// HCI reason codes of disconnects.
+var HCI_CONNECTION_TIMEOUT = 0x08;
+var HCI_LOCAL_HOST_TERMINATED_CONNECTION = 0x16;
+
+// Earliest wall-clock time accepted by the firmware (2016-01-01) [s].
+var WALLCLOCK_MIN = 1451606400;
+
+// Small seedable pseudo random number generator (mulberry32), so
+// simulations can be repeated.
+function Random(seed) {
+    this.state = seed >>> 0;
+}
+
+// Uniformly distributed in [0, 1).
+Random.prototype.next = function() {
+    var t;
+
+    this.state = (this.state + 0x6d2b79f5) >>> 0;
+    t = this.state;
+    t = Math.imul(t ^ (t >>> 15), t | 1);
+    t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+};
+
+// Uniformly distributed in [0.5 * mean, 1.5 * mean).
+Random.prototype.around = function(mean) {
+    return mean * (0.5 + this.next());
+};
+
+// Exponentially distributed with the given mean.
+Random.prototype.exponential = function(mean) {
+    return -mean * Math.log(1 - this.next());
+};
+
+function SimCharacteristic(uuid, properties) {
+    events.EventEmitter.call(this);
+    this.uuid = uuid;
+    this.properties = properties || ['read'];
+    this.isNotifying = false;
+}
+
+util.inherits(SimCharacteristic, events.EventEmitter);
+
+function SimDescriptor(uuid) {
+    this.uuid = uuid;
+}
+
+function SimService(uuid, chars) {
+    this.uuid = uuid;
+    this.chars = chars;
+}
+
+SimService.prototype.discoverCharacteristics = function(uuids, callback) {
+    var chars = this.chars;
+
+    setImmediate(function() {
+	callback(null, chars);
+    });
+};
+
+// Options (times in ms):
+// * connectDelay: mean time to establish a connection (default: 200).
+// * advInterval: advertising interval; a device is discovered within
+//   one interval after scanning has started (default: 1000).
+// * connInterval: connection interval (default: 100).
+// * maxNotificationsPerEvent: notifications sent per connection event
+//   (default: 6).
+// * meanTimeToDisconnect: mean time until the link is lost (supervision
+//   timeout); 0 for stable links (default: 0).
+// * acknowledged: acknowledged mode until the client subscribes
+//   (default: false).
+// * heartbeatInterval: full seconds; 0 for devices without heartbeat
+//   (older firmware) (default: 0).
+// * batteryMv: battery voltage (default: 3000).
+// * ringPatterns: the device sends ring patterns (default: false).
+// * wallclock: the device has a wall-clock characteristic (default:
+//   false).
+// * legacyAlarms: the device sends alarms like the released firmware, i.e.,
+//   only their time (4 bytes) (default: false).
+//
+// Events besides the noble events:
+// * 'deliver' (ringTime): emitted right before the notification of the
+//   ring at time ringTime (see measure.now()) is passed to the client;
+//   emitted again for retransmissions.
+function SimPeripheral(transport, address, options) {
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.transport = transport;
+    this.random = transport.random;
+    this.address = address;
+    this.advertisement = {
+	localName: 'DoorBell20',
+	serviceUuids: [DoorBell20Client.doorBellServiceUUID]
+    };
+    this.connectDelay = options.connectDelay !== undefined ?
+	options.connectDelay : 200;
+    this.advInterval = options.advInterval || 1000;
+    this.connInterval = options.connInterval || 100;
+    this.maxNotificationsPerEvent = options.maxNotificationsPerEvent || 6;
+    this.meanTimeToDisconnect = options.meanTimeToDisconnect || 0;
+    this.isAcknowledged = options.acknowledged || false;
+    this.heartbeatInterval = options.heartbeatInterval || 0;
+    this.batteryMv = options.batteryMv || 3000;
+    this.hasRingPatterns = options.ringPatterns || false;
+    this.hasWallclock = options.wallclock || false;
+    this.hasLegacyAlarms = options.legacyAlarms || false;
+    this.isHanging = false;
+
+    this.startTime = now();
+    this.isConnected = false;
+    this.isConnecting = false;
+    this.alarmChar = null;
+    // Rings waiting for the next connection event. In acknowledged mode,
+    // the first ring is in flight if isInFlight is set.
+    this.queue = [];
+    this.isInFlight = false;
+    // Sequence number of the last alarm.
+    this.seq = 0;
+    this.connectionTimer = null;
+    this.disconnectTimer = null;
+    this.heartbeatChar = null;
+    this.heartbeatTimer = null;
+    this.heartbeatSeq = 0;
+    this.ringPatternChar = null;
+    // Wall-clock time minus measure.now() [ms]; null until written.
+    this.wallclockOffset = null;
+
+    // Statistics.
+    this.stats = {
+	rings: 0,
+	sent: 0,
+	// Rings while not subscribed and queued rings lost on disconnect.
+	lost: 0,
+	connects: 0,
+	disconnects: 0,
+	retransmissions: 0
+    };
+}
+
+util.inherits(SimPeripheral, events.EventEmitter);
+
+SimPeripheral.prototype.connect = function(callback) {
+    var self = this;
+
+    if (this.isConnected || this.isConnecting) {
+	setImmediate(function() {
+	    callback(new Error('Already connected.'));
+	});
+	return;
+    }
+
+    this.isConnecting = true;
+    setTimeout(function() {
+	self.isConnecting = false;
+	self.isConnected = true;
+	self.stats.connects++;
+	self.scheduleDisconnect();
+	callback(null);
+    }, this.random.around(this.connectDelay));
+};
+
+SimPeripheral.prototype.scheduleDisconnect = function() {
+    var self = this;
+
+    if (this.meanTimeToDisconnect <= 0)
+	return;
+    this.disconnectTimer = setTimeout(function() {
+	self.disconnect(HCI_CONNECTION_TIMEOUT);
+    }, this.random.exponential(this.meanTimeToDisconnect));
+};
+
+// Reason defaults to a disconnect requested by the client.
+SimPeripheral.prototype.disconnect = function(reason) {
+    var self = this;
+
+    if (!this.isConnected)
+	return;
+
+    this.isConnected = false;
+    this.stats.disconnects++;
+    clearTimeout(this.disconnectTimer);
+    clearTimeout(this.connectionTimer);
+    this.connectionTimer = null;
+    // Notifications not transmitted so far are discarded. Acknowledged
+    // alarms are kept, including the one in flight.
+    if (!this.isAcknowledged) {
+	this.stats.lost += this.queue.length;
+	this.queue = [];
+    }
+    this.isInFlight = false;
+    this.alarmChar = null;
+    this.heartbeatChar = null;
+    this.ringPatternChar = null;
+    clearInterval(this.heartbeatTimer);
+
+    setImmediate(function() {
+	self.emit('disconnect', reason !== undefined ? reason :
+		  HCI_LOCAL_HOST_TERMINATED_CONNECTION);
+    });
+};
+
+SimPeripheral.prototype.discoverServices = function(uuids, callback) {
+    var self = this;
+    var alarmChar, localtimeChar, heartbeatChar, ringPatternChar;
+    var wallclockChar, chars;
+
+    // Like noble, new objects are created for every discovery.
+    alarmChar = new SimCharacteristic(DoorBell20Client.doorBellAlarmCharUUID,
+				      ['read', 'notify', 'indicate']);
+    alarmChar.subscribe = function(callback) {
+	setImmediate(function() {
+	    if (!self.isConnected || self.alarmChar !== alarmChar) {
+		callback(new Error('Not connected.'));
+		return;
+	    }
+	    alarmChar.isNotifying = true;
+	    self.isAcknowledged = false;
+	    callback(null);
+	    if (self.queue.length > 0)
+		self.scheduleConnectionEvent();
+	});
+    };
+    alarmChar.discoverDescriptors = function(callback) {
+	var cccd = new SimDescriptor('2902');
+
+	cccd.writeValue = function(data, callback) {
+	    setImmediate(function() {
+		if (!self.isConnected || self.alarmChar !== alarmChar) {
+		    callback(new Error('Not connected.'));
+		    return;
+		}
+		alarmChar.isNotifying = data.readUInt16LE(0) !== 0;
+		if (alarmChar.isNotifying)
+		    self.isAcknowledged = (data.readUInt16LE(0) & 0x0002) !== 0;
+		callback(null);
+		if (alarmChar.isNotifying && self.queue.length > 0)
+		    self.scheduleConnectionEvent();
+	    });
+	};
+	setImmediate(function() {
+	    callback(null, [cccd]);
+	});
+    };
+    localtimeChar = new SimCharacteristic(DoorBell20Client.localtimeCharUUID);
+    this.alarmChar = alarmChar;
+    chars = [alarmChar, localtimeChar];
+    if (this.heartbeatInterval > 0) {
+	heartbeatChar = new SimCharacteristic(
+	    DoorBell20Client.heartbeatCharUUID, ['read', 'notify']);
+	heartbeatChar.subscribe = function(callback) {
+	    setImmediate(function() {
+		if (!self.isConnected || self.heartbeatChar !== heartbeatChar) {
+		    callback(new Error('Not connected.'));
+		    return;
+		}
+		callback(null);
+		self.startHeartbeats();
+	    });
+	};
+	this.heartbeatChar = heartbeatChar;
+	chars.push(heartbeatChar);
+    }
+    if (this.hasRingPatterns) {
+	ringPatternChar = new SimCharacteristic(
+	    DoorBell20Client.ringPatternCharUUID, ['read', 'notify']);
+	ringPatternChar.subscribe = function(callback) {
+	    setImmediate(function() {
+		if (!self.isConnected || self.ringPatternChar !== ringPatternChar) {
+		    callback(new Error('Not connected.'));
+		    return;
+		}
+		ringPatternChar.isNotifying = true;
+		callback(null);
+	    });
+	};
+	this.ringPatternChar = ringPatternChar;
+	chars.push(ringPatternChar);
+    }
+    if (this.hasWallclock) {
+	wallclockChar = new SimCharacteristic(
+	    DoorBell20Client.wallclockCharUUID, ['read', 'write']);
+	wallclockChar.write = function(data, withoutResponse, callback) {
+	    var t = now();
+
+	    setImmediate(function() {
+		if (!self.isConnected) {
+		    callback(new Error('Not connected.'));
+		    return;
+		}
+		if (data.length !== 8 ||
+		    data.readUInt32LE(0) < WALLCLOCK_MIN) {
+		    callback(new Error('Invalid time.'));
+		    return;
+		}
+		self.wallclockOffset = data.readUInt32LE(0)*1000 +
+		    data.readUInt16LE(4) - t;
+		callback(null);
+	    });
+	};
+	chars.push(wallclockChar);
+    }
+
+    setImmediate(function() {
+	if (!self.isConnected) {
+	    callback(new Error('Not connected.'));
+	    return;
+	}
+	callback(null, [new SimService(DoorBell20Client.doorBellServiceUUID,
+				       chars)]);
+    });
+};
+
+// Sends a heartbeat now and then every heartbeat interval.
+SimPeripheral.prototype.startHeartbeats = function() {
+    var self = this;
+
+    clearInterval(this.heartbeatTimer);
+    this.sendHeartbeat();
+    this.heartbeatTimer = setInterval(function() {
+	self.sendHeartbeat();
+    }, this.heartbeatInterval);
+};
+
+SimPeripheral.prototype.sendHeartbeat = function() {
+    var data = Buffer.alloc(7);
+    var level = Math.round((this.batteryMv - 2000) / 10);
+
+    if (this.isHanging || !this.heartbeatChar)
+	return;
+
+    this.heartbeatSeq = (this.heartbeatSeq + 1) & 0xffff;
+    data.writeUInt16LE(this.heartbeatSeq, 0);
+    data.writeUInt16LE(Math.round(this.heartbeatInterval / 1000), 2);
+    data.writeUInt16LE(this.batteryMv, 4);
+    data.writeUInt8(Math.max(0, Math.min(100, level)), 6);
+    this.heartbeatChar.emit('data', data, true);
+    this.heartbeatChar.emit('read', data, true);
+};
+
+// The device stops sending heartbeats and alarms, but keeps the link.
+SimPeripheral.prototype.hang = function() {
+    this.isHanging = true;
+};
+
+// Simulates a door bell ring of the given inputs (bit mask, default: 1).
+// Returns true if the alarm is sent.
+SimPeripheral.prototype.ring = function(inputs) {
+    var isSubscribed = this.isConnected && this.alarmChar &&
+	this.alarmChar.isNotifying;
+
+    this.stats.rings++;
+    if (this.isHanging || (!isSubscribed && !this.isAcknowledged)) {
+	this.stats.lost++;
+	return false;
+    }
+
+    this.seq = (this.seq + 1) & 0xffff;
+    this.queue.push({ time: now(), inputs: inputs || 1, seq: this.seq });
+    if (isSubscribed)
+	this.scheduleConnectionEvent();
+    return true;
+};
+
+// Simulates a ring with the given durations [ms] of presses and gaps,
+// starting and ending with a press. The alarm is sent at the first press,
+// the ring pattern 1.5 s after the last press like by the firmware.
+SimPeripheral.prototype.ringPattern = function(durations, input) {
+    var self = this;
+    var total = durations.reduce(function(sum, duration) {
+	return sum + duration;
+    }, 0);
+
+    input = input || 0;
+    this.ring(1 << input);
+    setTimeout(function() {
+	self.sendRingPattern(durations, input);
+    }, total + 1500);
+};
+
+SimPeripheral.prototype.sendRingPattern = function(durations, input) {
+    var bytes = [(durations.length + 1) / 2, input << 5];
+    var data;
+
+    if (this.isHanging || !this.ringPatternChar ||
+	!this.ringPatternChar.isNotifying)
+	return;
+
+    durations.forEach(function(duration) {
+	var units = Math.round(duration / 10);
+
+	if (units < 128)
+	    bytes.push(units);
+	else
+	    bytes.push(0x80 | (units >> 8), units & 0xff);
+    });
+    data = Buffer.from(bytes);
+    this.ringPatternChar.emit('data', data, true);
+    this.ringPatternChar.emit('read', data, true);
+};
+
+// Simulates count rings separated by spacing [ms].
+SimPeripheral.prototype.burst = function(count, spacing, inputs) {
+    var self = this;
+    var i;
+
+    for (i = 0; i < count; i++) {
+	setTimeout(function() {
+	    self.ring(inputs);
+	}, i * spacing);
+    }
+};
+
+SimPeripheral.prototype.scheduleConnectionEvent = function() {
+    var self = this;
+    var elapsed;
+
+    if (this.connectionTimer)
+	return;
+
+    // Connection events take place every connection interval.
+    elapsed = (now() - this.startTime) % this.connInterval;
+    this.connectionTimer = setTimeout(function() {
+	self.connectionTimer = null;
+	self.onConnectionEvent();
+    }, this.connInterval - elapsed);
+};
+
+SimPeripheral.prototype.send = function(ring) {
+    var data = Buffer.alloc(8);
+
+    if (this.wallclockOffset !== null) {
+	data.writeUInt32LE(Math.floor((ring.time + this.wallclockOffset) /
+				      1000), 0);
+	data.writeUInt8(0x01, 5);
+    } else {
+	data.writeUInt32LE(Math.floor((ring.time - this.startTime) / 1000) +
+			   1, 0);
+	data.writeUInt8(0, 5);
+    }
+    data.writeUInt8(ring.inputs, 4);
+    data.writeUInt16LE(ring.seq, 6);
+    if (this.hasLegacyAlarms)
+	data = data.slice(0, 4);
+    if (ring.isSent)
+	this.stats.retransmissions++;
+    else
+	this.stats.sent++;
+    ring.isSent = true;
+    this.emit('deliver', ring.time);
+    this.alarmChar.emit('data', data, true);
+    this.alarmChar.emit('read', data, true);
+};
+
+SimPeripheral.prototype.onConnectionEvent = function() {
+    var i;
+
+    if (this.isAcknowledged) {
+	// The alarm sent in the last connection event is confirmed.
+	if (this.isInFlight) {
+	    this.queue.shift();
+	    this.isInFlight = false;
+	}
+	if (this.queue.length > 0) {
+	    this.send(this.queue[0]);
+	    this.isInFlight = true;
+	}
+    } else {
+	for (i = 0; i < this.maxNotificationsPerEvent &&
+		 this.queue.length > 0; i++)
+	    this.send(this.queue.shift());
+    }
+
+    if (this.queue.length > 0)
+	this.scheduleConnectionEvent();
+};
+
+// Options:
+// * seed: seed of the pseudo random number generator (default: 1).
+function SimTransport(options) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.random = new Random(options.seed || 1);
+    this.peripherals = [];
+    this.isScanning = false;
+    this.scanTimers = [];
+
+    // Like noble, the adapter is powered on asynchronously.
+    this.state = 'unknown';
+    process.nextTick(function() {
+	self.state = 'poweredOn';
+	self.emit('stateChange', self.state);
+    });
+}
+
+util.inherits(SimTransport, events.EventEmitter);
+
+// Adds a simulated device; see SimPeripheral for options.
+SimTransport.prototype.addPeripheral = function(address, options) {
+    var peripheral = new SimPeripheral(this, address, options);
+
+    this.peripherals.push(peripheral);
+    if (this.isScanning)
+	this.scheduleDiscover(peripheral);
+    return peripheral;
+};
+
+// Makes a simulated device of another transport visible to this
+// transport, e.g., to simulate several gateways in range of a device.
+SimTransport.prototype.addSharedPeripheral = function(peripheral) {
+    this.peripherals.push(peripheral);
+    if (this.isScanning)
+	this.scheduleDiscover(peripheral);
+};
+
+SimTransport.prototype.scheduleDiscover = function(peripheral) {
+    var self = this;
+
+    this.scanTimers.push(setTimeout(function() {
+	if (self.isScanning && !peripheral.isConnected)
+	    self.emit('discover', peripheral);
+    }, this.random.next() * peripheral.advInterval));
+};
+
+SimTransport.prototype.startScanning = function(serviceUUIDs,
+						allowDuplicates) {
+    var self = this;
+
+    // All simulated devices implement the DoorBell20 service, and every
+    // device is reported once per scan.
+    this.stopScanning();
+    this.isScanning = true;
+    this.peripherals.forEach(function(peripheral) {
+	self.scheduleDiscover(peripheral);
+    });
+};
+
+SimTransport.prototype.stopScanning = function() {
+    this.isScanning = false;
+    this.scanTimers.forEach(clearTimeout);
+    this.scanTimers = [];
+};
+
+module.exports = SimTransport;
+module.exports.Random = Random;
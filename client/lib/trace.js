@@ -0,0 +1,600 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Recording and replay of BLE-level traces of the gateway.
+//
+// TraceRecorder wraps a transport (noble or SimTransport) and writes every
+// event seen by the gateway to a trace: adapter state changes, discovered
+// devices, results of connect, service, characteristic, and descriptor
+// discovery, subscribe and write requests, notifications, and
+// disconnects. ReplayTransport implements the same API and feeds a
+// recorded trace back to the gateway in real time, accelerated, or as fast
+// as possible. Incidents recorded in
+// the field, e.g., a reconnect storm, can so be reproduced without
+// devices and used as regression benchmarks.
+//
+// Traces are NDJSON files: one JSON object per line with the time since
+// the start of the recording in ms (t, microsecond resolution), the record
+// type, and type-specific fields. The first line is a header:
+//
+// {"t":0,"type":"header","version":1,"start":"2016-11-12T10:00:00.000Z"}
+// {"t":3.1,"type":"stateChange","state":"poweredOn"}
+// {"t":3.2,"type":"scanStart"}
+// {"t":812.9,"type":"discover","address":"f3:23:0d:4c:ce:1b",
+//  "advertisement":{"localName":"DoorBell20","serviceUuids":[...]}}
+// {"t":813.0,"type":"scanStop"}
+// {"t":1025.4,"type":"connect","address":"...","error":null}
+// {"t":1190.2,"type":"services","address":"...","error":null,
+//  "services":["451e0001dd1c4f20a42eff91a53d2992"]}
+// {"t":1420.7,"type":"characteristics","address":"...","error":null,
+//  "characteristics":["451e0002dd1c4f20a42eff91a53d2992",...],
+//  "properties":[["read","notify","indicate"],...]}
+// {"t":1530.0,"type":"subscribe","address":"...",
+//  "characteristic":"451e0002dd1c4f20a42eff91a53d2992","error":null}
+// {"t":1610.3,"type":"write","address":"...",
+//  "characteristic":"451e0009dd1c4f20a42eff91a53d2992","error":null}
+// {"t":1612.0,"type":"descriptors","address":"...",
+//  "characteristic":"451e0002dd1c4f20a42eff91a53d2992","error":null,
+//  "descriptors":["2902"]}
+// {"t":1640.8,"type":"writeDescriptor","address":"...",
+//  "characteristic":"451e0002dd1c4f20a42eff91a53d2992",
+//  "descriptor":"2902","error":null}
+// {"t":9120.5,"type":"notification","address":"...",
+//  "characteristic":"451e0002dd1c4f20a42eff91a53d2992",
+//  "data":"0f0000000101"}
+// {"t":9300.0,"type":"disconnect","address":"...","reason":8}
+//
+// Errors are recorded as message strings, disconnect reasons as HCI reason
+// codes (null if the transport does not provide them).
+
+var events = require('events');
+var fs = require('fs');
+var util = require('util');
+var now = require('./measure').now;
+
+var TRACE_VERSION = 1;
+
+function errorMessage(err) {
+    return err ? (err.message || String(err)) : null;
+}
+
+function RecordingCharacteristic(recorder, address, characteristic) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+    this.uuid = characteristic.uuid;
+    this.properties = characteristic.properties;
+    this.characteristic = characteristic;
+    this.recorder = recorder;
+    this.address = address;
+
+    characteristic.on('read', function(data, isNotification) {
+	if (isNotification) {
+	    recorder.record({ type: 'notification', address: address,
+			      characteristic: self.uuid,
+			      data: data.toString('hex') });
+	}
+	self.emit('data', data, isNotification);
+	self.emit('read', data, isNotification);
+    });
+}
+
+util.inherits(RecordingCharacteristic, events.EventEmitter);
+
+RecordingCharacteristic.prototype.subscribe = function(callback) {
+    var self = this;
+
+    this.characteristic.subscribe(function(err) {
+	self.recorder.record({ type: 'subscribe', address: self.address,
+			       characteristic: self.uuid,
+			       error: errorMessage(err) });
+	callback(err);
+    });
+};
+
+RecordingCharacteristic.prototype.write = function(data, withoutResponse,
+						   callback) {
+    var self = this;
+
+    this.characteristic.write(data, withoutResponse, function(err) {
+	self.recorder.record({ type: 'write', address: self.address,
+			       characteristic: self.uuid,
+			       error: errorMessage(err) });
+	callback(err);
+    });
+};
+
+RecordingCharacteristic.prototype.discoverDescriptors = function(callback) {
+    var self = this;
+
+    this.characteristic.discoverDescriptors(function(err, descriptors) {
+	descriptors = descriptors || [];
+	self.recorder.record({ type: 'descriptors', address: self.address,
+			       characteristic: self.uuid,
+			       error: errorMessage(err),
+			       descriptors: descriptors.map(function(d) {
+				   return d.uuid;
+			       }) });
+	callback(err, descriptors.map(function(d) {
+	    return new RecordingDescriptor(self.recorder, self.address,
+					   self.uuid, d);
+	}));
+    });
+};
+
+function RecordingDescriptor(recorder, address, charUUID, descriptor) {
+    this.uuid = descriptor.uuid;
+    this.descriptor = descriptor;
+    this.recorder = recorder;
+    this.address = address;
+    this.charUUID = charUUID;
+}
+
+RecordingDescriptor.prototype.writeValue = function(data, callback) {
+    var self = this;
+
+    this.descriptor.writeValue(data, function(err) {
+	self.recorder.record({ type: 'writeDescriptor', address: self.address,
+			       characteristic: self.charUUID,
+			       descriptor: self.uuid,
+			       error: errorMessage(err) });
+	callback(err);
+    });
+};
+
+function RecordingService(recorder, address, service) {
+    this.uuid = service.uuid;
+    this.service = service;
+    this.recorder = recorder;
+    this.address = address;
+}
+
+RecordingService.prototype.discoverCharacteristics = function(uuids,
+							      callback) {
+    var self = this;
+
+    this.service.discoverCharacteristics(uuids, function(err, chars) {
+	chars = chars || [];
+	self.recorder.record({ type: 'characteristics', address: self.address,
+			       error: errorMessage(err),
+			       characteristics: chars.map(function(c) {
+				   return c.uuid;
+			       }),
+			       properties: chars.map(function(c) {
+				   return c.properties || [];
+			       }) });
+	callback(err, chars.map(function(c) {
+	    return new RecordingCharacteristic(self.recorder, self.address, c);
+	}));
+    });
+};
+
+function RecordingPeripheral(recorder, peripheral) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+    this.address = peripheral.address;
+    this.advertisement = peripheral.advertisement;
+    this.peripheral = peripheral;
+    this.recorder = recorder;
+
+    peripheral.on('disconnect', function(reason) {
+	recorder.record({ type: 'disconnect', address: self.address,
+			  reason: reason !== undefined ? reason : null });
+	self.emit('disconnect', reason);
+    });
+}
+
+util.inherits(RecordingPeripheral, events.EventEmitter);
+
+RecordingPeripheral.prototype.connect = function(callback) {
+    var self = this;
+
+    this.peripheral.connect(function(err) {
+	self.recorder.record({ type: 'connect', address: self.address,
+			       error: errorMessage(err) });
+	callback(err);
+    });
+};
+
+RecordingPeripheral.prototype.disconnect = function() {
+    this.peripheral.disconnect();
+};
+
+RecordingPeripheral.prototype.discoverServices = function(uuids, callback) {
+    var self = this;
+
+    this.peripheral.discoverServices(uuids, function(err, services) {
+	services = services || [];
+	self.recorder.record({ type: 'services', address: self.address,
+			       error: errorMessage(err),
+			       services: services.map(function(s) {
+				   return s.uuid;
+			       }) });
+	callback(err, services.map(function(s) {
+	    return new RecordingService(self.recorder, self.address, s);
+	}));
+    });
+};
+
+// Wraps transport and writes the trace to file. The returned object is
+// used by the gateway instead of the transport.
+function TraceRecorder(transport, file) {
+    var self = this;
+
+    events.EventEmitter.call(this);
+    this.transport = transport;
+    this.stream = fs.createWriteStream(file);
+    this.startTime = now();
+    // Wrapped peripherals indexed by address.
+    this.peripherals = {};
+
+    Object.defineProperty(this, 'state', {
+	get: function() { return transport.state; }
+    });
+
+    this.stream.write(JSON.stringify({ t: 0, type: 'header',
+				       version: TRACE_VERSION,
+				       start: new Date().toISOString() }) +
+		      '\n');
+
+    transport.on('stateChange', function(state) {
+	self.record({ type: 'stateChange', state: state });
+	self.emit('stateChange', state);
+    });
+    transport.on('discover', function(peripheral) {
+	var wrapped = self.peripherals[peripheral.address];
+
+	if (!wrapped) {
+	    wrapped = new RecordingPeripheral(self, peripheral);
+	    self.peripherals[peripheral.address] = wrapped;
+	}
+	self.record({ type: 'discover', address: peripheral.address,
+		      advertisement: {
+			  localName: peripheral.advertisement.localName,
+			  serviceUuids: peripheral.advertisement.serviceUuids
+		      } });
+	self.emit('discover', wrapped);
+    });
+}
+
+util.inherits(TraceRecorder, events.EventEmitter);
+
+// Appends a record stamped with the current time.
+TraceRecorder.prototype.record = function(record) {
+    var line = { t: Math.round((now() - this.startTime) * 1000) / 1000 };
+
+    Object.keys(record).forEach(function(key) {
+	line[key] = record[key];
+    });
+    this.stream.write(JSON.stringify(line) + '\n');
+};
+
+TraceRecorder.prototype.startScanning = function(serviceUUIDs,
+						 allowDuplicates) {
+    this.record({ type: 'scanStart' });
+    this.transport.startScanning(serviceUUIDs, allowDuplicates);
+};
+
+TraceRecorder.prototype.stopScanning = function() {
+    this.record({ type: 'scanStop' });
+    this.transport.stopScanning();
+};
+
+// Flushes the trace; callback is called when all records are written.
+TraceRecorder.prototype.close = function(callback) {
+    this.stream.end(callback);
+};
+
+// Reads a trace file. Returns the records without header.
+function readTrace(file) {
+    var lines = fs.readFileSync(file, 'utf8').split('\n').filter(
+	function(line) { return line.trim() !== ''; });
+    var header = JSON.parse(lines[0]);
+
+    if (header.type !== 'header' || header.version !== TRACE_VERSION)
+	throw new Error('Unsupported trace format: ' + file);
+
+    return lines.slice(1).map(function(line) {
+	return JSON.parse(line);
+    });
+}
+
+// Traces without properties give characteristics without properties.
+function ReplayCharacteristic(uuid, properties) {
+    events.EventEmitter.call(this);
+    this.uuid = uuid;
+    this.properties = properties;
+}
+
+util.inherits(ReplayCharacteristic, events.EventEmitter);
+
+function ReplayDescriptor(peripheral, uuid) {
+    this.peripheral = peripheral;
+    this.uuid = uuid;
+}
+
+ReplayDescriptor.prototype.writeValue = function(data, callback) {
+    this.peripheral.request('writeDescriptor', function(record) {
+	callback(record.error ? new Error(record.error) : null);
+    });
+};
+
+function ReplayService(peripheral, uuid) {
+    this.peripheral = peripheral;
+    this.uuid = uuid;
+}
+
+ReplayService.prototype.discoverCharacteristics = function(uuids,
+							   callback) {
+    var peripheral = this.peripheral;
+
+    peripheral.request('characteristics', function(record) {
+	var chars = record.characteristics.map(function(uuid, i) {
+	    var c = new ReplayCharacteristic(uuid, record.properties ?
+					     record.properties[i] : undefined);
+
+	    c.subscribe = function(callback) {
+		peripheral.request('subscribe', function(record) {
+		    callback(record.error ? new Error(record.error) : null);
+		});
+	    };
+	    c.write = function(data, withoutResponse, callback) {
+		peripheral.request('write', function(record) {
+		    callback(record.error ? new Error(record.error) : null);
+		});
+	    };
+	    c.discoverDescriptors = function(callback) {
+		peripheral.request('descriptors', function(record) {
+		    callback(record.error ? new Error(record.error) : null,
+			     record.descriptors.map(function(uuid) {
+				 return new ReplayDescriptor(peripheral, uuid);
+			     }));
+		});
+	    };
+	    return c;
+	});
+
+	// Notifications are passed to the characteristics of the latest
+	// discovery.
+	peripheral.chars = {};
+	chars.forEach(function(c) {
+	    peripheral.chars[c.uuid] = c;
+	});
+	callback(record.error ? new Error(record.error) : null, chars);
+    });
+};
+
+// Results of requests (connect, discovery, subscribe, write) are taken from the
+// trace in the recorded order. A result is passed to the gateway when the
+// gateway has issued the request and the replay has reached the time of
+// the result, whichever is later.
+function ReplayPeripheral(transport, address, advertisement) {
+    events.EventEmitter.call(this);
+    this.transport = transport;
+    this.address = address;
+    this.advertisement = advertisement;
+    this.chars = {};
+    // Recorded results not requested so far and requests waiting for their
+    // result, indexed by record type.
+    this.results = {};
+    this.requests = {};
+}
+
+util.inherits(ReplayPeripheral, events.EventEmitter);
+
+ReplayPeripheral.prototype.request = function(type, callback) {
+    var results = this.results[type];
+
+    if (results && results.length > 0) {
+	setImmediate(callback, results.shift());
+    } else {
+	this.requests[type] = callback;
+    }
+};
+
+ReplayPeripheral.prototype.onResult = function(record) {
+    var callback = this.requests[record.type];
+
+    if (callback) {
+	delete this.requests[record.type];
+	callback(record);
+    } else {
+	this.results[record.type] = this.results[record.type] || [];
+	this.results[record.type].push(record);
+    }
+};
+
+ReplayPeripheral.prototype.onDisconnect = function(reason) {
+    var self = this;
+
+    // Results of the lost link that the gateway has not requested and
+    // requests without results are void.
+    Object.keys(this.results).forEach(function(type) {
+	self.transport.stats.dropped += self.results[type].length;
+    });
+    this.results = {};
+    this.requests = {};
+    this.chars = {};
+    this.emit('disconnect', reason !== null ? reason : undefined);
+};
+
+ReplayPeripheral.prototype.connect = function(callback) {
+    this.request('connect', function(record) {
+	callback(record.error ? new Error(record.error) : null);
+    });
+};
+
+// The gateway's own disconnects are part of the trace.
+ReplayPeripheral.prototype.disconnect = function() {
+};
+
+ReplayPeripheral.prototype.discoverServices = function(uuids, callback) {
+    var self = this;
+
+    this.request('services', function(record) {
+	callback(record.error ? new Error(record.error) : null,
+		 record.services.map(function(uuid) {
+		     return new ReplayService(self, uuid);
+		 }));
+    });
+};
+
+// Options:
+// * speed: replay speed relative to the recording; 0 replays as fast as
+//   possible (default: 1).
+//
+// Events besides the noble events:
+// * 'end': all records have been replayed.
+function ReplayTransport(records, options) {
+    events.EventEmitter.call(this);
+
+    options = options || {};
+    this.records = records;
+    this.speed = options.speed !== undefined ? options.speed : 1;
+    this.state = 'unknown';
+    this.isScanning = false;
+    this.peripherals = {};
+    this.index = 0;
+    this.stats = {
+	// Replayed records.
+	records: 0,
+	// Records that did not match the behaviour of the gateway, e.g.,
+	// discoveries while not scanning or notifications without
+	// subscription.
+	dropped: 0,
+	// Delay of the replay behind the recorded time [ms]; only for
+	// speed > 0.
+	lateness: []
+    };
+}
+
+util.inherits(ReplayTransport, events.EventEmitter);
+
+ReplayTransport.prototype.startScanning = function(serviceUUIDs,
+						   allowDuplicates) {
+    this.isScanning = true;
+};
+
+ReplayTransport.prototype.stopScanning = function() {
+    this.isScanning = false;
+};
+
+// Starts the replay.
+ReplayTransport.prototype.play = function() {
+    this.startTime = now();
+    this.scheduleNext();
+};
+
+ReplayTransport.prototype.scheduleNext = function() {
+    var self = this;
+    var record, delay;
+
+    if (this.index >= this.records.length) {
+	setImmediate(function() {
+	    self.emit('end');
+	});
+	return;
+    }
+
+    record = this.records[this.index];
+    if (this.speed > 0) {
+	delay = record.t / this.speed - (now() - this.startTime);
+	setTimeout(function() {
+	    self.playDue();
+	}, Math.max(0, delay));
+    } else {
+	setImmediate(function() {
+	    self.playDue();
+	});
+    }
+};
+
+ReplayTransport.prototype.playDue = function() {
+    var elapsed = now() - this.startTime;
+    var record;
+
+    // Records that are due are replayed in one go, so the replay catches up
+    // if the gateway is slower than the recording.
+    do {
+	record = this.records[this.index++];
+	if (this.speed > 0)
+	    this.stats.lateness.push(Math.max(0, elapsed -
+					      record.t / this.speed));
+	this.stats.records++;
+	this.replay(record);
+    } while (this.speed > 0 && this.index < this.records.length &&
+	     this.records[this.index].t / this.speed <= elapsed);
+
+    this.scheduleNext();
+};
+
+ReplayTransport.prototype.replay = function(record) {
+    var peripheral = this.peripherals[record.address];
+    var c;
+
+    if (record.address !== undefined && record.type !== 'discover' &&
+	!peripheral) {
+	// The recorded gateway knew the device before the recording.
+	this.stats.dropped++;
+	return;
+    }
+
+    switch (record.type) {
+    case 'stateChange':
+	this.state = record.state;
+	this.emit('stateChange', record.state);
+	break;
+    case 'discover':
+	if (!peripheral) {
+	    peripheral = new ReplayPeripheral(this, record.address,
+					      record.advertisement);
+	    this.peripherals[record.address] = peripheral;
+	}
+	if (this.isScanning)
+	    this.emit('discover', peripheral);
+	else
+	    this.stats.dropped++;
+	break;
+    case 'connect':
+    case 'services':
+    case 'characteristics':
+    case 'subscribe':
+    case 'write':
+    case 'descriptors':
+    case 'writeDescriptor':
+	peripheral.onResult(record);
+	break;
+    case 'notification':
+	c = peripheral.chars[record.characteristic];
+	if (c && c.listeners('read').length > 0) {
+	    c.emit('data', Buffer.from(record.data, 'hex'), true);
+	    c.emit('read', Buffer.from(record.data, 'hex'), true);
+	} else {
+	    this.stats.dropped++;
+	}
+	break;
+    case 'disconnect':
+	peripheral.onDisconnect(record.reason);
+	break;
+    }
+};
+
+module.exports.TraceRecorder = TraceRecorder;
+module.exports.ReplayTransport = ReplayTransport;
+module.exports.readTrace = readTrace;
@@ -0,0 +1,270 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Failover test of redundant gateways (see lib/redundancy.js). Several
+// gateways run in this process and coordinate over multicast on the
+// loopback interface. The gateways subscribe to indications, so the
+// simulated devices are in acknowledged mode (see sim-transport.js).
+// Devices ring at random, and the active gateway crashes repeatedly: it
+// stops sending heartbeats, and its links are lost before the alarm in
+// flight has been confirmed. Right after each crash, every device rings
+// once while no gateway is connected; the device must keep the alarm and
+// send it after the next gateway has connected and subscribed. The crashed
+// gateway restarts after some time and stands by. The test reports the
+// failover time, i.e., the time from the crash until the next gateway has
+// connected all devices, and fails if an alarm has been delivered twice or
+// not at all.
+//
+// Usage:
+// node doorbell20-failover.js [--gateways n] [--devices n] [--crashes n]
+//     [--crash-interval ms] [--interval ms] [--port port] [--seed n]
+
+var DoorBell20Client = require('../lib/doorbell20-client');
+var SimTransport = require('../lib/sim-transport');
+var Coordinator = require('../lib/redundancy');
+var measure = require('../lib/measure');
+
+var now = measure.now;
+var report = measure.report;
+
+// Command line options and their defaults.
+var options = {
+    // Number of redundant gateways.
+    'gateways': 3,
+    // Number of simulated devices.
+    'devices': 5,
+    // Number of crashes of the active gateway.
+    'crashes': 5,
+    // Time from the failover until the next crash [ms].
+    'crash-interval': 5000,
+    // Mean time between two rings of a device [ms].
+    'interval': 200,
+    // UDP port of the multicast group.
+    'port': 20020,
+    'seed': 1
+};
+
+function usage() {
+    console.log('Usage: node doorbell20-failover.js ' +
+		Object.keys(options).map(function(name) {
+		    return '[--' + name + ' ' + options[name] + ']';
+		}).join(' '));
+    process.exit(-1);
+}
+
+function parseOptions(argv) {
+    var i, name, value;
+
+    for (i = 0; i < argv.length; i += 2) {
+	name = argv[i].replace(/^--/, '');
+	if (argv[i].indexOf('--') !== 0 || !options.hasOwnProperty(name) ||
+	    argv[i + 1] === undefined)
+	    usage();
+	value = Number(argv[i + 1]);
+	if (isNaN(value) || value < 0)
+	    usage();
+	options[name] = value;
+    }
+}
+
+// A gateway with its own transport, which shares the simulated devices.
+function Gateway(n, devices, random, onAlarm) {
+    var self = this;
+
+    this.name = 'gateway' + n;
+    this.transport = new SimTransport({ seed: Math.floor(random.next() *
+							  0xffffffff) });
+    devices.forEach(function(device) {
+	self.transport.addSharedPeripheral(device);
+    });
+    this.client = new DoorBell20Client(this.transport, devices.map(
+	function(device) {
+	    return device.address;
+	}), { reconnectDelay: 100, acknowledged: true });
+    this.client.on('alarm', function(address, alarm) {
+	if (!self.coordinator.isDuplicate(address, alarm))
+	    onAlarm(self, address, alarm);
+    });
+}
+
+Gateway.prototype.start = function() {
+    var self = this;
+
+    this.coordinator = new Coordinator({ id: this.name,
+					 port: options.port,
+					 interface: '127.0.0.1' });
+    this.coordinator.on('active', function() {
+	self.client.start();
+    });
+    this.coordinator.on('standby', function() {
+	self.client.stop();
+    });
+    this.coordinator.start();
+};
+
+// The gateway stops sending heartbeats, and its links are lost.
+Gateway.prototype.crash = function() {
+    this.coordinator.stop();
+    if (this.coordinator.isActive)
+	this.client.stop();
+};
+
+function main() {
+    var random, base, devices, gateways, delivered, failoverTimes;
+    var duplicates = 0;
+    var crashes = 0;
+    var crashTime = null;
+    // Alarms of rings while a device was disconnected.
+    var disconnectedRings = [];
+    var connected = {};
+    var isRinging = true;
+    var i;
+
+    parseOptions(process.argv.slice(2));
+    if (options.gateways < 2 || options.devices < 1)
+	usage();
+
+    base = new SimTransport({ seed: options.seed });
+    random = base.random;
+    devices = [];
+    for (i = 0; i < options.devices; i++) {
+	devices.push(base.addPeripheral('d2:0b:e1:20:00:' +
+					('0' + i.toString(16)).slice(-2),
+					{ connectDelay: 200,
+					  acknowledged: true }));
+    }
+
+    // Sequence numbers of the delivered alarms per device.
+    delivered = {};
+    devices.forEach(function(device) {
+	delivered[device.address] = {};
+    });
+    failoverTimes = [];
+
+    function onAlarm(gateway, address, alarm) {
+	if (delivered[address][alarm.seq])
+	    duplicates++;
+	delivered[address][alarm.seq] = true;
+    }
+
+    gateways = [];
+    for (i = 0; i < options.gateways; i++)
+	gateways.push(new Gateway(i, devices, random, onAlarm));
+
+    function activeGateway() {
+	var active = gateways.filter(function(gateway) {
+	    return gateway.coordinator.isActive;
+	});
+
+	return active.length === 1 ? active[0] : null;
+    }
+
+    function finish() {
+	var missing = 0;
+	var missingDisconnected = disconnectedRings.filter(function(ring) {
+	    return ring.seq === null || !delivered[ring.address][ring.seq];
+	}).length;
+
+	devices.forEach(function(device) {
+	    var seq;
+
+	    for (seq = 1; seq <= device.seq; seq++) {
+		if (!delivered[device.address][seq])
+		    missing++;
+	    }
+	});
+
+	report('gateways', gateways.length);
+	report('devices', devices.length);
+	report('crashes', crashes);
+	report('rings', devices.reduce(function(sum, device) {
+	    return sum + device.stats.rings;
+	}, 0));
+	report('retransmissions', devices.reduce(function(sum, device) {
+	    return sum + device.stats.retransmissions;
+	}, 0));
+	report('rings while disconnected', disconnectedRings.length);
+	report('of these not delivered', missingDisconnected);
+	report('duplicates delivered', duplicates);
+	report('rings not delivered', missing);
+	report('failover p50/p90/p99/max', measure.formatDelays(failoverTimes));
+	process.exit(duplicates > 0 || missing > 0 || missingDisconnected > 0 ?
+		     1 : 0);
+    }
+
+    function crash() {
+	var gateway = activeGateway();
+
+	if (!gateway) {
+	    setTimeout(crash, 100);
+	    return;
+	}
+	crashes++;
+	crashTime = now();
+	connected = {};
+	gateway.crash();
+	// The links of the crashed gateway are lost. A ring not kept by the
+	// device has no sequence number.
+	devices.forEach(function(device) {
+	    var isKept;
+
+	    if (device.isConnected)
+		return;
+	    isKept = device.ring();
+	    disconnectedRings.push({ address: device.address,
+				     seq: isKept ? device.seq : null });
+	});
+	// Restart as standby gateway after the failover.
+	setTimeout(function() {
+	    gateway.start();
+	}, 3 * gateway.coordinator.failoverTimeout);
+    }
+
+    gateways.forEach(function(gateway) {
+	gateway.client.on('connected', function(address) {
+	    connected[address] = true;
+	    if (Object.keys(connected).length < devices.length)
+		return;
+	    connected = {};
+	    if (crashTime !== null) {
+		failoverTimes.push(now() - crashTime);
+		crashTime = null;
+	    }
+	    if (crashes < options.crashes) {
+		setTimeout(crash, random.around(options['crash-interval']));
+	    } else {
+		// Let the devices deliver all alarms.
+		isRinging = false;
+		setTimeout(finish, 2000);
+	    }
+	});
+	gateway.start();
+    });
+
+    devices.forEach(function(device) {
+	function ring() {
+	    if (!isRinging)
+		return;
+	    device.ring();
+	    setTimeout(ring, random.exponential(options.interval));
+	}
+	setTimeout(ring, random.exponential(options.interval));
+    });
+}
+
+main();
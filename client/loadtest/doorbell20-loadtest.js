@@ -0,0 +1,347 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Load test of the gateway. Simulated DoorBell20 devices (see
+// sim-transport.js) ring at random, and the alarms pass through the same
+// DoorBell20Client as in the IFTTT client. The test reports the throughput,
+// the delivery delay from the ring to the alarm handler of the gateway, and
+// the memory growth of the gateway process. Optionally, the alarms are
+// pushed to local event stream subscribers (see lib/event-stream.js), and
+// the delay added by the stream is reported. With option --history, the
+// alarms are stored in the history (see lib/history.js), and the time to
+// store an alarm and to query the history is reported. With option
+// --legacy-devices, the first devices send alarms like the released firmware
+// (time only).
+//
+// Usage:
+// node doorbell20-loadtest.js [--devices n] [--rings n] [--interval ms]
+//     [--burst n] [--burst-spacing ms] [--connect-delay ms]
+//     [--conn-interval ms] [--disconnect-mean ms] [--seed n]
+//     [--trace file] [--metrics-port port] [--stream-clients n]
+//     [--history dir] [--legacy-devices n]
+//
+// Run node with --expose-gc to measure memory after garbage collection.
+
+var DoorBell20Client = require('../lib/doorbell20-client');
+var SimTransport = require('../lib/sim-transport');
+var measure = require('../lib/measure');
+var trace = require('../lib/trace');
+var metrics = require('../lib/metrics');
+var EventStreamServer = require('../lib/event-stream');
+var History = require('../lib/history');
+var http = require('http');
+
+var now = measure.now;
+var report = measure.report;
+
+// Command line options and their defaults.
+var options = {
+    // Number of simulated devices.
+    'devices': 100,
+    // Rings per device.
+    'rings': 50,
+    // Mean time between two bursts of rings of a device [ms].
+    'interval': 100,
+    // Rings per burst and their spacing [ms].
+    'burst': 1,
+    'burst-spacing': 5,
+    // Mean time to connect to a device [ms].
+    'connect-delay': 200,
+    // Connection interval of the devices [ms].
+    'conn-interval': 100,
+    // Mean time until a device loses the link; 0 for stable links [ms].
+    'disconnect-mean': 0,
+    'seed': 1,
+    // Records a trace of the BLE events to this file (see lib/trace.js).
+    'trace': '',
+    // Serves the metrics of the gateway at this port (see lib/metrics.js);
+    // 0 disables metrics.
+    'metrics-port': 0,
+    // Number of local event stream subscribers; 0 disables the stream.
+    'stream-clients': 0,
+    // Stores the alarms in the history in this directory.
+    'history': '',
+    // Number of devices sending alarms like the released firmware.
+    'legacy-devices': 0
+};
+
+function usage() {
+    console.log('Usage: node doorbell20-loadtest.js ' +
+		Object.keys(options).map(function(name) {
+		    return '[--' + name + ' ' + options[name] + ']';
+		}).join(' '));
+    process.exit(-1);
+}
+
+function parseOptions(argv) {
+    var i, name, value;
+
+    for (i = 0; i < argv.length; i += 2) {
+	name = argv[i].replace(/^--/, '');
+	if (argv[i].indexOf('--') !== 0 || !options.hasOwnProperty(name) ||
+	    argv[i + 1] === undefined)
+	    usage();
+	value = typeof options[name] === 'number' ? Number(argv[i + 1]) :
+	    argv[i + 1];
+	if (typeof value === 'number' && (isNaN(value) || value < 0))
+	    usage();
+	options[name] = value;
+    }
+}
+
+// Subscribes count clients to the event stream server and calls back when
+// all are subscribed. Every received alarm adds the time since its
+// publication to delays.
+function subscribeStreamClients(stream, count, delays, callback) {
+    var port = stream.server.address().port;
+    var i;
+
+    stream.on('subscribe', function onSubscribe(subscribers) {
+	if (subscribers === count) {
+	    stream.removeListener('subscribe', onSubscribe);
+	    callback();
+	}
+    });
+    for (i = 0; i < count; i++) {
+	http.get({ host: '127.0.0.1', port: port, path: '/events' },
+		 function(res) {
+	    var buffer = '';
+
+	    res.setEncoding('utf8');
+	    res.on('data', function(chunk) {
+		var frames;
+
+		buffer += chunk;
+		frames = buffer.split('\n\n');
+		buffer = frames.pop();
+		frames.forEach(function(frame) {
+		    var match = /^event: alarm\ndata: (.*)$/m.exec(frame);
+
+		    if (match)
+			delays.push(now() - JSON.parse(match[1]).publishedAt);
+		});
+	    });
+	});
+    }
+}
+
+// Reports the size of the history and the time of queries over the whole
+// history.
+function reportHistory(history, appendTimes) {
+    var to = Date.now() / 1000 + 1;
+    var t;
+
+    report('append p50/p90/p99/max', measure.formatDelays(appendTimes));
+    report('history size', history.count + ' alarms, ' +
+	   (history.size() / 1024).toFixed(1) + ' KB');
+    t = now();
+    history.counts(0, to);
+    report('history counts', (now() - t).toFixed(1) + ' ms');
+    t = now();
+    history.histogram(0, to);
+    report('history histogram', (now() - t).toFixed(1) + ' ms');
+    t = now();
+    history.range(to - 3600, to, history.devices[0]);
+    report('history range (1 h)', (now() - t).toFixed(1) + ' ms');
+}
+
+function runLoad(transport, peripherals, client, recorder, gatewayMetrics,
+		 stream, streamDelays, history) {
+    var random = transport.random;
+    var ringTimes = {};
+    var delays = [];
+    var appendTimes = [];
+    var dropped = 0;
+    var devicesRinging = peripherals.length;
+    var memory, startTime, lastDelivery;
+
+    function finish() {
+	var elapsed = (lastDelivery - startTime) / 1000;
+	var stats = { rings: 0, sent: 0, lost: 0, connects: 0,
+		      disconnects: 0 };
+
+	var memoryGrowth = memory.stop();
+
+	peripherals.forEach(function(peripheral) {
+	    Object.keys(stats).forEach(function(key) {
+		stats[key] += peripheral.stats[key];
+	    });
+	});
+
+	report('devices', peripherals.length);
+	report('rings', stats.rings);
+	report('delivered', delays.length);
+	report('dropped (invalid)', dropped);
+	report('lost (not sent)', stats.lost);
+	report('connects', stats.connects);
+	report('disconnects', stats.disconnects);
+	report('duration', elapsed.toFixed(2) + ' s');
+	report('throughput', (delays.length / elapsed).toFixed(1) + ' alarms/s');
+	report('delay p50/p90/p99/max', measure.formatDelays(delays));
+	report('memory growth', memoryGrowth);
+	if (stream)
+	    report('stream p50/p90/p99/max', measure.formatDelays(streamDelays));
+	if (history)
+	    reportHistory(history, appendTimes);
+	if (recorder) {
+	    recorder.close(function() {
+		process.exit(0);
+	    });
+	} else {
+	    process.exit(0);
+	}
+    }
+
+    // Every delivered alarm is matched with its ring; notifications of a
+    // device are delivered in order.
+    peripherals.forEach(function(peripheral) {
+	ringTimes[peripheral.address] = [];
+	peripheral.on('deliver', function(ringTime) {
+	    ringTimes[peripheral.address].push(ringTime);
+	});
+    });
+    client.on('dropped', function(address) {
+	ringTimes[address].shift();
+	dropped++;
+    });
+    client.on('alarm', function(address, alarm) {
+	lastDelivery = now();
+	delays.push(lastDelivery - ringTimes[address].shift());
+	if (stream)
+	    stream.publish('alarm', { device: address, time: alarm.time,
+				      inputs: alarm.inputs,
+				      publishedAt: lastDelivery });
+	if (history) {
+	    history.append(address, alarm, Date.now());
+	    appendTimes.push(now() - lastDelivery);
+	}
+	// The delay measurement is the sink of the load test.
+	if (gatewayMetrics)
+	    gatewayMetrics.sinkRequest('loadtest', alarm, lastDelivery,
+				       lastDelivery, 200);
+    });
+
+    // Finishes when all devices have stopped ringing and all sent
+    // notifications have been delivered or lost.
+    function waitForDelivery() {
+	var isPending = peripherals.some(function(peripheral) {
+	    return peripheral.queue.length > 0;
+	});
+
+	if (stream && streamDelays.length <
+	    delays.length * options['stream-clients'])
+	    isPending = true;
+
+	if (isPending)
+	    setTimeout(waitForDelivery, 10);
+	else
+	    finish();
+    }
+
+    memory = new measure.MemoryMonitor();
+    startTime = now();
+    lastDelivery = startTime;
+
+    peripherals.forEach(function(peripheral) {
+	var rings = options.rings;
+
+	function nextBurst() {
+	    var count = Math.min(options.burst, rings);
+
+	    rings -= count;
+	    peripheral.burst(count, options['burst-spacing']);
+	    if (rings > 0) {
+		setTimeout(nextBurst, random.exponential(options.interval));
+	    } else {
+		// Wait until the last burst is over.
+		setTimeout(function() {
+		    if (--devicesRinging === 0)
+			waitForDelivery();
+		}, count * options['burst-spacing']);
+	    }
+	}
+	setTimeout(nextBurst, random.exponential(options.interval));
+    });
+}
+
+function main() {
+    var transport, recorder, client, gatewayMetrics, peripherals, addresses;
+    var stream, streamDelays, history, connected, i;
+    var startTime = now();
+
+    parseOptions(process.argv.slice(2));
+    if (options.burst < 1)
+	usage();
+
+    transport = new SimTransport({ seed: options.seed });
+    peripherals = [];
+    for (i = 0; i < options.devices; i++) {
+	peripherals.push(transport.addPeripheral(
+	    'd2:0b:e1:20:' + ('0' + (i >> 8).toString(16)).slice(-2) + ':' +
+		('0' + (i & 0xff).toString(16)).slice(-2),
+	    { connectDelay: options['connect-delay'],
+	      connInterval: options['conn-interval'],
+	      meanTimeToDisconnect: options['disconnect-mean'],
+	      legacyAlarms: i < options['legacy-devices'] }));
+    }
+    addresses = peripherals.map(function(peripheral) {
+	return peripheral.address;
+    });
+
+    if (options.history)
+	history = new History(options.history);
+    if (options.trace)
+	recorder = new trace.TraceRecorder(transport, options.trace);
+    client = new DoorBell20Client(recorder || transport, addresses,
+				  { reconnectDelay: 100 });
+    if (options['metrics-port'] > 0) {
+	gatewayMetrics = new metrics.GatewayMetrics(client);
+	gatewayMetrics.registry.listen(options['metrics-port']);
+    }
+    client.on('timeout', function(address) {
+	console.log('Connection timeout: ' + address);
+	process.exit(-1);
+    });
+
+    // Start ringing when all devices are connected.
+    connected = {};
+    client.on('connected', function onConnected(address) {
+	connected[address] = true;
+	if (Object.keys(connected).length === addresses.length) {
+	    client.removeListener('connected', onConnected);
+	    report('connect all', (now() - startTime).toFixed(1) + ' ms');
+	    runLoad(transport, peripherals, client, recorder, gatewayMetrics,
+		    stream, streamDelays, history);
+	}
+    });
+
+    if (options['stream-clients'] > 0) {
+	stream = new EventStreamServer();
+	streamDelays = [];
+	stream.listen(0, '127.0.0.1', function() {
+	    subscribeStreamClients(stream, options['stream-clients'],
+				   streamDelays, function() {
+		client.start();
+	    });
+	});
+    } else {
+	client.start();
+    }
+}
+
+main();
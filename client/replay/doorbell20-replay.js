@@ -0,0 +1,123 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a gateway trace recorded with TraceRecorder (see lib/trace.js)
+// through DoorBell20Client and reports how the gateway coped with it.
+//
+// Usage:
+// node doorbell20-replay.js trace.ndjson [--speed x] [--expect-alarms n]
+//
+// Speed 1 replays in real time, larger values accelerate the replay, and
+// 0 replays as fast as possible. As fast as possible, the replay does not
+// wait for the reactions of the gateway, so some records might not match
+// (see dropped records). With --expect-alarms, the replay fails
+// (exit code 1) if the gateway does not emit exactly n alarms, so traces
+// can be used as regression tests.
+
+var DoorBell20Client = require('../lib/doorbell20-client');
+var trace = require('../lib/trace');
+var measure = require('../lib/measure');
+
+var report = measure.report;
+
+function usage() {
+    console.log('Usage: node doorbell20-replay.js trace.ndjson [--speed x] ' +
+		'[--expect-alarms n]');
+    process.exit(-1);
+}
+
+function main() {
+    var argv = process.argv.slice(2);
+    var speed = 1;
+    var expectedAlarms = -1;
+    var records, transport, client, memory, startTime, addresses, i;
+    var isAcknowledged;
+    var stats = { alarms: 0, connects: 0, disconnects: 0, warnings: 0 };
+
+    if (argv.length < 1)
+	usage();
+    for (i = 1; i < argv.length; i += 2) {
+	if (argv[i] === '--speed')
+	    speed = Number(argv[i + 1]);
+	else if (argv[i] === '--expect-alarms')
+	    expectedAlarms = Number(argv[i + 1]);
+	else
+	    usage();
+	if (isNaN(speed) || speed < 0 || isNaN(expectedAlarms))
+	    usage();
+    }
+
+    records = trace.readTrace(argv[0]);
+    transport = new trace.ReplayTransport(records, { speed: speed });
+
+    // The gateway is set up for the devices it has connected to in the
+    // recording, and subscribes to indications if the recorded gateway
+    // did.
+    addresses = [];
+    isAcknowledged = false;
+    records.forEach(function(record) {
+	if (record.type === 'connect' &&
+	    addresses.indexOf(record.address) < 0)
+	    addresses.push(record.address);
+	else if (record.type === 'writeDescriptor')
+	    isAcknowledged = true;
+    });
+
+    // Reconnects are driven by the trace, so the client retries at once.
+    client = new DoorBell20Client(transport, addresses,
+				  { reconnectDelay: 1,
+				    acknowledged: isAcknowledged });
+    client.on('alarm', function() { stats.alarms++; });
+    client.on('connected', function() { stats.connects++; });
+    client.on('disconnected', function() { stats.disconnects++; });
+    client.on('warning', function() { stats.warnings++; });
+
+    transport.on('end', function() {
+	var elapsed = measure.now() - startTime;
+	var recorded = records.length > 0 ? records[records.length - 1].t : 0;
+
+	report('devices', addresses.length);
+	report('records', transport.stats.records);
+	report('dropped records', transport.stats.dropped);
+	report('alarms', stats.alarms);
+	report('subscribed', stats.connects);
+	report('disconnects', stats.disconnects);
+	report('warnings', stats.warnings);
+	report('recorded duration', (recorded / 1000).toFixed(2) + ' s');
+	report('replay duration', (elapsed / 1000).toFixed(2) + ' s');
+	report('records/s', (transport.stats.records * 1000 /
+			     elapsed).toFixed(1));
+	if (speed > 0)
+	    report('lateness p50/p90/p99/max',
+		   measure.formatDelays(transport.stats.lateness));
+	report('memory growth', memory.stop());
+
+	if (expectedAlarms >= 0 && stats.alarms !== expectedAlarms) {
+	    console.log('Expected ' + expectedAlarms + ' alarms.');
+	    process.exit(1);
+	}
+	process.exit(0);
+    });
+
+    memory = new measure.MemoryMonitor();
+    startTime = measure.now();
+    client.start();
+    transport.play();
+}
+
+main();
@@ -0,0 +1,370 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host-side benchmark of the door bell detection algorithms (debounce.h).
+//
+// The benchmark generates the input signal of the nRF51 for a sequence of
+// random presses and feeds it to all algorithms. The signal model follows
+// the DoorBell20 board: the bell transformer voltage is rectified and
+// smoothed by a capacitor, which is discharged by the regulator and the
+// LED of the optocoupler. The input is active while the capacitor voltage
+// is above the threshold of the optocoupler. Without capacitor, the input
+// shows gaps at every zero crossing of the mains voltage. In addition,
+// the contact bounces, and spikes are coupled into the input line.
+//
+// The simulation advances in ticks of the 32.768 kHz low-frequency clock,
+// which is also the time base of the app timer. For every algorithm, the
+// benchmark reports the detection delay (first edge of a press to the
+// reported press), false positives (reported presses without a press or
+// repeated presses during one press), missed presses, and CPU wakeups
+// (edge interrupts plus timer expiries).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "debounce.h"
+
+#define TICKS_PER_SEC 32768
+#define MS_TO_TICKS(ms) ((uint32_t) ((ms) * TICKS_PER_SEC / 1000))
+
+// Default debouncing delay of the firmware (DEBOUNCING_DELAY_MS).
+#define DEFAULT_DELAY_MS 50
+
+// A reported press matches a press if it occurs while the button is
+// pressed or within this time after the release.
+#define MATCH_WINDOW MS_TO_TICKS(1000)
+
+// Maximum number of presses per run.
+#define MAX_PRESSES 4096
+
+struct scenario {
+     const char *name;
+     // Mains frequency [Hz] and peak voltage after the rectifier [V].
+     double mains_hz;
+     double v_peak;
+     // Smoothing capacitor [uF] (0 = none), load current discharging it
+     // [mA], and voltage above which the optocoupler is on [V].
+     double c_uf;
+     double load_ma;
+     double v_on;
+     // Contact bounce after pressing and releasing [ms].
+     double bounce_ms;
+     // Rate of spike bursts on the input line [1/s].
+     double spike_rate_hz;
+     // Fraction of very short taps (30-80 ms) among the presses.
+     double tap_fraction;
+};
+
+// 12 V AC bell transformer: 17 V peak minus 1.4 V for the bridge
+// rectifier. The DoorBell20 board has 100 uF and draws about 12 mA.
+static const struct scenario scenarios[] = {
+     {"board",         50, 15.6, 100, 12, 3.0,  5, 0,   0.1},
+     {"board-bouncy",  50, 15.6, 100, 12, 3.0, 20, 0,   0.1},
+     {"board-noisy",   50, 15.6, 100, 12, 3.0,  5, 0.5, 0.1},
+     {"board-taps",    50, 15.6, 100, 12, 3.0,  5, 0,   0.8},
+     {"no-cap-50Hz",   50, 15.6,   0, 12, 3.0,  5, 0,   0.1},
+     {"no-cap-60Hz",   60, 15.6,   0, 12, 3.0,  5, 0,   0.1},
+     {"no-cap-noisy",  50, 15.6,   0, 12, 3.0,  5, 0.5, 0.1}
+};
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static const char *algorithm_names[DEBOUNCE_ALGORITHM_COUNT] = {
+     [DEBOUNCE_DELAY_RESTART] = "delay-restart",
+     [DEBOUNCE_DELAY_ONCE] = "delay-once",
+     [DEBOUNCE_INTEGRATOR] = "integrator",
+     [DEBOUNCE_RIPPLE_HOLD] = "ripple-hold"
+};
+
+struct press {
+     uint32_t start;
+     uint32_t end;
+     bool is_matched;
+};
+
+struct result {
+     struct press presses[MAX_PRESSES];
+     unsigned int press_count;
+     unsigned int detected;
+     unsigned int false_positives;
+     double delay_sum;
+     uint32_t delay_max;
+     unsigned long wakeups;
+};
+
+struct runner {
+     struct debounce debounce;
+     bool is_timer_running;
+     uint32_t timer_expiry;
+     struct result result;
+};
+
+static uint64_t rng_state;
+
+static double rng_uniform()
+{
+     // xorshift64*; deterministic for a given seed on every host.
+     rng_state ^= rng_state >> 12;
+     rng_state ^= rng_state << 25;
+     rng_state ^= rng_state >> 27;
+     return (double) ((rng_state * 2685821657736338717ULL) >> 11) /
+	  (double) (1ULL << 53);
+}
+
+static double rng_range(double min, double max)
+{
+     return min + (max - min) * rng_uniform();
+}
+
+static unsigned int make_presses(const struct scenario *s, uint32_t duration,
+				 struct press *presses)
+{
+     unsigned int count = 0;
+     uint32_t t = MS_TO_TICKS(rng_range(1000, 5000));
+
+     while (count < MAX_PRESSES) {
+	  double len_ms = (rng_uniform() < s->tap_fraction) ?
+	       rng_range(30, 80) : rng_range(150, 1500);
+	  uint32_t end = t + MS_TO_TICKS(len_ms);
+
+	  if (end + MATCH_WINDOW >= duration)
+	       break;
+	  presses[count].start = t;
+	  presses[count].end = end;
+	  presses[count].is_matched = false;
+	  count++;
+	  // The next press follows after the match window, so reported
+	  // presses can be assigned unambiguously.
+	  t = end + MATCH_WINDOW + MS_TO_TICKS(rng_range(500, 8000));
+     }
+
+     return count;
+}
+
+static void on_event(struct result *r, uint8_t event, uint32_t now)
+{
+     if (event != DEBOUNCE_EVENT_PRESS)
+	  return;
+
+     for (unsigned int i = 0; i < r->press_count; i++) {
+	  struct press *p = &r->presses[i];
+	  if (now < p->start || now > p->end + MATCH_WINDOW)
+	       continue;
+	  if (p->is_matched)
+	       break;
+	  p->is_matched = true;
+	  r->detected++;
+	  r->delay_sum += now - p->start;
+	  if (now - p->start > r->delay_max)
+	       r->delay_max = now - p->start;
+	  return;
+     }
+     r->false_positives++;
+}
+
+static void apply(struct runner *run, struct debounce_action action,
+		  uint32_t now)
+{
+     on_event(&run->result, action.event, now);
+     switch (action.timer) {
+     case DEBOUNCE_TIMER_START:
+	  run->is_timer_running = true;
+	  run->timer_expiry = now + action.timeout;
+	  break;
+     case DEBOUNCE_TIMER_STOP:
+	  run->is_timer_running = false;
+	  break;
+     }
+}
+
+static void run_scenario(const struct scenario *s, uint32_t duration,
+			 const struct debounce_params *params,
+			 struct runner *runners)
+{
+     static struct press presses[MAX_PRESSES];
+     unsigned int press_count = make_presses(s, duration, presses);
+     unsigned int next_press = 0;
+     const double dt = 1.0 / TICKS_PER_SEC;
+     double phase = rng_range(0, 2 * M_PI);
+     double v_cap = 0;
+     bool is_contact_closed = false;
+     bool is_pressed = false;
+     bool was_active = false;
+     uint32_t bounce_end = 0;
+     uint32_t next_toggle = 0;
+     uint32_t spike_end = 0;
+     int spikes_left = 0;
+     uint32_t next_spike = 0;
+
+     for (int a = 0; a < DEBOUNCE_ALGORITHM_COUNT; a++) {
+	  struct runner *run = &runners[a];
+	  memset(&run->result, 0, sizeof(run->result));
+	  memcpy(run->result.presses, presses,
+		 press_count * sizeof(struct press));
+	  run->result.press_count = press_count;
+	  run->is_timer_running = false;
+	  debounce_init(&run->debounce, &params[a]);
+     }
+
+     for (uint32_t now = 0; now < duration; now++) {
+	  // Button.
+	  if (next_press < press_count && !is_pressed &&
+	      now == presses[next_press].start) {
+	       is_pressed = true;
+	       bounce_end = now + MS_TO_TICKS(s->bounce_ms);
+	       next_toggle = now;
+	  } else if (is_pressed && now == presses[next_press].end) {
+	       is_pressed = false;
+	       next_press++;
+	       bounce_end = now + MS_TO_TICKS(s->bounce_ms);
+	       next_toggle = now;
+	  }
+	  if (now < bounce_end) {
+	       // The contact toggles every 30-300 us while bouncing.
+	       if (now >= next_toggle) {
+		    is_contact_closed = !is_contact_closed;
+		    next_toggle = now + (uint32_t) rng_range(1, 10);
+	       }
+	  } else {
+	       is_contact_closed = is_pressed;
+	  }
+
+	  // Rectified and smoothed bell voltage.
+	  double v_rect = is_contact_closed ?
+	       s->v_peak * fabs(sin(2 * M_PI * s->mains_hz * now * dt +
+				    phase)) : 0;
+	  if (s->c_uf > 0) {
+	       v_cap -= (s->load_ma / 1000) / (s->c_uf / 1e6) * dt;
+	       if (v_cap < 0)
+		    v_cap = 0;
+	       if (v_rect > v_cap)
+		    v_cap = v_rect;
+	  } else {
+	       v_cap = v_rect;
+	  }
+	  bool active = v_cap > s->v_on;
+
+	  // Spike bursts of 1-4 spikes (30-200 us each).
+	  if (spikes_left == 0 && s->spike_rate_hz > 0 &&
+	      rng_uniform() < s->spike_rate_hz * dt) {
+	       spikes_left = (int) rng_range(1, 5);
+	       next_spike = now;
+	  }
+	  if (spikes_left > 0 && now >= next_spike) {
+	       spike_end = now + (uint32_t) rng_range(1, 7);
+	       next_spike = spike_end + (uint32_t) rng_range(5, 60);
+	       spikes_left--;
+	  }
+	  if (now < spike_end)
+	       active = true;
+
+	  for (int a = 0; a < DEBOUNCE_ALGORITHM_COUNT; a++) {
+	       struct runner *run = &runners[a];
+	       if (active != was_active) {
+		    run->result.wakeups++;
+		    apply(run, debounce_edge(&run->debounce, now, active), now);
+	       }
+	       if (run->is_timer_running && now == run->timer_expiry) {
+		    run->is_timer_running = false;
+		    run->result.wakeups++;
+		    apply(run, debounce_timeout(&run->debounce, now, active),
+			  now);
+	       }
+	  }
+	  was_active = active;
+     }
+}
+
+static void print_result(const struct scenario *s, const char *algorithm,
+			 const struct result *r)
+{
+     unsigned int missed = r->press_count - r->detected;
+
+     printf("%-14s %-14s %7u %6u %6u %8.1f %8.1f %9.1f\n",
+	    s->name, algorithm, r->press_count, missed, r->false_positives,
+	    r->detected > 0 ?
+	    r->delay_sum / r->detected * 1000 / TICKS_PER_SEC : 0.0,
+	    (double) r->delay_max * 1000 / TICKS_PER_SEC,
+	    r->press_count > 0 ?
+	    (double) r->wakeups / r->press_count : 0.0);
+}
+
+static void usage(const char *name)
+{
+     fprintf(stderr, "Usage: %s [-d duration_s] [-s seed] [-m delay_ms]\n",
+	     name);
+     exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+     static struct runner runners[DEBOUNCE_ALGORITHM_COUNT];
+     struct debounce_params params[DEBOUNCE_ALGORITHM_COUNT];
+     double duration_s = 600;
+     double delay_ms = DEFAULT_DELAY_MS;
+     unsigned long seed = 1;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "d:s:m:")) != -1) {
+	  switch (opt) {
+	  case 'd':
+	       duration_s = atof(optarg);
+	       break;
+	  case 's':
+	       seed = strtoul(optarg, NULL, 0);
+	       break;
+	  case 'm':
+	       delay_ms = atof(optarg);
+	       break;
+	  default:
+	       usage(argv[0]);
+	  }
+     }
+     // The simulation uses 32 bit tick counters.
+     if (duration_s <= 0 || duration_s > 100000 || delay_ms <= 0)
+	  usage(argv[0]);
+
+     memset(params, 0, sizeof(params));
+     for (int a = 0; a < DEBOUNCE_ALGORITHM_COUNT; a++) {
+	  params[a].algorithm = a;
+	  params[a].delay = MS_TO_TICKS(delay_ms);
+	  // 4 samples with 5 ms in between.
+	  params[a].sample_interval = MS_TO_TICKS(5);
+	  params[a].integrator_limit = 4;
+	  // Longer than half a mains period at 50 Hz (10 ms) plus the time
+	  // a rippled input stays inactive.
+	  params[a].hold = MS_TO_TICKS(25);
+     }
+
+     printf("%-14s %-14s %7s %6s %6s %8s %8s %9s\n", "scenario",
+	    "algorithm", "presses", "missed", "false+", "delay_ms", "max_ms",
+	    "wakeups/p");
+     for (unsigned int i = 0; i < SCENARIO_COUNT; i++) {
+	  // Every scenario gets the same random sequence for a given seed.
+	  rng_state = 0x9e3779b97f4a7c15ULL ^ (seed * 0x100000001b3ULL);
+	  run_scenario(&scenarios[i], (uint32_t) (duration_s * TICKS_PER_SEC),
+		       params, runners);
+	  for (int a = 0; a < DEBOUNCE_ALGORITHM_COUNT; a++)
+	       print_result(&scenarios[i], algorithm_names[a],
+			    &runners[a].result);
+     }
+
+     return 0;
+}
@@ -0,0 +1,236 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Algorithms for detecting door bell presses from the raw input signal.
+//
+// The bell signal passes a rectifier, a smoothing capacitor, and an
+// optocoupler, so the input shows contact bounce when the button is
+// pressed and released, ripple of the mains frequency (100/120 Hz) if the
+// capacitor cannot bridge the gaps near the zero crossings, and spikes
+// picked up by the high-impedance input line.
+//
+// The algorithms are written as event-driven state machines without any
+// dependency on the SDK, so they can be used by the firmware (driven by
+// GPIOTE interrupts and an app timer) and by the host-side benchmark in
+// nrf51/debounce-bench (driven by simulated waveforms). Each algorithm is
+// notified of every edge of the input and of the expiry of its timer. It
+// returns the detected press or release and tells the caller how to
+// manage the timer. All times are given in ticks of the 32.768 kHz
+// low-frequency clock; differences are computed modulo 2^24 like the
+// RTC1 counter used by the app timer.
+
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum debounce_algorithm {
+     // Behaviour of app_button (default of the firmware): every edge 
+     // (re)starts the detection timer; the level is sampled when the timer
+     // expires.
+     // Ripple edges keep restarting the timer, so a rippled press might
+     // never be sampled.
+     DEBOUNCE_DELAY_RESTART,
+     // The first edge starts the detection timer; further edges are
+     // ignored until the level has been sampled.
+     DEBOUNCE_DELAY_ONCE,
+     // The level is sampled periodically after an edge. A saturating
+     // counter is incremented for active and decremented for inactive
+     // samples; the state changes when the counter hits its limits.
+     DEBOUNCE_INTEGRATOR,
+     // Ripple-aware: the input counts as active if it is active or has
+     // been active within the hold window, which must be longer than the
+     // ripple gaps (half a mains period).
+     DEBOUNCE_RIPPLE_HOLD,
+     DEBOUNCE_ALGORITHM_COUNT
+};
+
+struct debounce_params {
+     // See enum debounce_algorithm.
+     uint8_t algorithm;
+     // Delay after the first edge until the level is evaluated [ticks].
+     uint32_t delay;
+     // DEBOUNCE_INTEGRATOR: sampling interval [ticks] and counter limit.
+     uint32_t sample_interval;
+     uint8_t integrator_limit;
+     // DEBOUNCE_RIPPLE_HOLD: hold window [ticks].
+     uint32_t hold;
+};
+
+enum debounce_event {
+     DEBOUNCE_EVENT_NONE,
+     DEBOUNCE_EVENT_PRESS,
+     DEBOUNCE_EVENT_RELEASE
+};
+
+enum debounce_timer {
+     // Leave the timer as it is (running or expired).
+     DEBOUNCE_TIMER_KEEP,
+     // (Re)start the single-shot timer with the given timeout.
+     DEBOUNCE_TIMER_START,
+     // Stop the timer.
+     DEBOUNCE_TIMER_STOP
+};
+
+// What the caller needs to do after an edge or timeout.
+struct debounce_action {
+     // See enum debounce_event.
+     uint8_t event;
+     // See enum debounce_timer.
+     uint8_t timer;
+     uint32_t timeout;
+};
+
+struct debounce {
+     const struct debounce_params *params;
+     // Debounced state.
+     bool is_pressed;
+     bool is_timer_running;
+     // Time of the last active edge (DEBOUNCE_RIPPLE_HOLD).
+     uint32_t last_active;
+     uint8_t integrator;
+};
+
+#define DEBOUNCE_TICKS_MASK 0x00ffffff
+
+static inline uint32_t debounce_ticks_diff(uint32_t later, uint32_t earlier)
+{
+     return (later - earlier) & DEBOUNCE_TICKS_MASK;
+}
+
+static inline void debounce_init(struct debounce *d,
+				 const struct debounce_params *params)
+{
+     d->params = params;
+     d->is_pressed = false;
+     d->is_timer_running = false;
+     d->last_active = 0;
+     d->integrator = 0;
+}
+
+static inline struct debounce_action debounce_start_timer(struct debounce *d,
+							  uint32_t timeout)
+{
+     struct debounce_action action = {DEBOUNCE_EVENT_NONE,
+				      DEBOUNCE_TIMER_START, timeout};
+
+     d->is_timer_running = true;
+     return action;
+}
+
+static inline struct debounce_action debounce_report(struct debounce *d,
+						     bool active)
+{
+     // Report a change of the sampled level.
+     struct debounce_action action = {DEBOUNCE_EVENT_NONE,
+				      DEBOUNCE_TIMER_KEEP, 0};
+
+     if (active != d->is_pressed) {
+	  d->is_pressed = active;
+	  action.event = active ? DEBOUNCE_EVENT_PRESS :
+	       DEBOUNCE_EVENT_RELEASE;
+     }
+     return action;
+}
+
+// Called on every edge of the input; active is the level after the edge.
+static inline struct debounce_action debounce_edge(struct debounce *d,
+						   uint32_t now, bool active)
+{
+     struct debounce_action none = {DEBOUNCE_EVENT_NONE,
+				    DEBOUNCE_TIMER_KEEP, 0};
+     const struct debounce_params *p = d->params;
+
+     switch (p->algorithm) {
+     case DEBOUNCE_DELAY_RESTART:
+	  return debounce_start_timer(d, p->delay);
+     case DEBOUNCE_DELAY_ONCE:
+	  if (!d->is_timer_running)
+	       return debounce_start_timer(d, p->delay);
+	  break;
+     case DEBOUNCE_INTEGRATOR:
+	  if (!d->is_timer_running)
+	       return debounce_start_timer(d, p->sample_interval);
+	  break;
+     case DEBOUNCE_RIPPLE_HOLD:
+	  // Confirm a press after the delay; check for a release one hold
+	  // window after the input became inactive.
+	  if (active) {
+	       d->last_active = now;
+	       if (!d->is_pressed && !d->is_timer_running)
+		    return debounce_start_timer(d, p->delay);
+	  } else if (d->is_pressed && !d->is_timer_running) {
+	       return debounce_start_timer(d, p->hold);
+	  }
+	  break;
+     }
+
+     return none;
+}
+
+// Called when the timer started by the algorithm expires; active is the
+// sampled level.
+static inline struct debounce_action debounce_timeout(struct debounce *d,
+						      uint32_t now,
+						      bool active)
+{
+     struct debounce_action action;
+     const struct debounce_params *p = d->params;
+
+     d->is_timer_running = false;
+
+     switch (p->algorithm) {
+     case DEBOUNCE_INTEGRATOR:
+	  if (active && d->integrator < p->integrator_limit)
+	       d->integrator++;
+	  else if (!active && d->integrator > 0)
+	       d->integrator--;
+	  if (d->integrator == p->integrator_limit)
+	       action = debounce_report(d, true);
+	  else if (d->integrator == 0)
+	       action = debounce_report(d, false);
+	  else
+	       action = debounce_report(d, d->is_pressed);
+	  // Keep sampling until the counter rests at the limit matching
+	  // the debounced state. The next edge restarts sampling.
+	  if (d->integrator != (d->is_pressed ? p->integrator_limit : 0)) {
+	       action.timer = DEBOUNCE_TIMER_START;
+	       action.timeout = p->sample_interval;
+	       d->is_timer_running = true;
+	  }
+	  return action;
+     case DEBOUNCE_RIPPLE_HOLD:
+	  action = debounce_report(d, active ||
+				   debounce_ticks_diff(now, d->last_active) <
+				   p->hold);
+	  // A pressed input that is inactive at the moment (ripple gap) is
+	  // checked again after one hold window, since there might be no
+	  // further edge.
+	  if (d->is_pressed && !active) {
+	       action.timer = DEBOUNCE_TIMER_START;
+	       action.timeout = p->hold;
+	       d->is_timer_running = true;
+	  }
+	  return action;
+     default:
+	  return debounce_report(d, active);
+     }
+}
+
+#endif
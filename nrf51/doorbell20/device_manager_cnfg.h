@@ -0,0 +1,45 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Configuration of the device manager of the nRF51 SDK.
+
+#ifndef DEVICE_MANAGER_CNFG_H__
+#define DEVICE_MANAGER_CNFG_H__
+
+// Only the application registers with the device manager.
+#define DEVICE_MANAGER_MAX_APPLICATIONS 1
+
+// The S110 softdevice supports a single connection.
+#define DEVICE_MANAGER_MAX_CONNECTIONS 1
+
+// Only a single bond is stored: the first gateway that bonds with the 
+// device owns it, i.e., it is the only peer allowed to change the 
+// configuration. Further peers can still connect, but cannot bond. 
+// Erase the flash to bond with another gateway.
+#define DEVICE_MANAGER_MAX_BONDS 1
+
+// Maximum number of CCCDs stored per bonded peer. Must not be smaller than
+// the number of characteristics with notifications or indications 
+// (CHAR_CCCD_COUNT in doorbell20.c, checked at compile time). Changing it
+// changes the layout of the stored bond, so bonds must be erased.
+#define DM_GATT_CCCD_COUNT 4
+
+// Size of the GATT server context (CCCDs) stored per bonded peer.
+#define DM_GATT_SERVER_ATTR_MAX_SIZE ((6 * DM_GATT_CCCD_COUNT) + 2)
+
+#endif // DEVICE_MANAGER_CNFG_H__
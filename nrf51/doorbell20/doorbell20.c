@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
 #include <string.h>
 #include <nrf.h>
 #include <nrf_gpio.h>
@@ -23,34 +24,57 @@
 #include <softdevice_handler.h>
 #include <ble_advdata.h>
 #include <app_timer.h>
-#include <app_button.h>
+#include <app_util.h>
 #include <ble_conn_params.h>
 #include <ble_hci.h>
 #include <app_util_platform.h>
-
+#include <ble_radio_notification.h>
+#include <nrf_drv_gpiote.h>
+#include <pstorage.h>
+#include <device_manager.h>
+#include "event_queue.h"
+#include "debounce.h"
+
+// The monitored inputs (door bells, intercom, etc.) are defined by the 
+// table INPUTS below. Each input is an active low GPIO with the given
+// pull configuration (see macro INPUT). The position of an input in the table defines its 
+// bit in the input mask of door bell alarms (see struct door_bell_alarm), 
+// so at most 8 inputs are supported. Each input costs one table entry in 
+// flash and two app timers in RAM. Inputs use low-power GPIOTE events, so
+// GPIOTE_CONFIG_NUM_OF_LOW_POWER_EVENTS (nrf_drv_config.h) must not be 
+// smaller than the number of inputs.
 #ifdef TARGET_BOARD_NRF51DK
 // Pinout of development board (DK):
 // * Pin 17: Button 1
 // * Pin 18: Button 2 
+// * Pin 19: Button 3 
 // * Pin 21: LED 1
 // * Pin 22: LED 2
-#define PIN_BELL 17
+// The buttons need the internal pull-up resistors of the nRF51 chip.
+#define INPUTS { \
+	  INPUT(17, NRF_GPIO_PIN_PULLUP), /* front door */ \
+	  INPUT(18, NRF_GPIO_PIN_PULLUP), /* back door */ \
+	  INPUT(19, NRF_GPIO_PIN_PULLUP)  /* intercom */ \
+     }
 #define PIN_LED 21
 #else
 // Pinout of DoorBell20 board:
-#define PIN_BELL 3
+// The door bell is connected to pin 3, which has an external pull-up 
+// resistor. Further inputs can be connected to unused GPIOs and added 
+// here.
+#define INPUTS { \
+	  INPUT(3, NRF_GPIO_PIN_NOPULL)  /* door bell */ \
+     }
 // Actually, the DoorBell20 board has no LED.
 // Pin 21 is not connected on this board, so it will also do no harm.
 #define PIN_LED 21
 #endif
 
-// Max. length of door bell alarm characteristic [bytes].
-#define MAX_LENGTH_DOOR_BELL_ALARM_CHAR 4
+#define DEVICE_NAME "DoorBell20"
 
-// Max. length of local time characteristic [bytes].
-#define MAX_LENGTH_LOCALTIME_CHAR 4
+// The following timing parameters are defaults. They can be changed at 
+// runtime through the configuration characteristic (see struct config).
 
-#define DEVICE_NAME "DoorBell20"
 // Minimum connection interval in 1.25 ms. Minimum allowed value: 7.5 ms.
 // 80 -> 100 ms.
 #define MIN_CONN_INTERVAL 80
@@ -77,6 +101,106 @@
 // How long to advertise in seconds (0 = forever)
 #define ADV_TIMEOUT 0
 
+// Layout of the advertising data.
+// Every advertising event sends the advertising packet on all three 
+// advertising channels, whereas the scan response is only sent if an 
+// actively scanning central requests it. With the compact layout, the 
+// advertising packet only carries the flags (3 bytes), and the device name 
+// and service UUID (30 bytes) are moved to the scan response. This reduces 
+// the on-air time of an advertising packet from 376 us (31 byte payload) 
+// to 152 us per channel, i.e., the TX time per advertising event from 
+// 1128 us to 456 us. 
+// Note that centrals then need to scan actively to find the device by its 
+// service UUID, which is the default for noble.
+// Set to 0 to send everything in the advertising packet. Name, flags, and 
+// UUID would add up to 33 bytes, which does not fit into an advertising 
+// packet (31 bytes), so the name is shortened to ADV_SHORT_NAME_LEN 
+// characters then.
+#ifndef ADV_PAYLOAD_COMPACT
+#define ADV_PAYLOAD_COMPACT 1
+#endif
+// 31 bytes - flags (3) - UUID (18) - name header (2)
+#define ADV_SHORT_NAME_LEN 8
+
+// Radio transmit power [dBm]. 
+// Supported values: -40, -30, -20, -16, -12, -8, -4, 0, 4.
+// Lower values save energy for every packet sent, but reduce the range.
+#ifndef TX_POWER_LEVEL
+#define TX_POWER_LEVEL 0
+#endif
+
+// Features compiled into the firmware (1: enabled, 0: disabled). The code
+// and data of disabled features are removed by the preprocessor, so they
+// cost neither flash nor RAM. The Makefile sets all features according to
+// the selected profile (PROFILE); the defaults are the diagnostics profile.
+// * FEATURE_CONNECTED: gateways connect to the DoorBell20 service and 
+//   subscribe to alarms. Without it, the device never accepts connections
+//   and broadcasts alarms in its advertising data (broadcast-only).
+// * FEATURE_ACKNOWLEDGED_DELIVERY: indications of alarms and the alarm 
+//   delivery characteristic.
+// * FEATURE_RING_PATTERN: capture of ring patterns.
+// * FEATURE_EARLY_RING: early ring records.
+// * FEATURE_WALLCLOCK: wall-clock time set by the bonded gateway.
+// * FEATURE_HEARTBEAT: heartbeats with the battery voltage.
+// * FEATURE_CONFIG: runtime configuration stored in flash. Otherwise, the
+//   default timing parameters are compiled in.
+// * FEATURE_ENERGY_LEDGER: accounting of radio and CPU activity.
+// All features but FEATURE_CONNECTED require FEATURE_CONNECTED.
+#ifndef FEATURE_CONNECTED
+#define FEATURE_CONNECTED 1
+#endif
+#ifndef FEATURE_ACKNOWLEDGED_DELIVERY
+#define FEATURE_ACKNOWLEDGED_DELIVERY 1
+#endif
+#ifndef FEATURE_RING_PATTERN
+#define FEATURE_RING_PATTERN 1
+#endif
+#ifndef FEATURE_EARLY_RING
+#define FEATURE_EARLY_RING 1
+#endif
+#ifndef FEATURE_WALLCLOCK
+#define FEATURE_WALLCLOCK 1
+#endif
+#ifndef FEATURE_HEARTBEAT
+#define FEATURE_HEARTBEAT 1
+#endif
+#ifndef FEATURE_CONFIG
+#define FEATURE_CONFIG 1
+#endif
+#ifndef FEATURE_ENERGY_LEDGER
+#define FEATURE_ENERGY_LEDGER 1
+#endif
+
+#if !FEATURE_CONNECTED && (FEATURE_ACKNOWLEDGED_DELIVERY || \
+			   FEATURE_RING_PATTERN || FEATURE_EARLY_RING || \
+			   FEATURE_WALLCLOCK || FEATURE_HEARTBEAT || \
+			   FEATURE_CONFIG || FEATURE_ENERGY_LEDGER)
+#error "All features but FEATURE_CONNECTED require FEATURE_CONNECTED"
+#endif
+
+// Writing the configuration and the wall-clock time is restricted to the 
+// bonded gateway, so these features need the device manager.
+#define FEATURE_BONDING (FEATURE_CONFIG || FEATURE_WALLCLOCK)
+
+// Broadcast-only devices (FEATURE_CONNECTED disabled) send scannable, 
+// non-connectable advertisements. The advertising packet carries the flags
+// and the last door bell alarm with the battery level as manufacturer 
+// specific data (see struct broadcast_data); the scan response carries the
+// device name and service UUID, so centrals find the device like a 
+// connectable one. After an alarm, the device advertises with 
+// BROADCAST_BURST_INTERVAL for BROADCAST_BURST_DURATION, so scanners 
+// receive the alarm quickly and with high probability; they detect 
+// repeated alarms by the sequence number.
+// Company identifier of the manufacturer specific data. 0xffff is reserved
+// by the Bluetooth SIG for tests and internal use.
+#define BROADCAST_COMPANY_ID 0xffff
+// Advertisement interval during a burst in 0.625 ms; min. 100 ms for 
+// non-connectable advertising.
+// 160 -> 100 ms.
+#define BROADCAST_BURST_INTERVAL 160
+// -> 5 s
+#define BROADCAST_BURST_DURATION APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER)
+
 // Time after making a connection when to start negotiation of connection 
 // timing parameters [ms].
 // -> 5 s
@@ -90,24 +214,109 @@
 // app timer (RTC0 is used by the softdevice, and, therefore, cannot be used by 
 // the application). 
 #define APP_TIMER_PRESCALER 0
-#define APP_TIMER_QUEUE_SIZE 4
+#define APP_TIMER_QUEUE_SIZE 8
 
 // Delay for debouncing door bell signals [ms].
-#define DEBOUNCING_DELAY APP_TIMER_TICKS(50, APP_TIMER_PRESCALER)
+#define DEBOUNCING_DELAY_MS 50
+
+// Algorithm detecting presses from the raw input signal (see debounce.h
+// and the benchmark in nrf51/debounce-bench). The default restarts the 
+// debouncing delay with every edge like app_button, which works well with
+// the smoothing capacitor of the DoorBell20 board. Use 
+// DEBOUNCE_RIPPLE_HOLD for inputs without smoothing capacitor.
+#ifndef DEBOUNCE_ALGORITHM
+#define DEBOUNCE_ALGORITHM DEBOUNCE_DELAY_RESTART
+#endif
+// Parameters of DEBOUNCE_INTEGRATOR (sampling interval [ms] and number of
+// consistent samples) and DEBOUNCE_RIPPLE_HOLD (hold window [ms]). 
+#define DEBOUNCE_SAMPLE_INTERVAL_MS 5
+#define DEBOUNCE_INTEGRATOR_LIMIT 4
+#define DEBOUNCE_HOLD_MS 25
 
 // Delay for not accepting another door bell event. This delay defines
 // how long two door bell events must be separated in time to be considered
 // two individual events. Note that some users might ring several times in
 // a short period of time. In such cases, we only want to send one event.
-// -> 1 min
-#define ALARM_INHIBIT_DELAY APP_TIMER_TICKS(60000, APP_TIMER_PRESCALER)
+// [ms] -> 1 min
+#define ALARM_INHIBIT_DELAY_MS 60000
 
 // The clock for updating the local time ticks every 
 // LOCALTIME_CLOCK_INTERVAL_SEC seconds. Thus, we need to add this amount of 
 // seconds every time the clock ticks.
 #define LOCALTIME_CLOCK_INTERVAL_SEC 15
-#define LOCALTIME_CLOCK_INTERVAL APP_TIMER_TICKS(\
-(1000*LOCALTIME_CLOCK_INTERVAL_SEC), APP_TIMER_PRESCALER)
+
+// Version of the configuration block (struct config). Increment whenever 
+// the layout changes. Blocks with a different version found in flash are 
+// ignored, and the defaults are used instead.
+#define CONFIG_VERSION 1
+
+// Ring pattern capture.
+// While the door bell is ringing, the durations of presses and the gaps 
+// between presses are recorded with this resolution [ms].
+#define RING_CAPTURE_RESOLUTION_MS 10
+// A ring is considered to be finished if the bell has been released for 
+// this time.
+// -> 1.5 s
+#define RING_CAPTURE_GAP_TIMEOUT APP_TIMER_TICKS(1500, APP_TIMER_PRESCALER)
+// Presses longer than this time end the capture (the press is recorded 
+// with this duration, and the pattern is flagged as truncated). This also
+// bounds intervals to less than one period of the 24 bit RTC counter.
+// -> 30 s
+#define RING_CAPTURE_PRESS_TIMEOUT APP_TIMER_TICKS(30000, APP_TIMER_PRESCALER)
+// Size of the buffer holding the encoded intervals [bytes]. Each interval
+// takes one byte (< 1.28 s) or two bytes, so the buffer can hold at least 
+// 9 intervals (5 presses). Together with the two header bytes, a pattern
+// fits into a single notification (20 bytes with the default ATT MTU).
+#define RING_CAPTURE_BUFFER_SIZE 18
+
+// Acknowledged delivery of door bell alarms.
+// If the client subscribes to indications instead of notifications, every
+// alarm is kept until the client has confirmed its indication.
+// Time to wait for the confirmation of an indication. ATT allows only a
+// single outstanding indication per link, so a lost confirmation would
+// block all further alarms. On timeout, the device therefore drops the
+// link; the alarm is sent again when the client has reconnected.
+// Confirmations usually arrive within two connection intervals.
+// -> 5 s
+#define INDICATION_TIMEOUT APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER)
+// Number of alarms kept until they are confirmed. If more alarms occur
+// while the client is unreachable, they are merged into the newest one.
+#define PENDING_ALARMS_SIZE 4
+
+// Wall-clock time.
+// A bonded gateway sets the wall-clock time by writing the wall-clock 
+// characteristic. Between writes, wall-clock time is extrapolated from 
+// local time, corrected by the drift of the low-frequency clock. The drift
+// is estimated from two writes at least this far apart. Writes are delayed
+// by up to one effective connection interval (more than 1 s with slave 
+// latency), so shorter intervals would mostly measure this delay.
+// -> 1 d
+#define WALLCLOCK_DRIFT_MIN_INTERVAL_SEC 86400
+// The low-frequency crystal is specified with +-20 ppm. Larger deviations 
+// between two writes are caused by the gateway setting its own clock; they
+// do not change the drift estimate.
+#define WALLCLOCK_DRIFT_MAX_PPM 500
+// Earliest wall-clock time accepted from gateways (2016-01-01T00:00:00Z).
+#define WALLCLOCK_MIN_TIME 1451606400
+
+// Battery voltage [mV] of a full and an empty battery (two AA cells in
+// series, 1.5 V and 1.0 V per cell). The battery level is interpolated 
+// linearly in between.
+#define BATTERY_MV_FULL 3000
+#define BATTERY_MV_EMPTY 2000
+
+// Frequency of RTC1 driving the app timer [Hz].
+#define RTC_TICKS_PER_SEC (APP_TIMER_CLOCK_FREQ / (APP_TIMER_PRESCALER + 1))
+// RTC1 is a 24 bit counter.
+#define RTC_COUNTER_MASK 0x00ffffff
+
+// Distance between the radio notification signalling the start of a radio
+// event and the radio becoming active. Without distance, the softdevice 
+// only signals the end of radio events. 
+#define RADIO_NOTIFICATION_DISTANCE NRF_RADIO_NOTIFICATION_DISTANCE_800US
+// -> 800 us rounded to RTC ticks.
+#define RADIO_NOTIFICATION_DISTANCE_TICKS \
+     ((800 * RTC_TICKS_PER_SEC + 500000) / 1000000)
 
 // Service and charateristic UUIDs in Little Endian format.
 // The 16 bit values will become byte 12 and 13 of the 128 bit UUID:
@@ -118,27 +327,412 @@
 #define UUID_SERVICE 0x0001
 #define UUID_CHARACTERISTIC_DOOR_BELL_ALARM 0x0002
 #define UUID_CHARACTERISTIC_LOCALTIME 0x0003
+#define UUID_CHARACTERISTIC_ENERGY_LEDGER 0x0004
+#define UUID_CHARACTERISTIC_RING_PATTERN 0x0005
+#define UUID_CHARACTERISTIC_CONFIG 0x0006
+#define UUID_CHARACTERISTIC_ALARM_DELIVERY 0x0007
+#define UUID_CHARACTERISTIC_EARLY_RING 0x0008
+#define UUID_CHARACTERISTIC_WALLCLOCK 0x0009
+#define UUID_CHARACTERISTIC_HEARTBEAT 0x000a
+
+// Characteristics of the DoorBell20 service. Characteristics are added to 
+// the service in this order as defined by the table characteristics[].
+// Characteristics of disabled features are left out; clients find 
+// characteristics by their UUIDs.
+enum characteristic_index {
+     CHAR_DOOR_BELL_ALARM = 0,
+     CHAR_LOCALTIME,
+#if FEATURE_ENERGY_LEDGER
+     CHAR_ENERGY_LEDGER,
+#endif
+#if FEATURE_RING_PATTERN
+     CHAR_RING_PATTERN,
+#endif
+#if FEATURE_CONFIG
+     CHAR_CONFIG,
+#endif
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+     CHAR_ALARM_DELIVERY,
+#endif
+#if FEATURE_EARLY_RING
+     CHAR_EARLY_RING,
+#endif
+#if FEATURE_WALLCLOCK
+     CHAR_WALLCLOCK,
+#endif
+#if FEATURE_HEARTBEAT
+     CHAR_HEARTBEAT,
+#endif
+     CHAR_COUNT
+};
+
+// Number of characteristics with notifications or indications, i.e., with
+// a CCCD (checked against table characteristics by service_init()). The 
+// device manager stores the CCCDs of the bonded peer (see 
+// DM_GATT_CCCD_COUNT in device_manager_cnfg.h).
+#define CHAR_CCCD_COUNT (1 + FEATURE_RING_PATTERN + FEATURE_EARLY_RING + \
+			 FEATURE_HEARTBEAT)
+#if FEATURE_BONDING && CHAR_CCCD_COUNT > DM_GATT_CCCD_COUNT
+#error "DM_GATT_CCCD_COUNT is smaller than the number of CCCDs"
+#endif
+
+// Properties of characteristics.
+// Readable by everybody.
+#define CHAR_PROP_READ 0x01
+// Supports notifications.
+#define CHAR_PROP_NOTIFY 0x02
+// Writeable over an encrypted link. Writes need to be authorized by the
+// application.
+#define CHAR_PROP_WRITE_AUTH 0x04
+// Variable length value.
+#define CHAR_PROP_VLEN 0x08
+// Supports indications.
+#define CHAR_PROP_INDICATE 0x10
+
+// Characteristic description used to add characteristics to the service.
+struct characteristic {
+     uint16_t uuid;
+     // See CHAR_PROP_*.
+     uint8_t props;
+     // Presentation format (BLE_GATT_CPF_FORMAT_*) and unit (Bluetooth 
+     // SIG assigned number).
+     uint8_t format;
+     uint16_t unit;
+     // Initial value. The value is managed by the BLE stack.
+     const void *p_value;
+     uint16_t init_len;
+     uint16_t max_len;
+};
+
+// Sources waking up the CPU, which are accounted separately in the energy
+// ledger.
+enum wakeup_source {
+     // BLE events from the softdevice.
+     WAKEUP_SOURCE_BLE = 0,
+     // Door bell signal.
+     WAKEUP_SOURCE_BELL,
+     // Local time clock.
+     WAKEUP_SOURCE_LOCALTIME,
+     // Anything else (e.g., softdevice-internal events, spurious wakeups).
+     WAKEUP_SOURCE_OTHER,
+     WAKEUP_SOURCE_COUNT
+};
+
+// The energy ledger records how long the radio and the CPU have been active
+// since boot. Gateways can read it periodically to estimate the energy
+// consumption of a device, e.g., to identify devices with unfavourable
+// connection parameters or a bad radio environment (many retransmissions).
+// All times are given in ticks of the 32.768 kHz low-frequency clock
+// (approx. 30.5 us per tick) and wrap around silently. The ledger is
+// transferred in Little Endian format as defined by the structure.
+struct energy_ledger {
+     // Radio active time while advertising.
+     uint32_t radio_adv_ticks;
+     // Radio active time of connection events without pending notifications.
+     uint32_t radio_conn_ticks;
+     // Radio active time of connection events transmitting notifications.
+     uint32_t radio_notification_ticks;
+     // CPU-awake time per wakeup source (see enum wakeup_source).
+     uint32_t cpu_ticks[WAKEUP_SOURCE_COUNT];
+     // Number of wakeups per wakeup source.
+     uint32_t wakeups[WAKEUP_SOURCE_COUNT];
+     // Number of events lost because the event queue was full (see 
+     // push_event()).
+     uint32_t event_overflows;
+};
+
+// Door bell alarm as sent to the client. Simultaneous alarms of several 
+// inputs are sent as a single alarm with multiple bits set in the input 
+// mask. The structure is packed to send it as 8 bytes in Little Endian 
+// format; it is only accessed by the main loop.
+struct door_bell_alarm {
+     // Time when the (first) input became active [s]: wall-clock time if
+     // DOOR_BELL_ALARM_FLAG_WALLCLOCK is set, local time otherwise.
+     uint32_t time;
+     // Bit i is set if input i (position in table INPUTS) became active.
+     uint8_t inputs;
+     // See DOOR_BELL_ALARM_FLAG_*.
+     uint8_t flags;
+     // Sequence number of the alarm, incremented per alarm and starting
+     // with 1 after boot. A retransmitted alarm keeps its number, so
+     // gateways can detect duplicates.
+     uint16_t seq;
+} __attribute__ ((packed));
+
+// The alarm time is wall-clock time (seconds since 1970-01-01T00:00:00Z).
+#define DOOR_BELL_ALARM_FLAG_WALLCLOCK 0x01
+
+// Heartbeat sent with the local time clock, so gateways can tell a silent
+// device from a lost link. The structure is packed to send it as 7 bytes 
+// in Little Endian format; it is only accessed by the main loop.
+struct heartbeat {
+     // Incremented per heartbeat.
+     uint16_t seq;
+     // Heartbeat interval [s] (local time clock interval).
+     uint16_t interval_sec;
+     // Battery voltage [mV] and level [%] (see BATTERY_MV_*).
+     uint16_t battery_mv;
+     uint8_t battery_level;
+} __attribute__ ((packed));
+
+// Advertised data of broadcast-only devices (without company identifier),
+// packed to send it as 9 bytes in Little Endian format. Only accessed by 
+// the main loop.
+struct broadcast_data {
+     // Last alarm (local time); all fields are 0 before the first alarm.
+     struct door_bell_alarm alarm;
+     // Battery level [%] (see BATTERY_MV_*), measured with the local time
+     // clock.
+     uint8_t battery_level;
+} __attribute__ ((packed));
+
+// Wall-clock time as read and written by the client, transferred in Little
+// Endian format.
+struct wallclock {
+     // Seconds since 1970-01-01T00:00:00Z; 0 if wall-clock time has not
+     // been set since boot.
+     uint32_t time;
+     // Milliseconds (0-999).
+     uint16_t ms;
+     // Estimated drift of the low-frequency clock [ppm]; positive if the 
+     // clock is too slow. Ignored on writes.
+     int16_t drift_ppm;
+};
+
+// Statistics of the acknowledged delivery of door bell alarms, transferred
+// in Little Endian format. Times are given in ticks of the 32.768 kHz
+// low-frequency clock. Counters wrap around silently.
+struct alarm_delivery {
+     // Round-trip time of the last confirmed alarm, i.e., the time from
+     // handing the indication over to the softdevice until the
+     // confirmation has been received.
+     uint32_t last_rtt_ticks;
+     // Maximum round-trip time since boot.
+     uint32_t max_rtt_ticks;
+     // Number of confirmed alarms.
+     uint16_t confirmed;
+     // Number of indications that were not confirmed in time.
+     uint16_t timeouts;
+     // Number of alarms sent again after a timeout or a lost link.
+     uint16_t retransmissions;
+     // Number of alarms merged because too many alarms were pending.
+     uint16_t merged;
+     // Number of alarms waiting for confirmation.
+     uint16_t pending;
+};
+
+// Kinds of early ring records.
+// The first edge of an idle input has been detected.
+#define EARLY_RING_TENTATIVE 0x01
+// Debouncing has detected a press following the tentative record.
+#define EARLY_RING_CONFIRM 0x02
+// Debouncing has not detected a press (spike or noise).
+#define EARLY_RING_CANCEL 0x03
+
+// Early ring record. A tentative record is followed by exactly one 
+// confirm or cancel record with the same input and sequence number, 
+// unless the link is lost in between.
+struct early_ring {
+     // See EARLY_RING_*.
+     uint8_t kind;
+     // Index of the input (position in table INPUTS).
+     uint8_t input;
+     // Incremented for every tentative record.
+     uint8_t seq;
+};
+
+// Flags of the ring pattern.
+// More intervals than fitting into the buffer were recorded. Presses are 
+// still counted.
+#define RING_PATTERN_FLAG_OVERFLOW 0x01
+// The last press was longer than RING_CAPTURE_PRESS_TIMEOUT.
+#define RING_PATTERN_FLAG_TRUNCATED 0x02
+// The upper three bits of the flags hold the index of the captured input.
+#define RING_PATTERN_INPUT_SHIFT 5
+
+// The ring pattern describes a single ring, i.e., a sequence of presses 
+// that are separated by gaps shorter than RING_CAPTURE_GAP_TIMEOUT.
+// The data field contains the encoded durations of presses and gaps in 
+// alternating order starting with the first press (press, gap, press, ...,
+// press). Each duration is given in units of RING_CAPTURE_RESOLUTION_MS. 
+// Durations below 128 units are encoded in one byte. Longer durations are 
+// encoded in two bytes (Big Endian) with the most significant bit of the 
+// first byte set, i.e., up to 0x7fff units. Only the used part of the data 
+// field is transferred (variable length characteristic).
+struct ring_pattern {
+     // Number of presses (saturating).
+     uint8_t presses;
+     // See RING_PATTERN_FLAG_* and RING_PATTERN_INPUT_SHIFT.
+     uint8_t flags;
+     uint8_t data[RING_CAPTURE_BUFFER_SIZE];
+};
+
+// Configuration block with the runtime-tunable parameters. 
+// The block is stored in flash and transferred in Little Endian format
+// through the configuration characteristic. Its size is a multiple of 4 
+// bytes as required by pstorage, and it fits into a single ATT write
+// request (20 bytes with the default ATT MTU).
+struct config {
+     // Must be CONFIG_VERSION.
+     uint16_t version;
+     // Delay for debouncing door bell signals [ms]; 5-1000.
+     uint16_t debouncing_delay_ms;
+     // Delay for not accepting another door bell event [ms]; 1000-500000.
+     uint32_t alarm_inhibit_delay_ms;
+     // Connection parameters as defined by the BLE specification:
+     // min/max connection interval [1.25 ms], slave latency [connection
+     // intervals], and supervision timeout [10 ms].
+     uint16_t min_conn_interval;
+     uint16_t max_conn_interval;
+     uint16_t slave_latency;
+     uint16_t conn_sup_timeout;
+     // Advertisement interval [0.625 ms]; 32-16384.
+     uint16_t adv_interval;
+     // Local time clock interval [s]; 1-300.
+     uint16_t localtime_interval_sec;
+};
+
+// Monitored input (active low).
+struct input {
+     uint8_t pin_no;
+     nrf_gpio_pin_pull_t pull_cfg;
+};
+
+#define INPUT(pin, pull) {pin, pull}
+
+static const struct input inputs[] = INPUTS;
+#define INPUT_COUNT (sizeof(inputs) / sizeof(inputs[0]))
+
+// The input masks are uint8_t, and each input needs a low-power GPIOTE 
+// event (see table INPUTS).
+STATIC_ASSERT(INPUT_COUNT <= 8);
+STATIC_ASSERT(INPUT_COUNT <= GPIOTE_CONFIG_NUM_OF_LOW_POWER_EVENTS);
+
+// One alarm inhibit timer per input, so a ring at one door does not 
+// inhibit alarms of the other doors.
+static app_timer_t alarm_inhibit_timers_data[INPUT_COUNT];
+
+static void debounce_timer_evt_handler(void *p_context);
+
+// Debouncing state and timer per input. Only accessed by the GPIOTE and
+// app timer handlers, which run at the same interrupt priority, i.e., 
+// they cannot preempt each other.
+static app_timer_t debounce_timers_data[INPUT_COUNT];
+static struct debounce debouncers[INPUT_COUNT];
+static struct debounce_params debounce_params = {
+     .algorithm = DEBOUNCE_ALGORITHM,
+     .sample_interval = APP_TIMER_TICKS(DEBOUNCE_SAMPLE_INTERVAL_MS, 
+					APP_TIMER_PRESCALER),
+     .integrator_limit = DEBOUNCE_INTEGRATOR_LIMIT,
+     .hold = APP_TIMER_TICKS(DEBOUNCE_HOLD_MS, APP_TIMER_PRESCALER)
+};
+
+#if FEATURE_EARLY_RING
+// Bit i is set while an early ring of input i is being debounced, i.e.,
+// a confirm or cancel event must follow. Only accessed by the GPIOTE and
+// app timer handlers.
+uint8_t speculative_inputs = 0;
+#endif
 
-APP_TIMER_DEF(alarm_inhibit_timer);
 APP_TIMER_DEF(localtime_timer);
+#if FEATURE_RING_PATTERN
+APP_TIMER_DEF(ring_capture_timer);
+#endif
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+APP_TIMER_DEF(indication_timer);
+#endif
+#if !FEATURE_CONNECTED
+APP_TIMER_DEF(broadcast_burst_timer);
+#endif
 
 uint8_t uuid_type;
+
+#if FEATURE_CONNECTED
 uint16_t service_handle;
-ble_gatts_char_handles_t char_handle_door_bell_alarm;
-ble_gatts_char_handles_t char_handle_localtime;
+ble_gatts_char_handles_t char_handles[CHAR_COUNT];
 uint16_t conn_handle = BLE_CONN_HANDLE_INVALID; 
 
-// This variable signals, whether a client has subscribed to receive
-// door bell alarm events.
-volatile bool is_client_subscribed = false;
+// Bit i of this variable signals, whether a client has subscribed to 
+// receive notifications of characteristic i (enum characteristic_index).
+volatile uint16_t subscriptions = 0;
 
-// This variable shows whether door bell events are blocked at the moment.
-volatile bool is_alarm_inhibited = false;
+// Bit i of this variable signals, whether a client has subscribed to
+// receive indications of characteristic i.
+volatile uint16_t indication_subscriptions = 0;
 
-// Local time of last door bell alarm.
-// The variable is word-aligned to use single atomic LDR and STR operations to 
-// load and store the variable.
-uint32_t door_bell_alarm_time __attribute__ ((aligned (4))) = 0;
+// Bit i of this variable signals, whether the last notification of
+// characteristic i has been dropped since the softdevice had no transmit
+// buffers left. Dropped notifications are sent again with the current
+// value after the next wakeup (see resend_dropped_notifications()). Only
+// accessed by the main loop.
+uint16_t dropped_notifications = 0;
+#endif
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+// Signals whether door bell alarms are delivered acknowledged. Set when
+// the client subscribes to indications of the alarm characteristic and
+// cleared when it subscribes to notifications. Unsubscribing or losing
+// the link does not change the mode, so alarms occurring while the
+// client is disconnected are kept until it has reconnected.
+volatile bool is_acknowledged_delivery = false;
+
+// Incremented by the BLE event handler whenever a link is established or
+// lost. Used by the main loop to detect that the link carrying an
+// indication has gone.
+volatile uint8_t link_generation = 0;
+#endif
+
+// Bit i of this variable shows whether door bell events of input i are 
+// blocked at the moment. Bits are set by the main loop and cleared by the 
+// alarm inhibit timers.
+volatile uint8_t inhibited_inputs = 0;
+
+// Last door bell alarm. Only accessed by the main loop.
+struct door_bell_alarm door_bell_alarm;
+
+// Sequence number of the last door bell alarm. Only accessed by the main
+// loop.
+uint16_t door_bell_alarm_seq = 0;
+
+// Inputs that became active during the current batch of events and the 
+// local time [ms] of the first of them. Only accessed by the main loop.
+uint8_t pending_alarm_inputs = 0;
+uint64_t pending_alarm_local_ms;
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+// Alarms waiting for confirmation (FIFO) in acknowledged delivery mode.
+// The oldest alarm is indicated; the others wait until it has been
+// confirmed. Only accessed by the main loop.
+struct door_bell_alarm pending_alarms[PENDING_ALARMS_SIZE];
+uint8_t pending_alarms_first = 0;
+uint8_t pending_alarms_count = 0;
+// Signals whether the oldest pending alarm has been sent before.
+bool is_pending_alarm_sent = false;
+
+// State of the indication waiting for confirmation: link generation and
+// time when it was handed over to the softdevice. Only accessed by the
+// main loop.
+bool is_indication_in_flight = false;
+uint8_t indication_link_generation;
+uint32_t indication_start;
+
+// Set by the BLE event handler when the confirmation has been received.
+volatile bool is_indication_confirmed = false;
+volatile uint32_t indication_confirmed_ticks;
+
+struct alarm_delivery alarm_delivery;
+#endif
+
+#if FEATURE_EARLY_RING
+// Last early ring record. Only accessed by the main loop.
+struct early_ring early_ring;
+
+// Inputs for which a tentative early ring record has been sent, and the
+// sequence numbers of these records. Only accessed by the main loop.
+uint8_t tentative_inputs = 0;
+uint8_t early_ring_seqs[INPUT_COUNT];
+uint8_t early_ring_seq = 0;
+#endif
 
 // Local time in seconds. 
 // Local time has no relation to wall-clock time.
@@ -148,8 +742,149 @@ uint32_t door_bell_alarm_time __attribute__ ((aligned (4))) = 0;
 // load and store the variable.
 volatile uint32_t localtime __attribute__ ((aligned (4))) = 1;
 
-volatile bool is_localtime_updated = false;
-volatile bool is_door_bell_alarm = false;
+// RTC1 counter value at which local time was exactly localtime seconds.
+// Together with the current counter value, this gives local time with the
+// resolution of the RTC (see local_time_at()). Only modified by the local 
+// time clock handler and with interrupts disabled.
+volatile uint32_t localtime_rtc_ticks __attribute__ ((aligned (4))) = 0;
+
+#if FEATURE_HEARTBEAT
+// Last heartbeat. Only accessed by the main loop.
+struct heartbeat heartbeat;
+
+// Set by the BLE event handler when a client subscribes to heartbeats, so
+// the first heartbeat is sent right away instead of one heartbeat
+// interval later.
+volatile bool is_heartbeat_requested = false;
+#endif
+
+#if !FEATURE_CONNECTED
+// Advertised data of a broadcast-only device.
+struct broadcast_data broadcast_data;
+
+// Set while advertising with BROADCAST_BURST_INTERVAL after an alarm, 
+// which started at RTC1 counter value broadcast_burst_start. Only accessed
+// by the main loop.
+bool is_broadcast_burst = false;
+uint32_t broadcast_burst_start;
+#endif
+
+#if FEATURE_WALLCLOCK
+// Current wall-clock time as published by the wall-clock characteristic.
+struct wallclock wallclock;
+
+// Wall-clock synchronization. Only accessed by the main loop.
+bool is_wallclock_set = false;
+// Local and wall-clock time [ms] of the last write. Wall-clock time is 
+// extrapolated from this point.
+uint64_t wallclock_sync_local_ms;
+uint64_t wallclock_sync_ms;
+// Local and wall-clock time [ms] of the write the next drift estimate is
+// measured against.
+uint64_t wallclock_ref_local_ms;
+uint64_t wallclock_ref_ms;
+int16_t wallclock_drift_ppm = 0;
+
+// Wall-clock time written by a bonded client and the local time [ms] of 
+// the write. Set by the BLE event handler and applied by the main loop.
+struct wallclock wallclock_written;
+uint64_t wallclock_written_local_ms;
+volatile bool is_wallclock_written = false;
+#endif
+
+// Events passed from interrupt handlers to the main loop. Each event 
+// carries the time when it occurred. Interrupt handlers are short, and the
+// main loop drains the queue after every wakeup, so the queue only needs 
+// to hold the events of one wakeup: at most one tick of the local time clock,
+// one completed ring pattern, and bell and early ring events, which are 
+// separated by at least the debouncing delay per input.
+struct event_queue event_queue;
+
+// Bit i is set if a door bell event of input i could not be queued. Set by
+// the producers of the event queue; read and cleared by the main loop with
+// interrupts disabled.
+volatile uint8_t lost_door_bell_inputs = 0;
+
+#if FEATURE_ENERGY_LEDGER
+struct energy_ledger energy_ledger;
+
+// Number of notifications handed over to the softdevice, which have not been
+// transmitted yet. Used to attribute radio activity to notifications.
+volatile uint8_t tx_pending = 0;
+
+// Category of the ongoing radio activity and its start time. 
+// Only used in the radio notification handler.
+uint32_t *radio_active_ledger_entry = NULL;
+uint32_t radio_active_start;
+#endif
+
+#if FEATURE_RING_PATTERN
+// State of the ring pattern capture. Only accessed from the debounce and
+// capture timer handlers, which are both executed in the interrupt context
+// of the app timer, i.e., they cannot preempt each other.
+bool is_ring_capture_active = false;
+bool is_ring_capture_pressed = false;
+uint8_t ring_capture_input;
+uint32_t ring_capture_last_edge;
+uint8_t ring_capture_len;
+struct ring_pattern ring_capture;
+
+// Last completed ring pattern. Written in interrupt context when a capture
+// is finished; read by the main loop after receiving the 
+// EVENT_RING_PATTERN event. (A new capture can only complete 
+// RING_CAPTURE_GAP_TIMEOUT after the next ring has started, so the main 
+// loop has plenty of time to read the pattern.)
+struct ring_pattern ring_pattern;
+uint8_t ring_pattern_len = 0;
+#endif
+
+const struct config default_config = {
+     .version = CONFIG_VERSION,
+     .debouncing_delay_ms = DEBOUNCING_DELAY_MS,
+     .alarm_inhibit_delay_ms = ALARM_INHIBIT_DELAY_MS,
+     .min_conn_interval = MIN_CONN_INTERVAL,
+     .max_conn_interval = MAX_CONN_INTERVAL,
+     .slave_latency = SLAVE_LATENCY,
+     .conn_sup_timeout = CONN_SUP_TIMEOUT,
+     .adv_interval = ADV_INTERVAL,
+     .localtime_interval_sec = LOCALTIME_CLOCK_INTERVAL_SEC
+};
+
+// Active configuration. Only written by the main loop (and during 
+// initialization).
+struct config config __attribute__ ((aligned (4)));
+
+#if FEATURE_CONFIG
+// Copy of the configuration that is being written to flash. pstorage 
+// accesses the source buffer asynchronously, so it must stay unchanged 
+// while is_config_store_pending is set. Cleared by the storage event 
+// handler when the update has completed.
+struct config config_flash __attribute__ ((aligned (4)));
+volatile bool is_config_store_pending = false;
+
+// Flash block holding the configuration.
+pstorage_handle_t config_storage_handle;
+
+// Configuration accepted by the BLE event handler, which needs to be 
+// applied and stored by the main loop (signalled by is_config_written). 
+// A later write replaces it.
+struct config config_written;
+volatile bool is_config_written = false;
+#endif
+
+// Timer intervals derived from the active configuration [ticks].
+uint32_t alarm_inhibit_delay_ticks;
+uint32_t localtime_interval_ticks;
+
+#if FEATURE_BONDING
+// Device manager application instance. The device manager handles pairing 
+// and stores the bond of the gateway.
+dm_application_instance_t dm_app_handle;
+
+// Signals whether the current link is encrypted with the keys of a 
+// bonded peer. Only bonded peers may change the configuration.
+volatile bool is_link_bonded = false;
+#endif
 
 static void led_off()
 {
@@ -191,16 +926,101 @@ static void die()
      sd_nvic_SystemReset();
 }
 
+static uint32_t rtc_ticks()
+{
+     uint32_t ticks;
+
+     // Cannot fail for a non-NULL argument.
+     app_timer_cnt_get(&ticks);
+     return ticks;
+}
+
+#if FEATURE_ENERGY_LEDGER || FEATURE_RING_PATTERN || !FEATURE_CONNECTED
+static uint32_t rtc_ticks_since(uint32_t start)
+{
+     uint32_t diff;
+
+     // RTC1 is a 24 bit counter; this function handles the wrap-around.
+     app_timer_cnt_diff_compute(rtc_ticks(), start, &diff);
+     return diff;
+}
+#endif
+
+#if FEATURE_ENERGY_LEDGER
+static void account_wakeup(enum wakeup_source source, uint32_t start)
+{
+     // Since the RTC ticks much slower than the CPU, very short wakeups
+     // will often be accounted with 0 or 1 tick. However, since wakeups are
+     // not synchronized with the RTC, the accounted time is correct on
+     // average.
+     energy_ledger.cpu_ticks[source] += rtc_ticks_since(start);
+     energy_ledger.wakeups[source]++;
+}
+#endif
+
+// Local time at RTC1 counter value ticks, which must not be earlier than the
+// last tick of the local time clock. Must be called from interrupt handlers
+// at APP_IRQ_PRIORITY_LOW or with interrupts disabled.
+static void local_time_at(uint32_t ticks, uint32_t *sec, uint16_t *ms)
+{
+     uint32_t diff;
+
+     app_timer_cnt_diff_compute(ticks, localtime_rtc_ticks, &diff);
+     *sec = localtime + diff / RTC_TICKS_PER_SEC;
+     *ms = (diff % RTC_TICKS_PER_SEC) * 1000 / RTC_TICKS_PER_SEC;
+}
+
+#if FEATURE_WALLCLOCK
+// Current local time [ms]. Must not be called from interrupt handlers.
+static uint64_t local_time_ms()
+{
+     uint32_t sec;
+     uint16_t ms;
+
+     CRITICAL_REGION_ENTER();
+     local_time_at(rtc_ticks(), &sec, &ms);
+     CRITICAL_REGION_EXIT();
+
+     return (uint64_t) sec * 1000 + ms;
+}
+#endif
+
+static void push_event(enum event_type type, uint8_t arg)
+{
+     struct event event;
+
+     // Timestamp the event in interrupt context rather than when the main
+     // loop processes it.
+     event.type = type;
+     event.arg = arg;
+     event.rtc_ticks = rtc_ticks();
+     local_time_at(event.rtc_ticks, &event.localtime, &event.localtime_ms);
+
+     // The queue is dimensioned such that it cannot overflow (see 
+     // event_queue). Overflows are counted by the queue and published in 
+     // the energy ledger. Door bell events must not be lost, so the input
+     // is latched and handled by the main loop.
+     if (!event_queue_push(&event_queue, &event) && type == EVENT_DOOR_BELL)
+	  lost_door_bell_inputs |= (1 << arg);
+}
+
 static void start_advertising()
 {
     uint32_t err_code;
     ble_gap_adv_params_t adv_params;
 
     memset(&adv_params, 0, sizeof(adv_params));
+#if FEATURE_CONNECTED
     adv_params.type = BLE_GAP_ADV_TYPE_ADV_IND;
+    adv_params.interval = config.adv_interval;
+#else
+    // Scanners may request the scan response with name and service UUID.
+    adv_params.type = BLE_GAP_ADV_TYPE_ADV_SCAN_IND;
+    adv_params.interval = is_broadcast_burst ? 
+	 BROADCAST_BURST_INTERVAL : config.adv_interval;
+#endif
     adv_params.p_peer_addr = NULL;
     adv_params.fp = BLE_GAP_ADV_FP_ANY;
-    adv_params.interval = ADV_INTERVAL;
     adv_params.timeout = ADV_TIMEOUT;
 
     err_code = sd_ble_gap_adv_start(&adv_params);
@@ -208,7 +1028,34 @@ static void start_advertising()
 	 die();
 }
 
-static void cccd_door_bell_alarm_write_evt(ble_gatts_evt_write_t *evt_write)
+#if FEATURE_CONNECTED
+static void set_subscription(enum characteristic_index index, uint8_t cccd)
+{
+     // If a client enables both notifications and indications (0x0003),
+     // indications are used.
+     if (cccd & 0x02) {
+	  indication_subscriptions |= (1 << index);
+	  subscriptions &= ~(1 << index);
+     } else if (cccd & 0x01) {
+	  subscriptions |= (1 << index);
+	  indication_subscriptions &= ~(1 << index);
+     } else {
+	  subscriptions &= ~(1 << index);
+	  indication_subscriptions &= ~(1 << index);
+	  return;
+     }
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+     if (index == CHAR_DOOR_BELL_ALARM)
+	  is_acknowledged_delivery = (cccd & 0x02) ? true : false;
+#endif
+#if FEATURE_HEARTBEAT
+     if (index == CHAR_HEARTBEAT)
+	  is_heartbeat_requested = true;
+#endif
+}
+
+static void cccd_write_evt(ble_gatts_evt_write_t *evt_write)
 {
      // A subscription is made by the client by writing the characteristic's
      // CCCD (Client Characteristic Configuration Descriptor). A value of 
@@ -217,66 +1064,337 @@ static void cccd_door_bell_alarm_write_evt(ble_gatts_evt_write_t *evt_write)
      // See https://www.bluetooth.com/specifications/gatt/
      // viewer?attributeXmlFile=org.bluetooth.descriptor.gatt.
      // client_characteristic_configuration.xml
-     if (evt_write->handle == char_handle_door_bell_alarm.cccd_handle) {
-	  if (evt_write->data[0] == 0x01 && evt_write->data[1] == 0x00) {
-	       // Client subscribed to door bell alarm events.
-	       is_client_subscribed = true;
-	  } else if (evt_write->data[0] == 0x00 && evt_write->data[1] == 0x00) {
-	       // Client unsubscribed from door bell alarm events.
-	       is_client_subscribed = false;
-	  }
+     // Characteristics without notifications have no CCCD and, thus, an
+     // invalid CCCD handle.
+     for (uint8_t i = 0; i < CHAR_COUNT; i++) {
+	  if (evt_write->handle != char_handles[i].cccd_handle)
+	       continue;
+	  set_subscription(i, evt_write->data[0]);
      }
 }
+#endif
 
 static void on_sys_evt(uint32_t sys_evt)
 {
      // No need to handle any system events.
 }
 
+#if FEATURE_BONDING
+static void refresh_subscriptions()
+{
+     // Bonded peers might already have subscribed in a previous connection.
+     // Their subscriptions are restored by the device manager when the 
+     // link is secured, so we read them back from the CCCDs.
+     uint8_t cccd[2];
+     ble_gatts_value_t value;
+
+     for (uint8_t i = 0; i < CHAR_COUNT; i++) {
+	  if (char_handles[i].cccd_handle == BLE_GATT_HANDLE_INVALID)
+	       continue;
+	  value.len = sizeof(cccd);
+	  value.offset = 0;
+	  value.p_value = cccd;
+	  if (sd_ble_gatts_value_get(conn_handle, char_handles[i].cccd_handle,
+				     &value) != NRF_SUCCESS)
+	       cccd[0] = 0x00;
+	  set_subscription(i, cccd[0]);
+     }
+}
+#endif
+
+#if FEATURE_CONFIG
+static bool config_is_valid(const struct config *c)
+{
+     if (c->version != CONFIG_VERSION)
+	  return false;
+     if (c->debouncing_delay_ms < 5 || c->debouncing_delay_ms > 1000)
+	  return false;
+     // The app timer cannot handle timeouts of 512 s and more.
+     if (c->alarm_inhibit_delay_ms < 1000 || 
+	 c->alarm_inhibit_delay_ms > 500000)
+	  return false;
+     // Connection parameter limits as defined by the BLE specification.
+     if (c->min_conn_interval < 6 || 
+	 c->min_conn_interval > c->max_conn_interval ||
+	 c->max_conn_interval > 3200)
+	  return false;
+     if (c->slave_latency > 499)
+	  return false;
+     if (c->conn_sup_timeout < 10 || c->conn_sup_timeout > 3200)
+	  return false;
+     // The supervision timeout must be larger than the effective 
+     // connection interval times two:
+     // timeout * 10 ms > (1 + latency) * max_interval * 1.25 ms * 2
+     if ((uint32_t) c->conn_sup_timeout * 4 <= 
+	 (1 + (uint32_t) c->slave_latency) * c->max_conn_interval)
+	  return false;
+     if (c->adv_interval < 32 || c->adv_interval > 16384)
+	  return false;
+     if (c->localtime_interval_sec < 1 || c->localtime_interval_sec > 300)
+	  return false;
+
+     return true;
+}
+#endif
+
+#if FEATURE_BONDING
+// Checks a write to a characteristic with CHAR_PROP_WRITE_AUTH, which 
+// must write a complete value of len bytes. Returns the GATT status.
+static uint16_t check_write_authorize(ble_gatts_evt_write_t *evt_write, 
+				      uint16_t len)
+{
+     if (!is_link_bonded) {
+	  // Link is encrypted (enforced by the write permission) but not
+	  // with the keys of the bonded gateway.
+	  return BLE_GATT_STATUS_ATTERR_INSUF_AUTHORIZATION;
+     } else if (evt_write->op != BLE_GATTS_OP_WRITE_REQ || 
+		evt_write->offset != 0 || evt_write->len != len) {
+	  // Only complete blocks can be written.
+	  return BLE_GATT_STATUS_ATTERR_INVALID_ATT_VAL_LENGTH;
+     }
+
+     return BLE_GATT_STATUS_SUCCESS;
+}
+
+static void reply_write_authorize(uint16_t gatt_status)
+{
+     ble_gatts_rw_authorize_reply_params_t reply;
+
+     memset(&reply, 0, sizeof(reply));
+     reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+     reply.params.write.gatt_status = gatt_status;
+
+     if (sd_ble_gatts_rw_authorize_reply(conn_handle, &reply) != 
+	 NRF_SUCCESS)
+	  die();
+}
+
+#if FEATURE_CONFIG
+static void on_config_write_authorize(ble_gatts_evt_write_t *evt_write)
+{
+     uint16_t gatt_status;
+     struct config c;
+
+     gatt_status = check_write_authorize(evt_write, sizeof(struct config));
+     if (gatt_status == BLE_GATT_STATUS_SUCCESS) {
+	  memcpy(&c, evt_write->data, sizeof(c));
+	  if (config_is_valid(&c)) {
+	       config_written = c;
+	       is_config_written = true;
+	  } else {
+	       // Application error code: invalid parameter block.
+	       gatt_status = BLE_GATT_STATUS_ATTERR_APP_BEGIN;
+	  }
+     }
+
+     reply_write_authorize(gatt_status);
+}
+#endif
+
+#if FEATURE_WALLCLOCK
+static void on_wallclock_write_authorize(ble_gatts_evt_write_t *evt_write)
+{
+     uint16_t gatt_status;
+     struct wallclock w;
+     uint32_t sec;
+     uint16_t ms;
+
+     // Take the local time of the write as early as possible.
+     local_time_at(rtc_ticks(), &sec, &ms);
+
+     gatt_status = check_write_authorize(evt_write, sizeof(struct wallclock));
+     if (gatt_status == BLE_GATT_STATUS_SUCCESS) {
+	  memcpy(&w, evt_write->data, sizeof(w));
+	  if (w.time >= WALLCLOCK_MIN_TIME && w.ms < 1000) {
+	       wallclock_written = w;
+	       wallclock_written_local_ms = (uint64_t) sec * 1000 + ms;
+	       is_wallclock_written = true;
+	  } else {
+	       // Application error code: invalid time.
+	       gatt_status = BLE_GATT_STATUS_ATTERR_APP_BEGIN;
+	  }
+     }
+
+     reply_write_authorize(gatt_status);
+}
+#endif
+#endif
+
 static void sys_evt_dispatch(uint32_t sys_evt)
 {
+#if FEATURE_BONDING
+    pstorage_sys_event_handler(sys_evt);
+#endif
     on_sys_evt(sys_evt);
 }
 
 static void ble_evt_handler(ble_evt_t *ble_evt)
 {
+#if FEATURE_CONNECTED
      ble_gatts_evt_write_t *evt_write;
+#endif
+#if FEATURE_BONDING
+     ble_gatts_evt_rw_authorize_request_t *auth_request;
+#endif
+#if FEATURE_ENERGY_LEDGER
+     uint32_t start = rtc_ticks();
+#endif
+
+#if FEATURE_BONDING
+     // The device manager handles pairing, bonding, and restoring system
+     // attributes (CCCDs) of bonded peers.
+     dm_ble_evt_handler(ble_evt);
+#endif
+#if FEATURE_CONNECTED
+     ble_conn_params_on_ble_evt(ble_evt);
+#endif
 
      switch (ble_evt->header.evt_id) {
+#if FEATURE_CONNECTED
      case BLE_GAP_EVT_CONNECTED:
 	  conn_handle = ble_evt->evt.gap_evt.conn_handle;
 	  // If we sometimes use bonding, note that bonded devices might 
 	  // already have subscribed when they connect. Subscriptions 
 	  // are stored for bonded devices.
-	  is_client_subscribed = false;
+	  subscriptions = 0;
+	  indication_subscriptions = 0;
+#if FEATURE_BONDING
+	  is_link_bonded = false;
+#endif
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+	  link_generation++;
+#endif
 	  break;
      case BLE_GAP_EVT_DISCONNECTED:
 	  conn_handle = BLE_CONN_HANDLE_INVALID;
+	  // Subscriptions end with the link, so nothing is sent until the
+	  // next client has subscribed again.
+	  subscriptions = 0;
+	  indication_subscriptions = 0;
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+	  // Indications waiting for confirmation are sent again on the next
+	  // link (see deliver_alarms()).
+	  link_generation++;
+#endif
+#if FEATURE_ENERGY_LEDGER
+	  // Notifications not transmitted so far are discarded.
+	  tx_pending = 0;
+#endif
 	  start_advertising();
 	  break;
-     case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
-	  // Pairing not supported.
-	  sd_ble_gap_sec_params_reply(conn_handle, 
-				      BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP,
-				      NULL, NULL);
-	  break;
      case BLE_GATTS_EVT_WRITE:
 	  evt_write = &ble_evt->evt.gatts_evt.params.write;
-	  cccd_door_bell_alarm_write_evt(evt_write);
+	  cccd_write_evt(evt_write);
 	  break;
-     case BLE_GATTS_EVT_HVC:
-	  // Indication has been acknowledged by the client.
-	  // Not used. We just send notifications.
+#if !FEATURE_BONDING
+     // Without bonding, the device manager is not linked, so these events
+     // are handled here. Unhandled, sending notifications fails for missing
+     // system attributes, and pairing requests time out.
+     case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
+	  // Pairing not supported.
+	  if (sd_ble_gap_sec_params_reply(conn_handle,
+					  BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP,
+					  NULL, NULL) != NRF_SUCCESS)
+	       die();
 	  break;
      case BLE_GATTS_EVT_SYS_ATTR_MISSING:
 	  // No system attributes have been stored.
-	  sd_ble_gatts_sys_attr_set(conn_handle, NULL, 0, 0);
+	  if (sd_ble_gatts_sys_attr_set(conn_handle, NULL, 0, 0) !=
+	      NRF_SUCCESS)
+	       die();
+	  break;
+#endif
+#endif
+#if FEATURE_BONDING
+     case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+	  auth_request = &ble_evt->evt.gatts_evt.params.authorize_request;
+	  if (auth_request->type != BLE_GATTS_AUTHORIZE_TYPE_WRITE)
+	       break;
+#if FEATURE_CONFIG
+	  if (auth_request->request.write.handle == 
+	      char_handles[CHAR_CONFIG].value_handle)
+	       on_config_write_authorize(&auth_request->request.write);
+#endif
+#if FEATURE_WALLCLOCK
+	  if (auth_request->request.write.handle == 
+	      char_handles[CHAR_WALLCLOCK].value_handle)
+	       on_wallclock_write_authorize(&auth_request->request.write);
+#endif
+	  break;
+#endif
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+     case BLE_GATTS_EVT_HVC:
+	  // Indication has been acknowledged by the client. Only door bell
+	  // alarms are sent as indications. The main loop measures the
+	  // round-trip time with the time stamp taken here.
+	  if (ble_evt->evt.gatts_evt.params.hvc.handle ==
+	      char_handles[CHAR_DOOR_BELL_ALARM].value_handle) {
+	       indication_confirmed_ticks = rtc_ticks();
+	       is_indication_confirmed = true;
+	  }
+	  break;
+#endif
+#if FEATURE_ENERGY_LEDGER
+     case BLE_EVT_TX_COMPLETE:
+	  // Notifications have been transmitted.
+	  if (ble_evt->evt.common_evt.params.tx_complete.count < tx_pending)
+	       tx_pending -= ble_evt->evt.common_evt.params.tx_complete.count;
+	  else
+	       tx_pending = 0;
 	  break;
+#endif
      case BLE_GAP_EVT_TIMEOUT:
 	  // TODO: Should we do something?
 	  break;
     }
+
+#if FEATURE_ENERGY_LEDGER
+     account_wakeup(WAKEUP_SOURCE_BLE, start);
+#endif
+}
+
+#if FEATURE_ENERGY_LEDGER
+static void radio_notification_evt_handler(bool radio_active)
+{
+     // This handler is executed in interrupt context (SWI1) 
+     // RADIO_NOTIFICATION_DISTANCE before the radio becomes active and 
+     // after it has become inactive again. 
+     uint32_t ticks;
+
+     if (radio_active) {
+	  // Attribute radio activity to a category. Notifications are 
+	  // transmitted in the next connection event after they have been
+	  // handed over to the softdevice.
+	  if (conn_handle == BLE_CONN_HANDLE_INVALID)
+	       radio_active_ledger_entry = &energy_ledger.radio_adv_ticks;
+	  else if (tx_pending > 0)
+	       radio_active_ledger_entry = 
+		    &energy_ledger.radio_notification_ticks;
+	  else
+	       radio_active_ledger_entry = &energy_ledger.radio_conn_ticks;
+	  radio_active_start = rtc_ticks();
+     } else if (radio_active_ledger_entry != NULL) {
+	  // The radio was not active during the distance.
+	  ticks = rtc_ticks_since(radio_active_start);
+	  if (ticks > RADIO_NOTIFICATION_DISTANCE_TICKS)
+	       *radio_active_ledger_entry += 
+		    ticks - RADIO_NOTIFICATION_DISTANCE_TICKS;
+	  radio_active_ledger_entry = NULL;
+     }
+}
+
+static void radio_notification_init()
+{
+     // Get notified before the radio becomes active and when it has become
+     // inactive to measure radio active time. ble_radio_notification 
+     // toggles the state on every signal, so both signals are required.
+     if (ble_radio_notification_init(NRF_APP_PRIORITY_LOW,
+				     RADIO_NOTIFICATION_DISTANCE,
+				     radio_notification_evt_handler) !=
+	 NRF_SUCCESS)
+	  die();
 }
+#endif
 
 static void ble_stack_init()
 {
@@ -303,9 +1421,8 @@ static void ble_stack_init()
 	  die();
      
      // Subscribe for system events.
-     // Actually, so far, we do not need to handle any system events.
-     // But maybe in the future, for instance, when we store some events
-     // persistently in flash or similar.
+     // System events signal the completion of flash operations, which are
+     // required by pstorage.
      if (softdevice_sys_evt_handler_set(sys_evt_dispatch) !=
 	 NRF_SUCCESS)
 	  die();
@@ -313,7 +1430,9 @@ static void ble_stack_init()
 
 static void gap_init()
 {
+#if FEATURE_CONNECTED
      ble_gap_conn_params_t gap_conn_params;
+#endif
      ble_gap_conn_sec_mode_t sec_mode;
 
      // Open link, no encryption required on BLE layer.
@@ -325,14 +1444,129 @@ static void gap_init()
 				    strlen(DEVICE_NAME)) != NRF_SUCCESS)
 	  die();
      
+#if FEATURE_CONNECTED
      // Set connection parameters.
      memset(&gap_conn_params, 0, sizeof(gap_conn_params));
-     gap_conn_params.min_conn_interval = MIN_CONN_INTERVAL;
-     gap_conn_params.max_conn_interval = MAX_CONN_INTERVAL;
-     gap_conn_params.slave_latency = SLAVE_LATENCY;
-     gap_conn_params.conn_sup_timeout = CONN_SUP_TIMEOUT;     
+     gap_conn_params.min_conn_interval = config.min_conn_interval;
+     gap_conn_params.max_conn_interval = config.max_conn_interval;
+     gap_conn_params.slave_latency = config.slave_latency;
+     gap_conn_params.conn_sup_timeout = config.conn_sup_timeout;     
      if (sd_ble_gap_ppcp_set(&gap_conn_params) != NRF_SUCCESS)
 	  die();
+#endif
+
+     // Set transmit power for advertising and connections.
+     if (sd_ble_gap_tx_power_set(TX_POWER_LEVEL) != NRF_SUCCESS)
+	  die();
+}
+
+#if FEATURE_CONNECTED
+static void set_characteristic_value(enum characteristic_index index,
+				     const void *p_data, uint16_t len)
+{
+     ble_gatts_value_t value;
+
+     value.len = len;
+     value.offset = 0;
+     value.p_value = (uint8_t *) p_data;
+     if (sd_ble_gatts_value_set(conn_handle, char_handles[index].value_handle,
+				&value) != NRF_SUCCESS)
+	  die();
+}
+
+// Sends a notification or indication, which also updates the value.
+// Returns NRF_SUCCESS or the error of a value that cannot be sent now:
+// the transmit buffers are full, the link has just been lost, or the
+// client has not subscribed (yet). Other errors are fatal.
+static uint32_t send_hvx(enum characteristic_index index, uint8_t type,
+			 const void *p_data, uint16_t len)
+{
+     ble_gatts_hvx_params_t params;
+     uint32_t err_code;
+
+     memset(&params, 0, sizeof(params));
+     params.type = type;
+     params.handle = char_handles[index].value_handle;
+     params.p_data = (uint8_t *) p_data;
+     params.p_len = &len;
+     err_code = sd_ble_gatts_hvx(conn_handle, &params);
+     switch (err_code) {
+     case NRF_SUCCESS:
+     case BLE_ERROR_NO_TX_BUFFERS:
+     case BLE_ERROR_INVALID_CONN_HANDLE:
+     case BLE_ERROR_GATTS_SYS_ATTR_MISSING:
+     case NRF_ERROR_INVALID_STATE:
+     case NRF_ERROR_BUSY:
+	  return err_code;
+     default:
+	  die();
+	  return err_code;
+     }
+}
+
+static uint32_t send_notification(enum characteristic_index index,
+				  const void *p_data, uint16_t len)
+{
+     uint32_t err_code = send_hvx(index, BLE_GATT_HVX_NOTIFICATION, p_data,
+				  len);
+
+     if (err_code == NRF_SUCCESS) {
+	  dropped_notifications &= ~(1 << index);
+#if FEATURE_ENERGY_LEDGER
+	  // tx_pending is also modified by the BLE event handler.
+	  CRITICAL_REGION_ENTER();
+	  tx_pending++;
+	  CRITICAL_REGION_EXIT();
+#endif
+     } else if (err_code == BLE_ERROR_NO_TX_BUFFERS) {
+	  dropped_notifications |= (1 << index);
+     }
+     return err_code;
+}
+
+static void update_characteristic(enum characteristic_index index,
+				  const void *p_data, uint16_t len)
+{
+     // Send value as notification if the client has subscribed. Otherwise,
+     // just update the value, so the client can read it. A notification
+     // that cannot be sent is dropped, but its value is set.
+     if (conn_handle != BLE_CONN_HANDLE_INVALID &&
+	 (subscriptions & (1 << index)) &&
+	 send_notification(index, p_data, len) == NRF_SUCCESS)
+	  return;
+
+     set_characteristic_value(index, p_data, len);
+}
+
+static void resend_dropped_notifications()
+{
+     // Notifications carry at most 20 bytes with the default ATT MTU, the
+     // only one supported by the S110.
+     uint8_t data[20];
+     ble_gatts_value_t value;
+
+     for (uint8_t i = 0; i < CHAR_COUNT && dropped_notifications != 0;
+	  i++) {
+	  if (!(dropped_notifications & (1 << i)))
+	       continue;
+	  if (conn_handle == BLE_CONN_HANDLE_INVALID ||
+	      !(subscriptions & (1 << i))) {
+	       dropped_notifications &= ~(1 << i);
+	       continue;
+	  }
+	  value.len = sizeof(data);
+	  value.offset = 0;
+	  value.p_value = data;
+	  if (sd_ble_gatts_value_get(conn_handle,
+				     char_handles[i].value_handle,
+				     &value) != NRF_SUCCESS)
+	       die();
+	  // Stop if the buffers are still full; the others keep their bits.
+	  if (send_notification(i, data, value.len) ==
+	      BLE_ERROR_NO_TX_BUFFERS)
+	       return;
+	  dropped_notifications &= ~(1 << i);
+     }
 }
 
 static void set_localtime_char()
@@ -343,180 +1577,326 @@ static void set_localtime_char()
      // need to protect this assignment by disabling interrupts.
      uint32_t t = localtime;
 
-     ble_gatts_value_t value;
-     value.len = sizeof(t);
-     value.offset = 0;
-     value.p_value = (uint8_t *) &t;
+     update_characteristic(CHAR_LOCALTIME, &t, sizeof(t));
+}
+#endif
 
-     if (sd_ble_gatts_value_set(conn_handle, 
-				char_handle_localtime.value_handle,
-				&value) != NRF_SUCCESS)
-	  die();
+#if FEATURE_WALLCLOCK
+// Wall-clock time [ms] at local time local_ms. Wall-clock time must have
+// been set.
+static uint64_t wallclock_at(uint64_t local_ms)
+{
+     int64_t elapsed = (int64_t) (local_ms - wallclock_sync_local_ms);
+
+     return wallclock_sync_ms + elapsed + 
+	  elapsed * wallclock_drift_ppm / 1000000;
 }
 
-static void set_door_bell_alarm_char()
+static void set_wallclock_char()
 {
-     // Make a copy of door_bell_alarm_time to avoid race conditions of
-     // concurrent write operations to variable door_bell_alarm_time.
-     // 32 bit load operations are atomic on ARM Cortex M0, so we do not
-     // need to protect this assignment by disabling interrupts.
-     uint32_t t = door_bell_alarm_time;
+     uint64_t t;
+
+     memset(&wallclock, 0, sizeof(wallclock));
+     if (is_wallclock_set) {
+	  t = wallclock_at(local_time_ms());
+	  wallclock.time = t / 1000;
+	  wallclock.ms = t % 1000;
+	  wallclock.drift_ppm = wallclock_drift_ppm;
+     }
 
-     ble_gatts_value_t value;
-     value.len = sizeof(t);
-     value.offset = 0;
-     value.p_value = (uint8_t *) &t;
+     set_characteristic_value(CHAR_WALLCLOCK, &wallclock, sizeof(wallclock));
+}
 
-     if (sd_ble_gatts_value_set(conn_handle, 
-				char_handle_door_bell_alarm.value_handle,
-				&value) != NRF_SUCCESS)
-	  die();
+static void on_wallclock_written()
+{
+     struct wallclock w;
+     uint64_t local_ms, t, elapsed;
+     int64_t drift_ppm;
+
+     // The BLE event handler might accept another write meanwhile.
+     CRITICAL_REGION_ENTER();
+     w = wallclock_written;
+     local_ms = wallclock_written_local_ms;
+     is_wallclock_written = false;
+     CRITICAL_REGION_EXIT();
+
+     t = (uint64_t) w.time * 1000 + w.ms;
+
+     if (!is_wallclock_set) {
+	  wallclock_ref_local_ms = local_ms;
+	  wallclock_ref_ms = t;
+     } else {
+	  elapsed = local_ms - wallclock_ref_local_ms;
+	  if (elapsed >= (uint64_t) WALLCLOCK_DRIFT_MIN_INTERVAL_SEC * 1000) {
+	       drift_ppm = ((int64_t) (t - wallclock_ref_ms) - 
+			    (int64_t) elapsed) * 1000000 / (int64_t) elapsed;
+	       if (drift_ppm >= -WALLCLOCK_DRIFT_MAX_PPM && 
+		   drift_ppm <= WALLCLOCK_DRIFT_MAX_PPM)
+		    wallclock_drift_ppm = drift_ppm;
+	       wallclock_ref_local_ms = local_ms;
+	       wallclock_ref_ms = t;
+	  }
+     }
+
+     wallclock_sync_local_ms = local_ms;
+     wallclock_sync_ms = t;
+     is_wallclock_set = true;
+
+     set_wallclock_char();
 }
+#endif
 
-static void add_characteristic_door_bell_alarm(uint16_t service_handle)
+#if FEATURE_HEARTBEAT || !FEATURE_CONNECTED
+static uint16_t battery_mv()
 {
-     // Characteristic UUID.
-     ble_uuid_t ble_uuid;
-     ble_uuid.type = uuid_type;
-     ble_uuid.uuid = UUID_CHARACTERISTIC_DOOR_BELL_ALARM;
+     uint32_t result;
+
+     // Measure the supply voltage with one third prescaling against the
+     // internal 1.2 V band gap reference. A conversion takes less than 
+     // 70 us, so we wait for it.
+     NRF_ADC->CONFIG = (ADC_CONFIG_RES_10bit << ADC_CONFIG_RES_Pos) |
+	  (ADC_CONFIG_INPSEL_SupplyOneThirdPrescaling << 
+	   ADC_CONFIG_INPSEL_Pos) |
+	  (ADC_CONFIG_REFSEL_VBG << ADC_CONFIG_REFSEL_Pos) |
+	  (ADC_CONFIG_PSEL_Disabled << ADC_CONFIG_PSEL_Pos) |
+	  (ADC_CONFIG_EXTREFSEL_None << ADC_CONFIG_EXTREFSEL_Pos);
+     NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Enabled;
+     NRF_ADC->EVENTS_END = 0;
+     NRF_ADC->TASKS_START = 1;
+     while (!NRF_ADC->EVENTS_END)
+	  ;
+     NRF_ADC->EVENTS_END = 0;
+     result = NRF_ADC->RESULT;
+     NRF_ADC->TASKS_STOP = 1;
+     // Disable the ADC to save energy.
+     NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Disabled;
+
+     // 10 bit result, 1200 mV reference, one third prescaling.
+     return result * 1200 * 3 / 1023;
+}
 
-     // Define characteristic presentation format.
-     // The door bell alarm is a single unsigned 32 bit integer representing
-     // a timestamp when the event happened.
-     ble_gatts_char_pf_t char_presentation_format;
-     memset(&char_presentation_format, 0, sizeof(char_presentation_format));
-     char_presentation_format.format = BLE_GATT_CPF_FORMAT_UINT32;
-     char_presentation_format.exponent = 0;
-     char_presentation_format.unit = 0x2703; // seconds
+// Battery level [%] at supply voltage mv [mV].
+static uint8_t battery_level(uint16_t mv)
+{
+     if (mv >= BATTERY_MV_FULL)
+	  return 100;
+     else if (mv <= BATTERY_MV_EMPTY)
+	  return 0;
+     else
+	  return (uint32_t) (mv - BATTERY_MV_EMPTY) * 100 /
+	       (BATTERY_MV_FULL - BATTERY_MV_EMPTY);
+}
+#endif
 
-     // Define CCCD attributes. 
-     // CCCD (Client Characteristic Configuration Descriptor) is used by the
-     // client to enable notifications or indications by writing a flag to the
-     // CCCD attribute.
-     ble_gatts_attr_md_t cccd_meta_data;
-     memset(&cccd_meta_data, 0, sizeof(cccd_meta_data));
-     // CCCD must be readable and writeable. 
-     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_meta_data.read_perm);
-     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_meta_data.write_perm);
-     cccd_meta_data.vloc = BLE_GATTS_VLOC_STACK;
+#if FEATURE_HEARTBEAT
+static void send_heartbeat()
+{
+     uint16_t mv = battery_mv();
 
-     // Define characteristic meta data.
-     // The door bell alarm is readable and can send notifications.
-     ble_gatts_char_md_t char_meta_data;
-     memset(&char_meta_data, 0, sizeof(char_meta_data));
-     char_meta_data.char_props.read = 1;
-     char_meta_data.char_props.write = 0;
-     char_meta_data.char_props.notify = 1;
-     char_meta_data.char_props.indicate = 0;
-     char_meta_data.p_char_user_desc = NULL;
-     char_meta_data.p_char_pf = &char_presentation_format;
-     char_meta_data.p_user_desc_md = NULL;
-     // CCCD (Client Characteristic Configuration Descriptor) needs to be 
-     // set for characteristics allowing for notifications and indications.
-     char_meta_data.p_cccd_md = &cccd_meta_data;
-     char_meta_data.p_sccd_md = NULL;
+     heartbeat.seq++;
+     heartbeat.interval_sec = config.localtime_interval_sec;
+     heartbeat.battery_mv = mv;
+     heartbeat.battery_level = battery_level(mv);
 
-     // Define attribute meta data. 
-     ble_gatts_attr_md_t char_attr_meta_data;
-     memset(&char_attr_meta_data, 0, sizeof(char_attr_meta_data));
-     // No security needed.
-     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&char_attr_meta_data.read_perm);
-     BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&char_attr_meta_data.write_perm);
-     // value location
-     char_attr_meta_data.vloc = BLE_GATTS_VLOC_STACK;
-     // always request read authorization from application 
-     char_attr_meta_data.rd_auth = 0;
-     // always request write authorization from application
-     char_attr_meta_data.wr_auth = 0;
-     // variable length attribute
-     char_attr_meta_data.vlen = 0;
-
-     // Define characteristic attributes. 
-     // Door bell alarm is a fixed length 32 bit data structure.
-     ble_gatts_attr_t char_attributes;
-     memset(&char_attributes, 0, sizeof(char_attributes));
-     char_attributes.p_uuid = &ble_uuid;
-     char_attributes.p_attr_md = &char_attr_meta_data;
-     char_attributes.init_len = sizeof(door_bell_alarm_time);
-     char_attributes.init_offs = 0;
-     char_attributes.max_len = MAX_LENGTH_DOOR_BELL_ALARM_CHAR;
-     // For attributes managed by the application (BLE_GATTS_VLOC_USER)
-     // rather than the BLE stack, set a pointer to the memory location here.
-     char_attributes.p_value = (uint8_t *) &door_bell_alarm_time;
+     // The notification is sent in the next connection event, which takes
+     // place anyway, so it costs little more than the wakeup of the local
+     // time clock.
+     update_characteristic(CHAR_HEARTBEAT, &heartbeat, sizeof(heartbeat));
+}
+#endif
 
-     // Add characteristic to service.
-     if (sd_ble_gatts_characteristic_add(service_handle,
-					 &char_meta_data,
-					 &char_attributes,
-					 &char_handle_door_bell_alarm) 
-	 != NRF_SUCCESS)
-	  die();
+#if FEATURE_ENERGY_LEDGER
+static void set_energy_ledger_char()
+{
+     // Individual counters might be updated concurrently in interrupt 
+     // context while copying. Each 32 bit counter is copied atomically, 
+     // and the counters are independent of each other, so we do not need to
+     // disable interrupts.
+     struct energy_ledger ledger = energy_ledger;
+
+     ledger.event_overflows = event_queue.overflows;
+     update_characteristic(CHAR_ENERGY_LEDGER, &ledger, sizeof(ledger));
 }
+#endif
+
+// Characteristics of the DoorBell20 service:
+// * Door bell alarm: last alarm (struct door_bell_alarm); notifications or
+//   indications (acknowledged delivery) are sent on alarms.
+// * Local time: local time in seconds (uint32_t).
+// * Energy ledger: see struct energy_ledger. The ledger is longer than a 
+//   single ATT packet, so clients need to use long reads (read blob).
+// * Ring pattern: pattern of the last ring (struct ring_pattern); 
+//   notifications are sent when a ring has been captured completely. 
+//   Initially, the pattern is empty (no presses, no flags).
+// * Configuration: see struct config.
+// * Alarm delivery: see struct alarm_delivery.
+// * Early ring: see struct early_ring; notifications are sent on the first
+//   edge of an input and after debouncing. Subscribing to this 
+//   characteristic enables early rings.
+// * Wall-clock time: see struct wallclock; updated with the local time 
+//   clock and when a bonded client writes the current time.
+// * Heartbeat: see struct heartbeat; notifications are sent with the local
+//   time clock and when a client subscribes.
+#if FEATURE_CONNECTED
+static const struct characteristic characteristics[CHAR_COUNT] = {
+     [CHAR_DOOR_BELL_ALARM] = {
+	  UUID_CHARACTERISTIC_DOOR_BELL_ALARM, 
+	  CHAR_PROP_READ | CHAR_PROP_NOTIFY | CHAR_PROP_INDICATE,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &door_bell_alarm, sizeof(door_bell_alarm), sizeof(door_bell_alarm)
+     },
+     [CHAR_LOCALTIME] = {
+	  UUID_CHARACTERISTIC_LOCALTIME, 
+	  CHAR_PROP_READ,
+	  BLE_GATT_CPF_FORMAT_UINT32, 0x2703, // seconds
+	  (const void *) &localtime, sizeof(localtime), sizeof(localtime)
+     },
+#if FEATURE_ENERGY_LEDGER
+     [CHAR_ENERGY_LEDGER] = {
+	  UUID_CHARACTERISTIC_ENERGY_LEDGER, 
+	  CHAR_PROP_READ,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &energy_ledger, sizeof(energy_ledger), sizeof(energy_ledger)
+     },
+#endif
+#if FEATURE_RING_PATTERN
+     [CHAR_RING_PATTERN] = {
+	  UUID_CHARACTERISTIC_RING_PATTERN, 
+	  CHAR_PROP_READ | CHAR_PROP_NOTIFY | CHAR_PROP_VLEN,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &ring_pattern, offsetof(struct ring_pattern, data), 
+	  sizeof(ring_pattern)
+     },
+#endif
+#if FEATURE_CONFIG
+     [CHAR_CONFIG] = {
+	  UUID_CHARACTERISTIC_CONFIG, 
+	  CHAR_PROP_READ | CHAR_PROP_WRITE_AUTH,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &config, sizeof(config), sizeof(config)
+     },
+#endif
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+     [CHAR_ALARM_DELIVERY] = {
+	  UUID_CHARACTERISTIC_ALARM_DELIVERY,
+	  CHAR_PROP_READ,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &alarm_delivery, sizeof(alarm_delivery), sizeof(alarm_delivery)
+     },
+#endif
+#if FEATURE_EARLY_RING
+     [CHAR_EARLY_RING] = {
+	  UUID_CHARACTERISTIC_EARLY_RING, 
+	  CHAR_PROP_READ | CHAR_PROP_NOTIFY,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &early_ring, sizeof(early_ring), sizeof(early_ring)
+     },
+#endif
+#if FEATURE_WALLCLOCK
+     [CHAR_WALLCLOCK] = {
+	  UUID_CHARACTERISTIC_WALLCLOCK, 
+	  CHAR_PROP_READ | CHAR_PROP_WRITE_AUTH,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &wallclock, sizeof(wallclock), sizeof(wallclock)
+     },
+#endif
+#if FEATURE_HEARTBEAT
+     [CHAR_HEARTBEAT] = {
+	  UUID_CHARACTERISTIC_HEARTBEAT, 
+	  CHAR_PROP_READ | CHAR_PROP_NOTIFY,
+	  BLE_GATT_CPF_FORMAT_STRUCT, 0x2700, // unitless
+	  &heartbeat, sizeof(heartbeat), sizeof(heartbeat)
+     },
+#endif
+};
 
-static void add_characteristic_localtime(uint16_t service_handle)
+static void add_characteristic(uint16_t service_handle, 
+			       const struct characteristic *characteristic,
+			       ble_gatts_char_handles_t *p_handles)
 {
      // Characteristic UUID.
      ble_uuid_t ble_uuid;
      ble_uuid.type = uuid_type;
-     ble_uuid.uuid = UUID_CHARACTERISTIC_LOCALTIME;
+     ble_uuid.uuid = characteristic->uuid;
 
      // Define characteristic presentation format.
-     // The localtime characteristic is a single unsigned 32 bit integer 
-     // representing a timestamp in seconds.
      ble_gatts_char_pf_t char_presentation_format;
      memset(&char_presentation_format, 0, sizeof(char_presentation_format));
-     char_presentation_format.format = BLE_GATT_CPF_FORMAT_UINT32;
+     char_presentation_format.format = characteristic->format;
      char_presentation_format.exponent = 0;
-     char_presentation_format.unit = 0x2703; // seconds
+     char_presentation_format.unit = characteristic->unit;
+
+     // Define CCCD attributes. 
+     // CCCD (Client Characteristic Configuration Descriptor) is used by the
+     // client to enable notifications or indications by writing a flag to the
+     // CCCD attribute.
+     ble_gatts_attr_md_t cccd_meta_data;
+     memset(&cccd_meta_data, 0, sizeof(cccd_meta_data));
+     // CCCD must be readable and writeable. 
+     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_meta_data.read_perm);
+     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_meta_data.write_perm);
+     cccd_meta_data.vloc = BLE_GATTS_VLOC_STACK;
 
      // Define characteristic meta data.
-     // Localtime is readable.
      ble_gatts_char_md_t char_meta_data;
      memset(&char_meta_data, 0, sizeof(char_meta_data));
-     char_meta_data.char_props.read = 1;
-     char_meta_data.char_props.write = 0;
-     char_meta_data.char_props.notify = 0;
-     char_meta_data.char_props.indicate = 0;
+     char_meta_data.char_props.read = 
+	  (characteristic->props & CHAR_PROP_READ) ? 1 : 0;
+     char_meta_data.char_props.write = 
+	  (characteristic->props & CHAR_PROP_WRITE_AUTH) ? 1 : 0;
+     char_meta_data.char_props.notify = 
+	  (characteristic->props & CHAR_PROP_NOTIFY) ? 1 : 0;
+     char_meta_data.char_props.indicate =
+	  (characteristic->props & CHAR_PROP_INDICATE) ? 1 : 0;
      char_meta_data.p_char_user_desc = NULL;
      char_meta_data.p_char_pf = &char_presentation_format;
      char_meta_data.p_user_desc_md = NULL;
      // CCCD (Client Characteristic Configuration Descriptor) needs to be 
      // set for characteristics allowing for notifications and indications.
-     char_meta_data.p_cccd_md = NULL;
+     char_meta_data.p_cccd_md = (characteristic->props &
+				 (CHAR_PROP_NOTIFY | CHAR_PROP_INDICATE)) ?
+	  &cccd_meta_data : NULL;
      char_meta_data.p_sccd_md = NULL;
 
      // Define attribute meta data. 
      ble_gatts_attr_md_t char_attr_meta_data;
      memset(&char_attr_meta_data, 0, sizeof(char_attr_meta_data));
-     // No security needed.
      BLE_GAP_CONN_SEC_MODE_SET_OPEN(&char_attr_meta_data.read_perm);
-     BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&char_attr_meta_data.write_perm);
+     if (characteristic->props & CHAR_PROP_WRITE_AUTH) {
+	  // Writing requires an encrypted link; whether the peer is 
+	  // bonded is checked by the application when authorizing the 
+	  // write request.
+	  BLE_GAP_CONN_SEC_MODE_SET_ENC_NO_MITM(
+	       &char_attr_meta_data.write_perm);
+	  char_attr_meta_data.wr_auth = 1;
+     } else {
+	  BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&char_attr_meta_data.write_perm);
+	  char_attr_meta_data.wr_auth = 0;
+     }
      // value location
      char_attr_meta_data.vloc = BLE_GATTS_VLOC_STACK;
      // always request read authorization from application 
      char_attr_meta_data.rd_auth = 0;
-     // always request write authorization from application
-     char_attr_meta_data.wr_auth = 0;
      // variable length attribute
-     char_attr_meta_data.vlen = 0;
+     char_attr_meta_data.vlen = 
+	  (characteristic->props & CHAR_PROP_VLEN) ? 1 : 0;
 
      // Define characteristic attributes. 
      ble_gatts_attr_t char_attributes;
      memset(&char_attributes, 0, sizeof(char_attributes));
      char_attributes.p_uuid = &ble_uuid;
      char_attributes.p_attr_md = &char_attr_meta_data;
-     char_attributes.init_len = sizeof(localtime);
+     char_attributes.init_len = characteristic->init_len;
      char_attributes.init_offs = 0;
-     char_attributes.max_len = MAX_LENGTH_LOCALTIME_CHAR;
-     // For attributes managed by the application (BLE_GATTS_VLOC_USER)
-     // rather than the BLE stack, set a pointer to the memory location here.
-     char_attributes.p_value = (uint8_t *) &localtime;
+     char_attributes.max_len = characteristic->max_len;
+     // The stack copies the initial value.
+     char_attributes.p_value = (uint8_t *) characteristic->p_value;
 
      // Add characteristic to service.
      if (sd_ble_gatts_characteristic_add(service_handle,
 					 &char_meta_data,
 					 &char_attributes,
-					 &char_handle_localtime) 
+					 p_handles) 
 	 != NRF_SUCCESS)
 	  die();
 }
@@ -524,14 +1904,7 @@ static void add_characteristic_localtime(uint16_t service_handle)
 static void service_init()
 {
      uint32_t err_code;
-     
-     // Add base UUID to list of base UUIDs.
-     // The uuid_type field filled by this function call can be used later to
-     // refer to this base UUID.
-     ble_uuid128_t base_uuid = {UUID_BASE};
-     err_code = sd_ble_uuid_vs_add(&base_uuid, &uuid_type);
-     if (err_code != NRF_SUCCESS)
-	  die();
+     uint8_t cccd_count = 0;
 
      // Build 128 bit service UUID by referring to base UUID using uuid_type
      // and specifying the two bytes that will replace byte 12 and 13 of the
@@ -546,8 +1919,17 @@ static void service_init()
 	  die();
      
      // Add characteristics to service.
-     add_characteristic_door_bell_alarm(service_handle);
-     add_characteristic_localtime(service_handle);
+     for (uint8_t i = 0; i < CHAR_COUNT; i++) {
+	  add_characteristic(service_handle, &characteristics[i], 
+			     &char_handles[i]);
+	  if (characteristics[i].props & 
+	      (CHAR_PROP_NOTIFY | CHAR_PROP_INDICATE))
+	       cccd_count++;
+     }
+
+     // CHAR_CCCD_COUNT must match the table.
+     if (cccd_count != CHAR_CCCD_COUNT)
+	  die();
 }
 
 static void conn_params_error_handler(uint32_t nrf_error)
@@ -576,10 +1958,10 @@ static void conn_params_init()
     ble_conn_params_init_t cp_init;
     ble_gap_conn_params_t conn_parameters;
 
-    conn_parameters.min_conn_interval = MIN_CONN_INTERVAL;
-    conn_parameters.max_conn_interval = MAX_CONN_INTERVAL;
-    conn_parameters.slave_latency = SLAVE_LATENCY;
-    conn_parameters.conn_sup_timeout = CONN_SUP_TIMEOUT;
+    conn_parameters.min_conn_interval = config.min_conn_interval;
+    conn_parameters.max_conn_interval = config.max_conn_interval;
+    conn_parameters.slave_latency = config.slave_latency;
+    conn_parameters.conn_sup_timeout = config.conn_sup_timeout;
 
     memset(&cp_init, 0, sizeof(cp_init));
     cp_init.p_conn_params = &conn_parameters;
@@ -594,34 +1976,103 @@ static void conn_params_init()
     if (ble_conn_params_init(&cp_init) != NRF_SUCCESS)
 	 die();
 }
+#endif
+
+static void uuid_base_init()
+{
+     // Add base UUID to list of base UUIDs.
+     // The uuid_type field filled by this function call can be used later to
+     // refer to this base UUID.
+     ble_uuid128_t base_uuid = {UUID_BASE};
+     if (sd_ble_uuid_vs_add(&base_uuid, &uuid_type) != NRF_SUCCESS)
+	  die();
+}
+
+#if !FEATURE_CONNECTED
+static void set_broadcast_advdata()
+{
+     ble_uuid_t adv_uuids[] = {{UUID_SERVICE, uuid_type}};
+     ble_advdata_manuf_data_t manuf_data;
+
+     // The softdevice copies the data, so it can be updated while 
+     // advertising.
+     manuf_data.company_identifier = BROADCAST_COMPANY_ID;
+     manuf_data.data.p_data = (uint8_t *) &broadcast_data;
+     manuf_data.data.size = sizeof(broadcast_data);
+
+     ble_advdata_t advdata;
+     memset(&advdata, 0, sizeof(advdata));
+     advdata.include_appearance = false;
+     advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+     advdata.p_manuf_specific_data = &manuf_data;
+
+     ble_advdata_t scanrsp;
+     memset(&scanrsp, 0, sizeof(scanrsp));
+     scanrsp.name_type = BLE_ADVDATA_FULL_NAME;
+     scanrsp.include_appearance = false;
+     scanrsp.uuids_complete.uuid_cnt = sizeof(adv_uuids)/sizeof(adv_uuids[0]);
+     scanrsp.uuids_complete.p_uuids = adv_uuids;
+
+     if (ble_advdata_set(&advdata, &scanrsp) != NRF_SUCCESS)
+	  die();
+}
+
+static void set_broadcast_battery_level()
+{
+     broadcast_data.battery_level = battery_level(battery_mv());
+     set_broadcast_advdata();
+}
+#endif
 
 static void advertising_init(void)
 {
+#if !FEATURE_CONNECTED
+     set_broadcast_battery_level();
+#else
      ble_uuid_t adv_uuids[] = {{UUID_SERVICE, uuid_type}};
      
      ble_advdata_t advdata;
      memset(&advdata, 0, sizeof(advdata));
-     advdata.name_type = BLE_ADVDATA_FULL_NAME;
      advdata.include_appearance = false;
      // LE General Discoverable Mode.
      advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+
+#if ADV_PAYLOAD_COMPACT
+     // Name and complete set of UUIDs are sent in the scan response 
+     // (see ADV_PAYLOAD_COMPACT). The scan response must not contain 
+     // flags.
+     ble_advdata_t scanrsp;
+     memset(&scanrsp, 0, sizeof(scanrsp));
+     scanrsp.name_type = BLE_ADVDATA_FULL_NAME;
+     scanrsp.include_appearance = false;
+     scanrsp.uuids_complete.uuid_cnt = sizeof(adv_uuids)/sizeof(adv_uuids[0]);
+     scanrsp.uuids_complete.p_uuids = adv_uuids;
+
+     if (ble_advdata_set(&advdata, &scanrsp) != NRF_SUCCESS)
+	  die();
+#else
+     advdata.name_type = BLE_ADVDATA_SHORT_NAME;
+     advdata.short_name_len = ADV_SHORT_NAME_LEN;
      // Send complete set of UUIDs.
      advdata.uuids_complete.uuid_cnt = sizeof(adv_uuids)/sizeof(adv_uuids[0]);
      advdata.uuids_complete.p_uuids = adv_uuids;
      
-     // No scan response data needs to be defined (second parameter) since 
-     // everything fits into the advertisement message (the scan response can 
-     // be requested by the central device to get more information from the 
-     // peripheral).
+     // No scan response data.
      if (ble_advdata_set(&advdata, NULL) != NRF_SUCCESS)
 	  die();
+#endif
+#endif
 }
 
 static void alarm_inhibit_timer_evt_handler(void *p_context)
 {
-     UNUSED_PARAMETER(p_context);
-     // Will accept again door bell signals.
-     is_alarm_inhibited = false;
+     // The context is the index of the input.
+     uint8_t input = (uint8_t) (uintptr_t) p_context;
+
+     // Will accept again door bell signals of this input.
+     // Executed in interrupt context; the main loop protects its 
+     // modifications of inhibited_inputs by a critical region.
+     inhibited_inputs &= ~(1 << input);
 }
 
 static void localtime_timer_evt_handler(void *p_context)
@@ -632,10 +2083,129 @@ static void localtime_timer_evt_handler(void *p_context)
      // place where the 32 bit variable localtime is updated. So we 
      // do not need to protect against concurrent write opertions
      // by disabling interrupts.
-     localtime += LOCALTIME_CLOCK_INTERVAL_SEC;
+     localtime += config.localtime_interval_sec;
+     localtime_rtc_ticks = (localtime_rtc_ticks + localtime_interval_ticks) &
+	  RTC_COUNTER_MASK;
+
+     push_event(EVENT_LOCALTIME, 0);
+}
+
+#if FEATURE_RING_PATTERN
+static void restart_ring_capture_timer(uint32_t timeout)
+{
+     app_timer_stop(ring_capture_timer);
+     if (app_timer_start(ring_capture_timer, timeout, NULL) != NRF_SUCCESS)
+	  die();
+}
+
+static void ring_capture_record_interval(uint32_t ticks)
+{
+     // Convert to units of RING_CAPTURE_RESOLUTION_MS. Intervals are 
+     // bounded by the capture timeouts, so the multiplication does not 
+     // overflow.
+     uint32_t units = (ticks * (APP_TIMER_PRESCALER + 1) * 
+		       (1000 / RING_CAPTURE_RESOLUTION_MS)) / 32768;
+
+     if (units > 0x7fff)
+	  units = 0x7fff;
+
+     if (units < 0x80) {
+	  if (ring_capture_len + 1 > RING_CAPTURE_BUFFER_SIZE) {
+	       ring_capture.flags |= RING_PATTERN_FLAG_OVERFLOW;
+	       return;
+	  }
+	  ring_capture.data[ring_capture_len++] = (uint8_t) units;
+     } else {
+	  if (ring_capture_len + 2 > RING_CAPTURE_BUFFER_SIZE) {
+	       ring_capture.flags |= RING_PATTERN_FLAG_OVERFLOW;
+	       return;
+	  }
+	  ring_capture.data[ring_capture_len++] = 0x80 | (uint8_t) (units >> 8);
+	  ring_capture.data[ring_capture_len++] = (uint8_t) units;
+     }
+}
+
+static void ring_capture_edge(uint8_t input, bool pressed)
+{
+     // Called for each debounced edge of an input. The work per edge is 
+     // constant, and the debouncing delay bounds the edge rate, so 
+     // capturing adds a bounded CPU load. Only one input is captured at a
+     // time: the input whose press started the capture.
+     uint32_t now = rtc_ticks();
+
+     if (!is_ring_capture_active) {
+	  // A capture always starts with a press.
+	  if (!pressed)
+	       return;
+	  memset(&ring_capture, 0, sizeof(ring_capture));
+	  ring_capture.flags = input << RING_PATTERN_INPUT_SHIFT;
+	  ring_capture_len = 0;
+	  ring_capture_input = input;
+	  is_ring_capture_active = true;
+     } else {
+	  if (input != ring_capture_input || pressed == is_ring_capture_pressed)
+	       return;
+	  // Record duration of the press or gap ending with this edge.
+	  ring_capture_record_interval(rtc_ticks_since(ring_capture_last_edge));
+     }
+
+     if (pressed && ring_capture.presses < UINT8_MAX)
+	  ring_capture.presses++;
+     is_ring_capture_pressed = pressed;
+     ring_capture_last_edge = now;
+
+     restart_ring_capture_timer(pressed ? RING_CAPTURE_PRESS_TIMEOUT : 
+				RING_CAPTURE_GAP_TIMEOUT);
+}
+
+static void ring_capture_finish(uint8_t flags)
+{
+     ring_capture.flags |= flags;
+     is_ring_capture_active = false;
+
+     // Publish pattern to main loop.
+     ring_pattern = ring_capture;
+     ring_pattern_len = offsetof(struct ring_pattern, data) + 
+	  ring_capture_len;
+     push_event(EVENT_RING_PATTERN, 0);
+}
+
+static void ring_capture_timer_evt_handler(void *p_context)
+{
+     UNUSED_PARAMETER(p_context);
+
+     if (!is_ring_capture_active)
+	  return;
+
+     if (is_ring_capture_pressed) {
+	  // Record the press with its maximum duration.
+	  ring_capture_record_interval(RING_CAPTURE_PRESS_TIMEOUT);
+	  ring_capture_finish(RING_PATTERN_FLAG_TRUNCATED);
+     } else {
+	  // Bell has been quiet long enough. The trailing gap is not
+	  // recorded.
+	  ring_capture_finish(0);
+     }
+}
+#endif
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+static void indication_timer_evt_handler(void *p_context)
+{
+     UNUSED_PARAMETER(p_context);
 
-     is_localtime_updated = true;
+     push_event(EVENT_INDICATION_TIMEOUT, 0);
 }
+#endif
+
+#if !FEATURE_CONNECTED
+static void broadcast_burst_timer_evt_handler(void *p_context)
+{
+     UNUSED_PARAMETER(p_context);
+
+     push_event(EVENT_BROADCAST_BURST_END, 0);
+}
+#endif
 
 static uint32_t local_time()
 {
@@ -651,105 +2221,695 @@ static void timers_init()
      // BLE softdevice).
      APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_QUEUE_SIZE, false);
 
-     if (app_timer_create(&alarm_inhibit_timer, APP_TIMER_MODE_SINGLE_SHOT,
-			  alarm_inhibit_timer_evt_handler) != NRF_SUCCESS)
-	  die();
+     for (uint8_t i = 0; i < INPUT_COUNT; i++) {
+	  app_timer_id_t timer_id = &alarm_inhibit_timers_data[i];
+	  if (app_timer_create(&timer_id, APP_TIMER_MODE_SINGLE_SHOT,
+			       alarm_inhibit_timer_evt_handler) != NRF_SUCCESS)
+	       die();
+	  timer_id = &debounce_timers_data[i];
+	  if (app_timer_create(&timer_id, APP_TIMER_MODE_SINGLE_SHOT,
+			       debounce_timer_evt_handler) != NRF_SUCCESS)
+	       die();
+     }
 
      if (app_timer_create(&localtime_timer, APP_TIMER_MODE_REPEATED,
 			  localtime_timer_evt_handler) != NRF_SUCCESS)
 	  die();
+
+#if FEATURE_RING_PATTERN
+     if (app_timer_create(&ring_capture_timer, APP_TIMER_MODE_SINGLE_SHOT,
+			  ring_capture_timer_evt_handler) != NRF_SUCCESS)
+	  die();
+#endif
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+     if (app_timer_create(&indication_timer, APP_TIMER_MODE_SINGLE_SHOT,
+			  indication_timer_evt_handler) != NRF_SUCCESS)
+	  die();
+#endif
+
+#if !FEATURE_CONNECTED
+     if (app_timer_create(&broadcast_burst_timer, APP_TIMER_MODE_SINGLE_SHOT,
+			  broadcast_burst_timer_evt_handler) != NRF_SUCCESS)
+	  die();
+#endif
 }
 
-static void start_alarm_inhibit_timer()
+static void start_alarm_inhibit_timer(uint8_t input)
 {
-     if (app_timer_start(alarm_inhibit_timer, ALARM_INHIBIT_DELAY, NULL) !=
+     // Pass the index of the input as context to the timer handler.
+     if (app_timer_start(&alarm_inhibit_timers_data[input], 
+			 alarm_inhibit_delay_ticks, 
+			 (void *) (uintptr_t) input) !=
 	 NRF_SUCCESS)
 	  die();
 }
 
 static void start_localtime_timer()
 {
-     if (app_timer_start(localtime_timer, LOCALTIME_CLOCK_INTERVAL, NULL) !=
+     if (app_timer_start(localtime_timer, localtime_interval_ticks, NULL) !=
 	 NRF_SUCCESS)
 	  die();
 }
 
-static void stop_alarm_inhibit_timer()
+#if FEATURE_CONFIG
+static void stop_localtime_timer()
 {
-     app_timer_stop(alarm_inhibit_timer);
+     app_timer_stop(localtime_timer);
 }
 
-static void notify_door_bell_alarm()
+static void restart_localtime_timer()
 {
-     // Make a copy of door_bell_alarm_time to avoid race conditions of
-     // concurrent write operations to variable door_bell_alarm_time.
-     // (Strictly speaking, concurrent writes are very unlikely due to 
-     // the long inhibit period preventing immediate follow-up updates.)
-     // 32 bit load operations are atomic on ARM Cortex M0, so we do not
-     // need to protect this assignment by disabling interrupts.
-     uint32_t t = door_bell_alarm_time;
+     uint32_t diff, sec;
 
-     ble_gatts_hvx_params_t params;
-     uint16_t len = sizeof(t);
-     
-     // Send door bell alarm event as notification.
-     memset(&params, 0, sizeof(params));
-     params.type = BLE_GATT_HVX_NOTIFICATION;
-     params.handle = char_handle_door_bell_alarm.value_handle;
-     params.p_data = (uint8_t *) &t;
-     params.p_len = &len;
-     if (sd_ble_gatts_hvx(conn_handle, &params) != NRF_SUCCESS)
-	  die();
+     stop_localtime_timer();
+
+     // Carry the whole seconds elapsed since the last tick over to local 
+     // time. The remainder stays with localtime_rtc_ticks, so local time 
+     // continues without a jump.
+     CRITICAL_REGION_ENTER();
+     app_timer_cnt_diff_compute(rtc_ticks(), localtime_rtc_ticks, &diff);
+     sec = diff / RTC_TICKS_PER_SEC;
+     localtime += sec;
+     localtime_rtc_ticks = (localtime_rtc_ticks + sec * RTC_TICKS_PER_SEC) &
+	  RTC_COUNTER_MASK;
+     CRITICAL_REGION_EXIT();
+
+     start_localtime_timer();
+}
+#endif
+
+static bool is_input_active(uint8_t input)
+{
+     // Inputs are active low.
+     return !nrf_drv_gpiote_in_is_set(inputs[input].pin_no);
 }
 
-static void buttons_evt_handler(uint8_t pin_no, uint8_t action)
+static void apply_debounce_action(uint8_t input, 
+				  struct debounce_action action)
 {
-     switch (pin_no) {
-     case PIN_BELL :
-	  if (APP_BUTTON_PUSH == action)
-	       is_door_bell_alarm = true;
+     app_timer_id_t timer_id = &debounce_timers_data[input];
+
+     switch (action.timer) {
+     case DEBOUNCE_TIMER_START:
+	  // Restart if running. The context is the index of the input.
+	  app_timer_stop(timer_id);
+	  if (app_timer_start(timer_id, action.timeout, 
+			      (void *) (uintptr_t) input) != NRF_SUCCESS)
+	       die();
+	  break;
+     case DEBOUNCE_TIMER_STOP:
+	  app_timer_stop(timer_id);
 	  break;
      }
+
+     if (action.event != DEBOUNCE_EVENT_NONE) {
+	  if (action.event == DEBOUNCE_EVENT_PRESS)
+	       push_event(EVENT_DOOR_BELL, input);
+#if FEATURE_RING_PATTERN
+	  ring_capture_edge(input, action.event == DEBOUNCE_EVENT_PRESS);
+#endif
+     }
+
+#if FEATURE_EARLY_RING
+     // An early ring is resolved as soon as debouncing has either 
+     // detected a press or come to rest without one. A confirmed early 
+     // ring is signalled by the EVENT_DOOR_BELL event.
+     if ((speculative_inputs & (1 << input)) &&
+	 (debouncers[input].is_pressed || 
+	  !debouncers[input].is_timer_running)) {
+	  speculative_inputs &= ~(1 << input);
+	  if (!debouncers[input].is_pressed)
+	       push_event(EVENT_EARLY_RING_CANCEL, input);
+     }
+#endif
+}
+
+static void input_evt_handler(nrf_drv_gpiote_pin_t pin, 
+			      nrf_gpiote_polarity_t action)
+{
+     // Executed in GPIOTE interrupt context for every edge. 
+     uint32_t now = rtc_ticks();
+
+     // Map pin to input index.
+     for (uint8_t i = 0; i < INPUT_COUNT; i++) {
+	  if (inputs[i].pin_no != pin)
+	       continue;
+	  bool active = is_input_active(i);
+#if FEATURE_EARLY_RING
+	  // The first edge of an idle input is reported early if a client 
+	  // has subscribed to early rings.
+	  if (active && !debouncers[i].is_pressed && 
+	      !debouncers[i].is_timer_running &&
+	      (subscriptions & (1 << CHAR_EARLY_RING))) {
+	       speculative_inputs |= (1 << i);
+	       push_event(EVENT_EARLY_RING, i);
+	  }
+#endif
+	  apply_debounce_action(i, debounce_edge(&debouncers[i], now, active));
+	  break;
+     }
+}
+
+static void debounce_timer_evt_handler(void *p_context)
+{
+     // The context is the index of the input.
+     uint8_t input = (uint8_t) (uintptr_t) p_context;
+
+     apply_debounce_action(input, debounce_timeout(&debouncers[input], 
+						   rtc_ticks(),
+						   is_input_active(input)));
 }
 
 static void buttons_init()
 {
-     // We treat the door bell GPIO as a button which is active low.
-     // The DoorBell20 board has a pull-up resistor. For the nRF51 DK, we 
-     // enable the internal pull-up resistor of the nRF51 chip.
-     // Door bell signal is active low -> second parameter = false.
-     #ifdef TARGET_BOARD_NRF51DK
-     static app_button_cfg_t buttons[] = {
-	  {PIN_BELL, false, NRF_GPIO_PIN_PULLUP, buttons_evt_handler}
-     };
-     #else
-     static app_button_cfg_t buttons[] = {
-	  {PIN_BELL, false, NRF_GPIO_PIN_NOPULL, buttons_evt_handler}
-     };
-     #endif
-     if (app_button_init(buttons, sizeof(buttons) / sizeof(buttons[0]),
-			 DEBOUNCING_DELAY) != NRF_SUCCESS)
+     nrf_drv_gpiote_in_config_t gpiote_config = 
+	  GPIOTE_CONFIG_IN_SENSE_TOGGLE(false);
+
+     // GPIOTE is used in low-power mode (PORT event) like app_button does.
+     if (!nrf_drv_gpiote_is_init() && nrf_drv_gpiote_init() != NRF_SUCCESS)
 	  die();
+
+     debounce_params.delay = APP_TIMER_TICKS(config.debouncing_delay_ms, 
+					     APP_TIMER_PRESCALER);
+     for (uint8_t i = 0; i < INPUT_COUNT; i++) {
+	  debounce_init(&debouncers[i], &debounce_params);
+	  gpiote_config.pull = inputs[i].pull_cfg;
+	  if (nrf_drv_gpiote_in_init(inputs[i].pin_no, &gpiote_config, 
+				     input_evt_handler) != NRF_SUCCESS)
+	       die();
+     }
 }
 
 static void start_button_event_detection()
 {
-     if (app_button_enable() != NRF_SUCCESS)
-          die();
+     for (uint8_t i = 0; i < INPUT_COUNT; i++)
+	  nrf_drv_gpiote_in_event_enable(inputs[i].pin_no, true);
+}
+
+#if FEATURE_CONFIG
+static void set_debouncing_delay()
+{
+     // Takes effect with the next edge. The parameters are read by the 
+     // GPIOTE and app timer handlers.
+     uint32_t delay = APP_TIMER_TICKS(config.debouncing_delay_ms, 
+				      APP_TIMER_PRESCALER);
+
+     CRITICAL_REGION_ENTER();
+     debounce_params.delay = delay;
+     CRITICAL_REGION_EXIT();
+}
+#endif
+
+#if FEATURE_BONDING
+#if FEATURE_CONFIG
+static void storage_evt_handler(pstorage_handle_t *handle, uint8_t op_code,
+				uint32_t result, uint8_t *p_data, 
+				uint32_t data_len)
+{
+     // Failing flash operations are unexpected. After rebooting, the last
+     // configuration that was stored successfully is used.
+     if (result != NRF_SUCCESS)
+	  die();
+
+     if (op_code == PSTORAGE_UPDATE_OP_CODE)
+	  is_config_store_pending = false;
+}
+#endif
+
+static void storage_init()
+{
+#if FEATURE_CONFIG
+     pstorage_module_param_t param;
+#endif
+
+     // pstorage uses the softdevice for flash operations, so the BLE stack
+     // must be initialized before.
+     if (pstorage_init() != NRF_SUCCESS)
+	  die();
+
+#if FEATURE_CONFIG
+     memset(&param, 0, sizeof(param));
+     param.block_size = sizeof(struct config);
+     param.block_count = 1;
+     param.cb = storage_evt_handler;
+     if (pstorage_register(&param, &config_storage_handle) != NRF_SUCCESS)
+	  die();
+#endif
+}
+#endif
+
+static void update_timer_intervals()
+{
+     alarm_inhibit_delay_ticks = APP_TIMER_TICKS(config.alarm_inhibit_delay_ms,
+						 APP_TIMER_PRESCALER);
+     localtime_interval_ticks = APP_TIMER_TICKS(
+	  1000 * (uint32_t) config.localtime_interval_sec, 
+	  APP_TIMER_PRESCALER);
+}
+
+static void config_init()
+{
+#if FEATURE_CONFIG
+     // Erased flash or a block stored by a firmware with a different 
+     // configuration layout is not valid -> use defaults.
+     if (pstorage_load((uint8_t *) &config, &config_storage_handle, 
+		       sizeof(config), 0) != NRF_SUCCESS)
+	  die();
+     if (!config_is_valid(&config))
+	  config = default_config;
+#else
+     config = default_config;
+#endif
+
+     update_timer_intervals();
+}
+
+#if FEATURE_CONFIG
+static void store_config()
+{
+     // config_flash holds the new configuration.
+     is_config_store_pending = true;
+     if (pstorage_update(&config_storage_handle, (uint8_t *) &config_flash,
+			 sizeof(config_flash), 0) != NRF_SUCCESS)
+	  die();
+}
+
+static void change_config()
+{
+     struct config old_config = config;
+     ble_gap_conn_params_t conn_params;
+     uint32_t err_code;
+
+     // The BLE event handler might accept another write meanwhile.
+     CRITICAL_REGION_ENTER();
+     config_flash = config_written;
+     is_config_written = false;
+     CRITICAL_REGION_EXIT();
+
+     config = config_flash;
+     update_timer_intervals();
+
+     // Apply changed parameters immediately. The alarm inhibit delay is 
+     // applied with the next alarm.
+     if (config.debouncing_delay_ms != old_config.debouncing_delay_ms)
+	  set_debouncing_delay();
+
+     if (config.min_conn_interval != old_config.min_conn_interval ||
+	 config.max_conn_interval != old_config.max_conn_interval ||
+	 config.slave_latency != old_config.slave_latency ||
+	 config.conn_sup_timeout != old_config.conn_sup_timeout) {
+	  conn_params.min_conn_interval = config.min_conn_interval;
+	  conn_params.max_conn_interval = config.max_conn_interval;
+	  conn_params.slave_latency = config.slave_latency;
+	  conn_params.conn_sup_timeout = config.conn_sup_timeout;
+	  // Updates the preferred connection parameters and re-negotiates 
+	  // them with the central if connected. Without a connection, 
+	  // only the preferred parameters can be updated.
+	  err_code = ble_conn_params_change_conn_params(&conn_params);
+	  if (err_code != NRF_SUCCESS && conn_handle != BLE_CONN_HANDLE_INVALID)
+	       die();
+     }
+
+     if (config.localtime_interval_sec != old_config.localtime_interval_sec)
+	  restart_localtime_timer();
+
+     if (config.adv_interval != old_config.adv_interval && 
+	 conn_handle == BLE_CONN_HANDLE_INVALID) {
+	  // Restart advertising with new interval.
+	  sd_ble_gap_adv_stop();
+	  start_advertising();
+     }
+
+     store_config();
+}
+#endif
+
+#if FEATURE_BONDING
+static ret_code_t device_manager_evt_handler(dm_handle_t const *p_handle,
+					     dm_event_t const *p_event,
+					     ret_code_t event_result)
+{
+     switch (p_event->event_id) {
+     case DM_EVT_LINK_SECURED:
+	  // The link has been encrypted, either with the keys of a bonded
+	  // peer or after pairing with a new peer. Only bonded peers have a 
+	  // valid device id.
+	  is_link_bonded = (event_result == NRF_SUCCESS && 
+			    p_handle->device_id != DM_INVALID_ID);
+	  refresh_subscriptions();
+	  break;
+     }
+
+     return NRF_SUCCESS;
+}
+
+static void device_manager_init()
+{
+     dm_init_param_t init_param;
+     dm_application_param_t register_param;
+
+     // The device manager stores bonds using pstorage, so storage_init()
+     // must be called before.
+     init_param.clear_persistent_data = false;
+     if (dm_init(&init_param) != NRF_SUCCESS)
+	  die();
+
+     // "Just works" bonding, since the device has neither a display nor a 
+     // keyboard. The device manager is configured to store a single bond
+     // (see device_manager_cnfg.h), i.e., the first gateway bonding with 
+     // the device is the only one that can change its configuration.
+     memset(&register_param, 0, sizeof(register_param));
+     register_param.sec_param.bond = 1;
+     register_param.sec_param.mitm = 0;
+     register_param.sec_param.io_caps = BLE_GAP_IO_CAPS_NONE;
+     register_param.sec_param.oob = 0;
+     register_param.sec_param.min_key_size = 7;
+     register_param.sec_param.max_key_size = 16;
+     register_param.evt_handler = device_manager_evt_handler;
+     register_param.service_type = DM_PROTOCOL_CNTXT_GATT_SRVR_ID;
+     if (dm_register(&dm_app_handle, &register_param) != NRF_SUCCESS)
+	  die();
 }
+#endif
+
+static void on_door_bell_event(const struct event *event)
+{
+     uint8_t input_mask = 1 << event->arg;
+
+     if (inhibited_inputs & input_mask)
+	  return;
+
+     // Collect the inputs of all door bell events of the current batch 
+     // into a single alarm. The alarm time is the local time when the first
+     // event occurred, not when the main loop processes it.
+     if (pending_alarm_inputs == 0)
+	  pending_alarm_local_ms = (uint64_t) event->localtime * 1000 + 
+	       event->localtime_ms;
+     pending_alarm_inputs |= input_mask;
+
+     // The alarm inhibit timer handler modifies inhibited_inputs in 
+     // interrupt context.
+     CRITICAL_REGION_ENTER();
+     inhibited_inputs |= input_mask;
+     CRITICAL_REGION_EXIT();
+     start_alarm_inhibit_timer(event->arg);
+}
+
+static void on_lost_door_bell_events()
+{
+     struct event event;
+     uint8_t lost_inputs;
+
+     // The door bell events did not fit into the event queue, so their 
+     // time is lost. The alarm is stamped with the current time instead.
+     CRITICAL_REGION_ENTER();
+     lost_inputs = lost_door_bell_inputs;
+     lost_door_bell_inputs = 0;
+     event.rtc_ticks = rtc_ticks();
+     local_time_at(event.rtc_ticks, &event.localtime, &event.localtime_ms);
+     CRITICAL_REGION_EXIT();
+
+     event.type = EVENT_DOOR_BELL;
+     for (uint8_t i = 0; i < INPUT_COUNT; i++) {
+	  if (!(lost_inputs & (1 << i)))
+	       continue;
+	  event.arg = i;
+	  on_door_bell_event(&event);
+     }
+}
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+static void set_alarm_delivery_char()
+{
+     alarm_delivery.pending = pending_alarms_count;
+     set_characteristic_value(CHAR_ALARM_DELIVERY, &alarm_delivery,
+			      sizeof(alarm_delivery));
+}
+
+static void queue_pending_alarm(const struct door_bell_alarm *alarm)
+{
+     uint8_t i;
+
+     if (pending_alarms_count < PENDING_ALARMS_SIZE) {
+	  i = (pending_alarms_first + pending_alarms_count) %
+	       PENDING_ALARMS_SIZE;
+	  pending_alarms[i] = *alarm;
+	  pending_alarms_count++;
+     } else {
+	  // Merge into the newest alarm, which is never the one being sent
+	  // (PENDING_ALARMS_SIZE > 1). Its time stays the time of the
+	  // earlier alarm.
+	  i = (pending_alarms_first + pending_alarms_count - 1) %
+	       PENDING_ALARMS_SIZE;
+	  pending_alarms[i].inputs |= alarm->inputs;
+	  alarm_delivery.merged++;
+     }
+     set_alarm_delivery_char();
+}
+
+static void on_alarm_confirmed(uint32_t confirmed_ticks)
+{
+     uint32_t rtt;
+
+     is_indication_in_flight = false;
+     if (app_timer_stop(indication_timer) != NRF_SUCCESS)
+	  die();
+
+     app_timer_cnt_diff_compute(confirmed_ticks, indication_start, &rtt);
+     alarm_delivery.last_rtt_ticks = rtt;
+     if (rtt > alarm_delivery.max_rtt_ticks)
+	  alarm_delivery.max_rtt_ticks = rtt;
+     alarm_delivery.confirmed++;
+
+     pending_alarms_first = (pending_alarms_first + 1) % PENDING_ALARMS_SIZE;
+     pending_alarms_count--;
+     is_pending_alarm_sent = false;
+     set_alarm_delivery_char();
+}
+
+static void on_indication_timeout_event()
+{
+     // The timeout event might have been queued just before the
+     // confirmation arrived. Then the confirmation wins.
+     if (!is_indication_in_flight || is_indication_confirmed)
+	  return;
+
+     is_indication_in_flight = false;
+     alarm_delivery.timeouts++;
+     set_alarm_delivery_char();
+
+     // No further indications can be sent over this link. Drop it, so the
+     // client reconnects, and the alarm is sent again. If the link is
+     // already being terminated, disconnecting fails, which is fine.
+     if (conn_handle != BLE_CONN_HANDLE_INVALID)
+	  sd_ble_gap_disconnect(conn_handle,
+				BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+}
+
+static void deliver_alarms()
+{
+     // Called by the main loop after every wakeup. Drives the acknowledged
+     // delivery of the pending alarms one at a time.
+     if (is_indication_confirmed) {
+	  is_indication_confirmed = false;
+	  if (is_indication_in_flight)
+	       on_alarm_confirmed(indication_confirmed_ticks);
+     }
+
+     if (is_indication_in_flight &&
+	 indication_link_generation != link_generation) {
+	  // The link has been lost before the confirmation arrived.
+	  is_indication_in_flight = false;
+	  if (app_timer_stop(indication_timer) != NRF_SUCCESS)
+	       die();
+     }
+
+     if (!is_acknowledged_delivery && !is_indication_in_flight &&
+	 pending_alarms_count > 0) {
+	  // The client switched to notifications. Alarms are no longer
+	  // kept.
+	  pending_alarms_count = 0;
+	  is_pending_alarm_sent = false;
+	  set_alarm_delivery_char();
+     }
+
+     // Without a link, alarms are kept until the next client has
+     // subscribed to indications again.
+     if (is_indication_in_flight || pending_alarms_count == 0 ||
+	 conn_handle == BLE_CONN_HANDLE_INVALID ||
+	 !(indication_subscriptions & (1 << CHAR_DOOR_BELL_ALARM)))
+	  return;
+
+     // If the indication cannot be sent now, e.g., since the transmit
+     // buffers are full, it is tried again after the next wakeup.
+     if (send_hvx(CHAR_DOOR_BELL_ALARM, BLE_GATT_HVX_INDICATION,
+		  &pending_alarms[pending_alarms_first],
+		  sizeof(struct door_bell_alarm)) != NRF_SUCCESS)
+	  return;
+     if (is_pending_alarm_sent)
+	  alarm_delivery.retransmissions++;
+     is_pending_alarm_sent = true;
+     is_indication_in_flight = true;
+     indication_link_generation = link_generation;
+     indication_start = rtc_ticks();
+     if (app_timer_start(indication_timer, INDICATION_TIMEOUT, NULL) !=
+	 NRF_SUCCESS)
+	  die();
+}
+#endif
+
+#if !FEATURE_CONNECTED
+static void broadcast_alarm()
+{
+     broadcast_data.alarm = door_bell_alarm;
+     set_broadcast_advdata();
+
+     // Advertise with the burst interval for BROADCAST_BURST_DURATION 
+     // after the last alarm.
+     if (!is_broadcast_burst) {
+	  is_broadcast_burst = true;
+	  sd_ble_gap_adv_stop();
+	  start_advertising();
+     }
+     app_timer_stop(broadcast_burst_timer);
+     broadcast_burst_start = rtc_ticks();
+     if (app_timer_start(broadcast_burst_timer, BROADCAST_BURST_DURATION, 
+			 NULL) != NRF_SUCCESS)
+	  die();
+}
+
+static void on_broadcast_burst_end_event()
+{
+     // The timer might have expired just before the burst was extended by 
+     // another alarm. Then the burst goes on.
+     if (!is_broadcast_burst || 
+	 rtc_ticks_since(broadcast_burst_start) < BROADCAST_BURST_DURATION)
+	  return;
+
+     is_broadcast_burst = false;
+     sd_ble_gap_adv_stop();
+     start_advertising();
+}
+#endif
+
+static void send_door_bell_alarm()
+{
+     // This is the only place where variable door_bell_alarm is written.
+     door_bell_alarm.time = pending_alarm_local_ms / 1000;
+     door_bell_alarm.flags = 0;
+#if FEATURE_WALLCLOCK
+     if (is_wallclock_set) {
+	  door_bell_alarm.time = wallclock_at(pending_alarm_local_ms) / 1000;
+	  door_bell_alarm.flags = DOOR_BELL_ALARM_FLAG_WALLCLOCK;
+     }
+#endif
+     door_bell_alarm.inputs = pending_alarm_inputs;
+     door_bell_alarm.seq = ++door_bell_alarm_seq;
+     pending_alarm_inputs = 0;
+
+#if !FEATURE_CONNECTED
+     broadcast_alarm();
+#else
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+     if (is_acknowledged_delivery) {
+	  // Keep the alarm until it has been confirmed (see
+	  // deliver_alarms()). Update the value, so the latest alarm can
+	  // also be read.
+	  set_characteristic_value(CHAR_DOOR_BELL_ALARM, &door_bell_alarm,
+				   sizeof(door_bell_alarm));
+	  queue_pending_alarm(&door_bell_alarm);
+	  return;
+     }
+#endif
+     update_characteristic(CHAR_DOOR_BELL_ALARM, &door_bell_alarm,
+			   sizeof(door_bell_alarm));
+#endif
+}
+
+#if FEATURE_EARLY_RING
+static void send_early_ring(uint8_t kind, uint8_t input)
+{
+     early_ring.kind = kind;
+     early_ring.input = input;
+     early_ring.seq = early_ring_seqs[input];
+     update_characteristic(CHAR_EARLY_RING, &early_ring, sizeof(early_ring));
+}
+
+static void on_early_ring_event(const struct event *event)
+{
+     uint8_t input_mask = 1 << event->arg;
+
+     // No early rings for inputs whose alarms are inhibited, or if the
+     // client has unsubscribed in the meantime.
+     if ((inhibited_inputs & input_mask) || 
+	 !(subscriptions & (1 << CHAR_EARLY_RING)))
+	  return;
+
+     early_ring_seqs[event->arg] = early_ring_seq++;
+     tentative_inputs |= input_mask;
+     send_early_ring(EARLY_RING_TENTATIVE, event->arg);
+}
+
+static void resolve_early_ring(uint8_t input, uint8_t kind)
+{
+     uint8_t input_mask = 1 << input;
+
+     if (!(tentative_inputs & input_mask))
+	  return;
+     tentative_inputs &= ~input_mask;
+     // Without subscription, the value is just updated.
+     send_early_ring(kind, input);
+}
+#endif
+
+#if FEATURE_RING_PATTERN
+static void on_ring_pattern_event()
+{
+     // A ring has been captured completely. The pattern is sent 
+     // independent of alarm inhibition, so clients can see every ring.
+     update_characteristic(CHAR_RING_PATTERN, &ring_pattern, ring_pattern_len);
+}
+#endif
+
+#if FEATURE_ENERGY_LEDGER
+// Attributes the current wakeup of the main loop to source unless an 
+// earlier event of the batch has been accounted already.
+#define ACCOUNT_WAKEUP_SOURCE(source) \
+     do { \
+	  if (wakeup_source == WAKEUP_SOURCE_OTHER) \
+	       wakeup_source = (source); \
+     } while (0)
+#else
+#define ACCOUNT_WAKEUP_SOURCE(source)
+#endif
 
 int main(void)
 {
      led_init();
 	       
      timers_init();
-     buttons_init();
      ble_stack_init();
+#if FEATURE_BONDING
+     storage_init();
+     device_manager_init();
+#endif
+     config_init();
+     buttons_init();
+#if FEATURE_ENERGY_LEDGER
+     radio_notification_init();
+#endif
      gap_init();
+     uuid_base_init();
+#if FEATURE_CONNECTED
      service_init();
+#endif
      advertising_init();
+#if FEATURE_CONNECTED
      conn_params_init();
+#endif
 
+     localtime_rtc_ticks = rtc_ticks();
      start_localtime_timer();
      start_advertising();
      start_button_event_detection();
@@ -762,32 +2922,135 @@ int main(void)
 	  // pressed buttons.
 	  sd_app_evt_wait();
 
+	  // BLE events have already been processed in interrupt context 
+	  // when we get here (and accounted by the BLE event handler). 
+	  // Account the time spent in the main loop to the first queued 
+	  // event.
+#if FEATURE_ENERGY_LEDGER
+	  uint32_t wakeup_start = rtc_ticks();
+	  enum wakeup_source wakeup_source = WAKEUP_SOURCE_OTHER;
+#endif
+	  bool is_localtime_updated = false;
+	  struct event event;
+
+#if FEATURE_CONNECTED
+	  // Send notifications dropped for lack of transmit buffers before
+	  // newer ones; the softdevice has freed buffers if it has
+	  // transmitted packets since.
+	  if (dropped_notifications != 0)
+	       resend_dropped_notifications();
+#endif
+
+	  // Drain all events that occurred since the last wakeup in one
+	  // batch. Characteristics that only reflect the latest state are 
+	  // updated once per batch.
+	  while (event_queue_pop(&event_queue, &event)) {
+	       switch (event.type) {
+	       case EVENT_DOOR_BELL:
+		    ACCOUNT_WAKEUP_SOURCE(WAKEUP_SOURCE_BELL);
+#if FEATURE_EARLY_RING
+		    // A tentative early ring is confirmed before the alarm
+		    // is sent.
+		    resolve_early_ring(event.arg, EARLY_RING_CONFIRM);
+#endif
+		    on_door_bell_event(&event);
+		    break;
+#if FEATURE_EARLY_RING
+	       case EVENT_EARLY_RING:
+		    ACCOUNT_WAKEUP_SOURCE(WAKEUP_SOURCE_BELL);
+		    on_early_ring_event(&event);
+		    break;
+	       case EVENT_EARLY_RING_CANCEL:
+		    ACCOUNT_WAKEUP_SOURCE(WAKEUP_SOURCE_BELL);
+		    resolve_early_ring(event.arg, EARLY_RING_CANCEL);
+		    break;
+#endif
+#if FEATURE_RING_PATTERN
+	       case EVENT_RING_PATTERN:
+		    ACCOUNT_WAKEUP_SOURCE(WAKEUP_SOURCE_BELL);
+		    on_ring_pattern_event();
+		    break;
+#endif
+	       case EVENT_LOCALTIME:
+		    ACCOUNT_WAKEUP_SOURCE(WAKEUP_SOURCE_LOCALTIME);
+		    is_localtime_updated = true;
+		    break;
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+	       case EVENT_INDICATION_TIMEOUT:
+		    on_indication_timeout_event();
+		    break;
+#endif
+#if !FEATURE_CONNECTED
+	       case EVENT_BROADCAST_BURST_END:
+		    on_broadcast_burst_end_event();
+		    break;
+#endif
+	       default:
+		    // Events of disabled features are never queued.
+		    break;
+	       }
+	  }
+
+	  if (lost_door_bell_inputs != 0) {
+	       ACCOUNT_WAKEUP_SOURCE(WAKEUP_SOURCE_BELL);
+	       on_lost_door_bell_events();
+	  }
+
+#if FEATURE_WALLCLOCK
+	  if (is_wallclock_written) {
+	       // A bonded client has written the wall-clock time. Apply it 
+	       // before stamping alarms.
+	       on_wallclock_written();
+	  }
+#endif
+
+	  if (pending_alarm_inputs != 0) {
+	       // Send a single alarm for all inputs that became active.
+	       send_door_bell_alarm();
+	  }
+
+#if FEATURE_ACKNOWLEDGED_DELIVERY
+	  // Send pending alarms in acknowledged delivery mode.
+	  deliver_alarms();
+#endif
+
 	  if (is_localtime_updated) {
+#if FEATURE_CONNECTED
 	       // Update the localtime characteristic value to reflect current
 	       // time.
 	       set_localtime_char();
-	       is_localtime_updated = false;
+#else
+	       // Advertise the current battery level.
+	       set_broadcast_battery_level();
+#endif
+	       // Publish the energy ledger and wall-clock time with the same 
+	       // period.
+#if FEATURE_ENERGY_LEDGER
+	       set_energy_ledger_char();
+#endif
+#if FEATURE_WALLCLOCK
+	       set_wallclock_char();
+#endif
 	  }
-	  
-	  if (is_door_bell_alarm) {
-	       if (!is_alarm_inhibited) {
-		    // This is the only place where where variable 
-		    // door_bell_alarm_time is written. So we do not have to 
-		    // protect it against concurrent write operations. 
-		    // Moreover, the 32 bit load operation for reading 
-		    // variable localtime is atomic on ARM Cortex M0. Thus, we 
-		    // do not need to protect this load operation against 
-		    // concurrent updates by disabling interrupts.
-		    door_bell_alarm_time = localtime;
-		    if (is_client_subscribed) {
-			 notify_door_bell_alarm();	 
-		    } else {
-			 set_door_bell_alarm_char();
-		    }
-		    is_alarm_inhibited = true;
-		    start_alarm_inhibit_timer();
-	       }
-	       is_door_bell_alarm = false;
+
+#if FEATURE_HEARTBEAT
+	  if (is_localtime_updated || is_heartbeat_requested) {
+	       is_heartbeat_requested = false;
+	       send_heartbeat();
 	  }
+#endif
+
+#if FEATURE_CONFIG
+	  if (is_config_written && !is_config_store_pending) {
+	       // A bonded client has written a new configuration. If the
+	       // previous one is still being stored, it is applied after the
+	       // storage event has woken up the main loop.
+	       change_config();
+	  }
+#endif
+
+#if FEATURE_ENERGY_LEDGER
+	  account_wakeup(wakeup_source, wakeup_start);
+#endif
      }
 }
@@ -0,0 +1,133 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Lock-free single-producer/single-consumer event queue.
+//
+// Interrupt handlers (producer) push events to the queue, and the main
+// loop (consumer) pops them. The producer only writes the head index, and
+// the consumer only writes the tail index, so no locks are needed as long 
+// as there is only a single producer context. All producers of DoorBell20 
+// are app timer handlers and the GPIOTE handler of the inputs, which are 
+// executed at the same interrupt priority (APP_IRQ_PRIORITY_LOW) and 
+// cannot preempt each other.
+//
+// Indices are free-running 8 bit counters. Since the queue size is a power 
+// of two dividing 256, the number of queued events is always head - tail 
+// (modulo 256).
+
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <nrf.h>
+
+// Number of events that can be queued. Must be a power of two <= 128.
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE 16
+#endif
+
+#if (EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1)) != 0 || EVENT_QUEUE_SIZE > 128
+#error "EVENT_QUEUE_SIZE must be a power of two <= 128"
+#endif
+
+enum event_type {
+     // The door bell has been pressed (debounced).
+     EVENT_DOOR_BELL,
+     // The local time clock has ticked.
+     EVENT_LOCALTIME,
+     // The capture of a ring pattern has been completed.
+     EVENT_RING_PATTERN,
+     // The confirmation of an indicated door bell alarm has timed out.
+     EVENT_INDICATION_TIMEOUT,
+     // First edge of an idle input (arg: input index).
+     EVENT_EARLY_RING,
+     // Debouncing of an early ring did not detect a press (arg: input 
+     // index).
+     EVENT_EARLY_RING_CANCEL,
+     // The fast advertising after an alarm of a broadcast-only device is 
+     // over.
+     EVENT_BROADCAST_BURST_END
+};
+
+struct event {
+     // See enum event_type.
+     uint8_t type;
+     // Event-specific argument.
+     uint8_t arg;
+     // Local time [s] when the event was created (in interrupt context).
+     uint32_t localtime;
+     // Milliseconds of local time when the event was created (0-999).
+     uint16_t localtime_ms;
+     // RTC1 counter when the event was created (in interrupt context).
+     uint32_t rtc_ticks;
+};
+
+struct event_queue {
+     // Index of the next free slot. Only written by the producer.
+     volatile uint8_t head;
+     // Index of the oldest event. Only written by the consumer.
+     volatile uint8_t tail;
+     // Number of events that could not be queued because the queue was 
+     // full. Only written by the producer.
+     volatile uint8_t overflows;
+     struct event events[EVENT_QUEUE_SIZE];
+};
+
+// Adds an event to the queue. Must only be called from the producer 
+// context. Returns false if the queue is full.
+static inline bool event_queue_push(struct event_queue *queue, 
+				    const struct event *event)
+{
+     uint8_t head = queue->head;
+
+     if ((uint8_t) (head - queue->tail) == EVENT_QUEUE_SIZE) {
+	  queue->overflows++;
+	  return false;
+     }
+
+     queue->events[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+     // The event must be completely written before it is published by 
+     // incrementing the head index.
+     __DMB();
+     queue->head = head + 1;
+
+     return true;
+}
+
+// Removes the oldest event from the queue. Must only be called from the 
+// consumer context. Returns false if the queue is empty.
+static inline bool event_queue_pop(struct event_queue *queue, 
+				   struct event *event)
+{
+     uint8_t tail = queue->tail;
+
+     if (tail == queue->head)
+	  return false;
+
+     // Read the event only after having seen the published head index.
+     __DMB();
+     *event = queue->events[tail & (EVENT_QUEUE_SIZE - 1)];
+     // The event must be completely read before the slot is released.
+     __DMB();
+     queue->tail = tail + 1;
+
+     return true;
+}
+
+#endif // EVENT_QUEUE_H
@@ -0,0 +1,87 @@
+/**
+ * This file is part of DoorBell20.
+ *
+ * Copyright 2016 Frank Duerr
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Platform-specific configuration of the pstorage module of the nRF51 SDK.
+// pstorage is used by the device manager to store bonds and by the 
+// application to store its configuration.
+
+#ifndef PSTORAGE_PL_H__
+#define PSTORAGE_PL_H__
+
+#include <stdint.h>
+#include <nrf.h>
+
+static __INLINE uint16_t pstorage_flash_page_size()
+{
+     return (uint16_t) NRF_FICR->CODEPAGESIZE;
+}
+
+// Size of one flash page.
+#define PSTORAGE_FLASH_PAGE_SIZE pstorage_flash_page_size()
+// Value of erased flash.
+#define PSTORAGE_FLASH_EMPTY_MASK 0xFFFFFFFF
+
+// DoorBell20 does not use a bootloader, but we stay below it if one is
+// installed.
+#define BOOTLOADER_ADDRESS (NRF_UICR->BOOTLOADERADDR)
+
+static __INLINE uint32_t pstorage_flash_page_end()
+{
+     uint32_t bootloader_addr = BOOTLOADER_ADDRESS;
+  
+     return ((bootloader_addr != PSTORAGE_FLASH_EMPTY_MASK) ?
+	     (bootloader_addr / PSTORAGE_FLASH_PAGE_SIZE) : 
+	     NRF_FICR->CODESIZE);
+}
+
+#define PSTORAGE_FLASH_PAGE_END pstorage_flash_page_end()
+
+// Number of flash pages used by pstorage (excluding the swap page): 
+// one page for the bonds stored by the device manager and one page for
+// the configuration block of the application.
+#define PSTORAGE_NUM_OF_PAGES 2
+// Persistent data is stored at the end of the flash memory right in front
+// of the swap page.
+#define PSTORAGE_DATA_START_ADDR ((PSTORAGE_FLASH_PAGE_END - \
+				  PSTORAGE_NUM_OF_PAGES - 1) * \
+				  PSTORAGE_FLASH_PAGE_SIZE)
+#define PSTORAGE_DATA_END_ADDR ((PSTORAGE_FLASH_PAGE_END - 1) * \
+				PSTORAGE_FLASH_PAGE_SIZE)
+#define PSTORAGE_SWAP_ADDR PSTORAGE_DATA_END_ADDR
+
+#define PSTORAGE_MAX_BLOCK_SIZE PSTORAGE_FLASH_PAGE_SIZE
+#define PSTORAGE_MIN_BLOCK_SIZE 0x0010
+// Device manager and application.
+#define PSTORAGE_MAX_APPLICATIONS 2
+// Maximum number of pending flash operations.
+#define PSTORAGE_CMD_QUEUE_SIZE 10
+
+typedef uint32_t pstorage_block_t;
+
+typedef struct
+{
+     uint32_t module_id;
+     pstorage_block_t block_id;
+} pstorage_handle_t;
+
+typedef uint16_t pstorage_size_t;
+
+// Clear whole block.
+#define PSTORAGE_CLEAR_OP_CODE 0x7E
+
+#endif // PSTORAGE_PL_H__